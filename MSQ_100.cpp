@@ -13,9 +13,14 @@
 //#include <iomanip>
 #include <string.h>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
 
 #include "AppConfig.h"
 #include "MSQ_100.h"
+#include "MSQ_Q1.h"
+#include "MSQ_Transcode.h"
 #include "juce_MathsFunctions.h"
 
 
@@ -99,6 +104,13 @@ typedef union
 
 
 
+//
+// SysEx blocks per decode thread, smaller dumps decode on the calling thread.
+// A block decodes in about 1 us and a thread costs about 18 us to start and
+// join, so only a full dump gains from a second thread, by about a quarter
+#define Q1_BLKS_PER_THREAD  64
+
+
 //
 static const unsigned char msq_fcb_header[] =
 {
@@ -113,18 +125,44 @@ static const unsigned char msq_fcb_header[] =
 
 MSQ_100_SysEx::MSQ_100_SysEx()
 {
-    valid_Q1_data = FALSE;
+    ctx = new msq_conv_ctx;
+    own_ctx = TRUE;
+    msq_conv_init(ctx);
+    raw_sysex = FALSE;
+    standard_midi = FALSE;
+    perf_count = 0;
+}
+
+
+// works on the caller's context, allocates nothing itself
+MSQ_100_SysEx::MSQ_100_SysEx(msq_conv_ctx& call_ctx)
+{
+    ctx = &call_ctx;
+    own_ctx = FALSE;
+    msq_conv_init(ctx);
     raw_sysex = FALSE;
     standard_midi = FALSE;
-    num_syx_blks = 0;
-    q1_data_size = 0;
-    full_q1_data = new uint8_t[128*256];
+    perf_count = 0;
 }
 
 
 MSQ_100_SysEx::~MSQ_100_SysEx()
 {
-    delete full_q1_data;
+    if (own_ctx) delete ctx;
+}
+
+
+void msq_conv_init(msq_conv_ctx* ctx)
+{
+    ctx->valid_Q1_data = FALSE;
+    ctx->filt_opts = FILTER_OPT_CLEAR;
+    ctx->num_syx_blks = 0;
+    ctx->q1_data_size = 0;
+    ctx->q1_base_size = 0;
+    ctx->num_bars = 0;
+    ctx->syx_frames_size = 0;
+    std::memset(&ctx->stats, 0, sizeof(ctx->stats));
+    std::memset(&ctx->salvage, 0, sizeof(ctx->salvage));
 }
 
 
@@ -137,31 +175,343 @@ bool MSQ_100_SysEx::isRawSysEx()
 // check is we have MSQ SysEx data
 bool MSQ_100_SysEx::validate_MSQ()
 {
-    valid_Q1_data = FALSE;
+    ctx->valid_Q1_data = FALSE;
     
-    return valid_Q1_data;
+    return ctx->valid_Q1_data;
 }
 
 
 // validated MSQ-100 Q1 Sequencer data
 bool MSQ_100_SysEx::is_MSQ_100()
 {
-    return(valid_Q1_data);
+    return(ctx->valid_Q1_data);
+}
+
+
+int MSQ_100_SysEx::get_Q1_data_size()
+{
+    return (ctx->q1_data_size);
+}
+
+
+int MSQ_100_SysEx::get_num_syx_blks()
+{
+    return (ctx->num_syx_blks);
+}
+
+
+int MSQ_100_SysEx::get_Q1_base_size()
+{
+    return (ctx->q1_base_size);
+}
+
+
+int MSQ_100_SysEx::get_num_bars()
+{
+    return (ctx->num_bars);
+}
+
+
+const msq_conv_stats& MSQ_100_SysEx::get_stats()
+{
+    return (ctx->stats);
+}
+
+
+void MSQ_100_SysEx::set_perf_count(MSQ_PerfCount* perf)
+{
+    perf_count = perf;
+}
+
+
+const q1_salvage_report& MSQ_100_SysEx::get_salvage_report()
+{
+    return (ctx->salvage);
+}
+
+
+const uint8_t* MSQ_100_SysEx::get_Q1_data()
+{
+    return (ctx->q1_data);
+}
+
+
+// counts the bytes of each SysEx block as they go over the wire
+int MSQ_100_SysEx::get_SysEx_size()
+{
+    int syx_size = 0;
+    
+    if ( getNumTracks() > 0 )
+    {
+        const juce::MidiMessageSequence& msyx = *tracks.getUnchecked (0);
+        
+        for (int m_id = 0; m_id < msyx.getNumEvents(); m_id++)
+        {
+            const juce::MidiMessage& mm = msyx.getEventPointer(m_id)->message;
+            if ( mm.isSysEx() )
+                syx_size += mm.getRawDataSize();
+        }
+    }
+    
+    return (syx_size);
+}
+
+
+//  Time to upload the SysEx blocks over a MIDI link, in milliseconds
+//  blk_delay_ms is the pause the device needs after each block
+//
+double MSQ_100_SysEx::get_transfer_time(double blk_delay_ms)
+{
+    const double byte_time_ms = (1000.0 * MIDI_BITS_PER_BYTE) / MIDI_BAUD_RATE;  // 0.32 ms
+    int num_blks = 0;
+    
+    if ( getNumTracks() > 0 )
+        num_blks = tracks.getUnchecked (0)->getNumEvents();
+    
+    return (get_SysEx_size() * byte_time_ms + num_blks * blk_delay_ms);
+}
+
+
+
+// bytes of a variable length quantity, values below 2^28
+static inline int smf_var_len_size(uint32_t value)
+{
+    return 1 + (value >= 0x80) + (value >= 0x4000) + (value >= 0x200000);
+}
+
+
+//  Writes all four bytes of the spread out value and advances by the
+//  size only, the destination needs 3 bytes to spare at the very end
+//
+static inline int write_smf_var_len(uint8_t* dest, uint32_t value)
+{
+    const int n = smf_var_len_size(value);
+    const uint32_t packed = (value & 0x7F) | ((value << 1) & 0x7F00) | ((value << 2) & 0x7F0000)
+                            | ((value << 3) & 0x7F000000) | 0x80808000;
+    const uint32_t msb_first = packed << (8 * (4 - n));
+    
+    dest[0] = (uint8_t)(msb_first >> 24);
+    dest[1] = (uint8_t)(msb_first >> 16);
+    dest[2] = (uint8_t)(msb_first >> 8);
+    dest[3] = (uint8_t) msb_first;
+    
+    return (n);
+}
+
+
+//  Serializes one track's events, without the MTrk header, into dest
+//  or only counts the bytes when dest is 0.  Note offs with velocity 0
+//  go out as 0x9n so the note stream keeps running status.
+//
+int MSQ_100_SysEx::write_smf_track(int trk_num, uint8_t* dest)
+{
+    const juce::MidiMessageSequence& ms = *tracks.getUnchecked (trk_num);
+    uint8_t lastStatusByte = 0;
+    int lastTick = 0;
+    int k = 0;
+    
+    for (int j = 0; j < ms.getNumEvents(); j++)
+    {
+        const juce::MidiMessage& mm = ms.getEventPointer(j)->message;
+        
+        if (mm.isEndOfTrackMetaEvent()) continue;
+        
+        const int tick = juce::roundToInt (mm.getTimeStamp());
+        const uint32_t delta = (uint32_t) juce::jmax (0, tick - lastTick);
+        lastTick = tick;
+        
+        const uint8_t* data = mm.getRawData();
+        int dataSize = mm.getRawDataSize();
+        uint8_t statusByte = data[0];
+        
+        if ( ((statusByte & 0xF0) == 0x80) && (dataSize == 3) && (data[2] == 0) )
+            statusByte |= 0x10;
+        
+        if (dest)
+            k += write_smf_var_len(&dest[k], delta);
+        else
+            k += smf_var_len_size(delta);
+        
+        if ( (statusByte == lastStatusByte) && ((statusByte & 0xF0) != 0xF0) && (dataSize > 1) )
+        {
+            // running status
+            ++data;
+            --dataSize;
+        }
+        else
+        {
+            if (dest) dest[k] = statusByte;
+            ++k;
+            ++data;
+            --dataSize;
+            
+            if (statusByte == 0xF0)
+            {
+                // SysEx gets its length
+                if (dest)
+                    k += write_smf_var_len(&dest[k], (uint32_t) dataSize);
+                else
+                    k += smf_var_len_size((uint32_t) dataSize);
+            }
+        }
+        
+        if (dest) std::memcpy(&dest[k], data, dataSize);
+        k += dataSize;
+        
+        lastStatusByte = statusByte;
+    }
+    
+    // end of track
+    if (dest)
+    {
+        dest[k] = 0x00;
+        dest[k + 1] = 0xFF;
+        dest[k + 2] = 0x2F;
+        dest[k + 3] = 0x00;
+    }
+    k += 4;
+    
+    return (k);
+}
+
+
+//  Writes the SMF with one write from a buffer sized exactly up front,
+//  Format 0 for the single track msq_syx_to_smf leaves
+//
+bool MSQ_100_SysEx::write_smf(juce::OutputStream& out)
+{
+    const int num_trks = getNumTracks();
+    size_t file_size = 14;
+    
+    int* trk_size = new int[num_trks + 1];
+    for (int t = 0; t < num_trks; t++)
+    {
+        trk_size[t] = write_smf_track(t, 0);
+        file_size += 8 + trk_size[t];
+    }
+    
+    // spare bytes for write_smf_var_len
+    uint8_t* smf_data = new uint8_t[file_size + 4];
+    uint8_t* p = smf_data;
+    
+    const uint8_t smf_hdr[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, (uint8_t)((num_trks > 1) ? 1 : 0),
+                                (uint8_t)(num_trks >> 8), (uint8_t) num_trks,
+                                (uint8_t)(timeFormat >> 8), (uint8_t) timeFormat };
+    std::memcpy(p, smf_hdr, sizeof(smf_hdr));
+    p += sizeof(smf_hdr);
+    
+    for (int t = 0; t < num_trks; t++)
+    {
+        const uint8_t mtrk_hdr[] = { 'M', 'T', 'r', 'k', (uint8_t)(trk_size[t] >> 24), (uint8_t)(trk_size[t] >> 16),
+                                     (uint8_t)(trk_size[t] >> 8), (uint8_t) trk_size[t] };
+        std::memcpy(p, mtrk_hdr, sizeof(mtrk_hdr));
+        p += sizeof(mtrk_hdr);
+        
+        p += write_smf_track(t, p);
+    }
+    
+    const bool written = out.write(smf_data, file_size);
+    
+    delete[] smf_data;
+    delete[] trk_size;
+    
+    return (written);
+}
+
+
+//  Sends the blocks smf_to_msq_syx framed, in a single write.  With no
+//  frames from it, or the track changed since, falls back to write_RawSysEx
+//
+bool MSQ_100_SysEx::write_syx(juce::OutputStream& out)
+{
+    if ( (ctx->syx_frames_size == 0) || (getNumTracks() != 1) || (get_SysEx_size() != ctx->syx_frames_size) )
+    {
+        write_RawSysEx(out);
+        return TRUE;
+    }
+    
+    const bool written = out.write(ctx->syx_frames, (size_t) ctx->syx_frames_size);
+    out.flush();
+    
+    return (written);
+}
+
+
+//  The encoder's view of a track: each time rounded to whole ticks,
+//  this once, and only the bytes it looks at
+//
+static void flatten_track(const juce::MidiMessageSequence& m_seq, std::vector<msq_tick_event>& events)
+{
+    events.resize(m_seq.getNumEvents());
+    
+    for (int j = 0; j < m_seq.getNumEvents(); j++)
+    {
+        const juce::MidiMessage& mm = m_seq.getEventPointer(j)->message;
+        const uint8_t* data = mm.getRawData();
+        const int dataSize = mm.getRawDataSize();
+        msq_tick_event& ev = events[j];
+        
+        ev.tick = juce::roundToInt (mm.getTimeStamp());
+        ev.status = data[0];
+        ev.data1 = (dataSize > 1) ? data[1] : 0;
+        ev.data2 = (dataSize > 2) ? data[2] : 0;
+        ev.data3 = 0;
+        
+        if ( mm.isTimeSignatureMetaEvent() )
+        {
+            int numerator, denominator;
+            mm.getTimeSignatureInfo (numerator, denominator);
+            
+            ev.data2 = (uint8_t) numerator;
+            while ( (ev.data3 < 31) && ((1 << ev.data3) < denominator) )
+                ev.data3++;
+        }
+    }
+}
+
+
+static inline bool is_meta_event(const msq_tick_event& ev, uint8_t type)
+{
+    return ( (ev.status == 0xFF) && (ev.data1 == type) );
+}
+
+
+static inline bool is_note_off(const msq_tick_event& ev)
+{
+    return ( ((ev.status & 0xF0) == 0x80) || (((ev.status & 0xF0) == 0x90) && (ev.data2 == 0)) );
 }
 
 
+// first of the (sorted) time signatures at tick or after
+static int next_time_sig(const std::vector<msq_tick_event>& time_sigs, int tick)
+{
+    int lo = 0;
+    int hi = (int) time_sigs.size();
+    
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (time_sigs[mid].tick < tick)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return (lo);
+}
+
 
 // Results in data stored in one track sequence
 int MSQ_100_SysEx::smf_to_msq_syx(int track_num, uint32_t filters)
 {
-    uint8_t cksum;
-    int encoded_blk_size, i;
-    uint8_t* temp_msg_data;
+    int i = 0;
     
-    filt_opts = filters;
+    if (perf_count) perf_count->begin(MSQ_STAGE_FILTER);
     
-    temp_msg_data = new uint8_t[256];
-    i = 0;
+    ctx->filt_opts = filters;
+    build_tempo_map();
+    ctx->syx_frames_size = 0;
+    std::memset(&ctx->stats, 0, sizeof(ctx->stats));
     
     
     if ((track_num == 0) && (getNumTracks() > 1) )
@@ -184,7 +534,9 @@ int MSQ_100_SysEx::smf_to_msq_syx(int track_num, uint32_t filters)
             if ( mtps.getEndTime() < end_zeit ) continue;
             
             
+            const int num_before = mtps.getNumEvents();
             mtps.deleteSysExMessages();
+            ctx->stats.num_sysex += (uint32_t)(num_before - mtps.getNumEvents());
             mt.addSequence(mtps, 0, 0, end_zeit);
             mt.updateMatchedPairs();
         }
@@ -201,188 +553,404 @@ int MSQ_100_SysEx::smf_to_msq_syx(int track_num, uint32_t filters)
         //ms.getTrack(1);
 
         // delete any SysEx in track
+        int num_before = ms.getNumEvents();
         ms.deleteSysExMessages();
+        ctx->stats.num_sysex += (uint32_t)(num_before - ms.getNumEvents());
 
-        if ( filt_opts & FILTER_OPT_CHNMUTE )
+        num_before = ms.getNumEvents();
+        if ( ctx->filt_opts & FILTER_OPT_CHNMUTE )
         {
             // mute MIDI channel
-            ms.deleteMidiChannelMessages( filt_opts & FILTER_CHAN_MASK );
+            ms.deleteMidiChannelMessages( ctx->filt_opts & FILTER_CHAN_MASK );
         }
-        else if ( filt_opts & FILTER_OPT_CHNSOLO )
+        else if ( ctx->filt_opts & FILTER_OPT_CHNSOLO )
         {
             // isolate MIDI channel
             juce::MidiMessageSequence mswp = juce::MidiMessageSequence();
-            ms.extractMidiChannelMessages(filt_opts & FILTER_CHAN_MASK, mswp, TRUE);
+            ms.extractMidiChannelMessages(ctx->filt_opts & FILTER_CHAN_MASK, mswp, TRUE);
             ms.swapWith(mswp);
         }
+        ctx->stats.num_channel = (uint32_t)(num_before - ms.getNumEvents());
         
         ms.updateMatchedPairs();
-
-        q1_data_size = convert_to_Q1_data(ms);
-
-        // clear the file
-        clear();
-        standard_midi = FALSE;
-        timeFormat = (short)120;
         
-        juce::MidiMessageSequence msyx = juce::MidiMessageSequence();
-
-        for (int m_id = 0; m_id < num_syx_blks; m_id++)
+        // whole ticks from here on
+        if (perf_count) perf_count->begin(MSQ_STAGE_FLATTEN);
+        std::vector<msq_tick_event> events;
+        std::vector<msq_tick_event> time_sigs;
+        flatten_track(ms, events);
         {
-            int k = 0;
-            temp_msg_data[k++] = 0xF0;   // SysEx start
-            temp_msg_data[k++] = 0x41;
-            temp_msg_data[k++] = 0x57;
-            temp_msg_data[k++] = 0x70;
-
-            // build up a new message block
-            temp_msg_data[k++] = (uint8_t)m_id;
-
-            // encode
-            encoded_blk_size = encode_7_8_bytes(&temp_msg_data[k],
-                                                &full_q1_data[i], 217);
-            i += decode_8_7_size( encoded_blk_size );
-                                                  
-            cksum = byte_checksum(&temp_msg_data[k], encoded_blk_size);
-            
-            k += encoded_blk_size;
-            temp_msg_data[k++] = cksum;
-            temp_msg_data[k++] = 0xF7;   // SysEx end
-
-            // Creates a midi message from a block of data.
-            // use block number as timestamp
-            juce::MidiMessage mm = juce::MidiMessage (temp_msg_data, k, (double)m_id);
-            msyx.addEvent(mm);
+            juce::MidiMessageSequence sig_all = juce::MidiMessageSequence();
+            findAllTimeSigEvents(sig_all);
+            flatten_track(sig_all, time_sigs);
         }
-        addTrack (msyx);
+        
+        if (perf_count) perf_count->begin(MSQ_STAGE_ENCODE);
+        encode_Q1_track(events, time_sigs, filters);
     }
     else
     {
         //  error
     }
-
-    delete temp_msg_data;
+    
+    if (perf_count) perf_count->end();
 
     return (getNumTracks());
 }
 
 
-// SysEx should initially be stored in one track sequence of SysEx messages
-void MSQ_100_SysEx::msq_syx_to_smf(uint32_t filters)
+bool MSQ_100_SysEx::raw_to_msq_syx(MSQ_RawMidi& raw, double bpm, uint32_t filters)
 {
-    uint8_t cksum;
-    int decoded_blk_size;
-    const uint8_t* syx_msg_data;
-
-    int syx_msg_size = 0;
-    int i = 0;
+    std::vector<msq_tick_event> events;
+    std::vector<msq_tick_event> time_sigs;
+    q1_event rev;
+    uint32_t num_over = 0;
+    uint8_t num_on[16 * 128];   // sounding, by channel and key
     
-    num_syx_blks = 0;
-    q1_data_size = 0;
-    valid_Q1_data = FALSE;
-    raw_sysex = TRUE;
-    filt_opts = filters;
+    std::memset(num_on, 0, sizeof(num_on));
     
-    uint8_t* temp_data = new uint8_t[256];
+    ctx->filt_opts = filters;
+    ctx->syx_frames_size = 0;
+    std::memset(&ctx->stats, 0, sizeof(ctx->stats));
     
-    if ( getNumTracks() > 0 )
+    // the capture's one tempo
+    tempo_map.clear(120);
+    tempo_map.add_tempo(0, juce::roundToInt (60000000.0 / bpm));
+    
+    // the encoder takes the track's first event for its time signature,
+    // a capture has none, so 4/4 as the MSQ-100 starts out
+    const msq_tick_event sig_4_4 = { 0, 0xFF, 0x58, 4, 2 };
+    time_sigs.push_back(sig_4_4);
+    events.push_back(sig_4_4);
+    
+    while ( raw.next_event(&rev) )
     {
-        juce::MidiMessageSequence& msyx = *tracks.getUnchecked (0);
+        const int chan = (rev.status & 0x0F) + 1;
         
-        for (int m_id = 0; m_id < msyx.getNumEvents(); m_id++)
+        if ( ((ctx->filt_opts & FILTER_OPT_CHNMUTE) && (chan == (int)(ctx->filt_opts & FILTER_CHAN_MASK))) ||
+             ((ctx->filt_opts & FILTER_OPT_CHNSOLO) && (chan != (int)(ctx->filt_opts & FILTER_CHAN_MASK))) )
         {
-            int k = 0;
-            
-            // if m_di < getNumEvents()
-            juce::MidiMessage& mm = msyx.getEventPointer(m_id)->message;
-            syx_msg_size = mm.getRawDataSize();
-            syx_msg_data = mm.getRawData();
-    
-            //memccpy(raw_msg_data, syx_msg_data, syx_msg_size, sizeof(uint8_t));
-            
-            // validate message header
-            if ( *(syx_msg_data++) != (uint8_t) 0xF0 ) break;
-            if ( *(syx_msg_data++) != (uint8_t) 0x41 ) break;
-            if ( *(syx_msg_data++) != (uint8_t) 0x57 ) break;
-            if ( *(syx_msg_data++) != (uint8_t) 0x70 ) break;
-            if ( *(syx_msg_data++) != (uint8_t) m_id ) break;
-    
-            // decode
-            k = syx_msg_size - 7;
-            decoded_blk_size = decode_8_7_bytes(temp_data,
-                                                (uint8_t *)syx_msg_data, k);
-            
-            int j = 4;
-            while ( (temp_data[j] != 0xFE) && (j < decoded_blk_size) )
-            {
-                full_q1_data[i++] = temp_data[j++];
-            }
-            q1_data_size += (j-4);
-            
-            cksum = byte_checksum((uint8_t *)syx_msg_data, k);
-            
-            // validate message end
-            syx_msg_data += k;
-            if( *(syx_msg_data++) != cksum ) break;
-            if( *(syx_msg_data++) != (uint8_t ) 0xF7) break;   // SysEx end
-            num_syx_blks++;
-
+            ctx->stats.num_channel++;
+            continue;
         }
         
+        msq_tick_event ev = { rev.tick, rev.status, rev.data1, rev.data2, 0 };
         
-        if (num_syx_blks)
+        // left out here, so the cap counts only events that are encoded
+        if ( const uint32_t filter = is_filtered(ev) )
         {
-            valid_Q1_data = TRUE;
-            //Q1 data block chunks must be decoded and concatenated
-            //  prior to calling this
-            
-            juce::MidiMessageSequence m_std = juce::MidiMessageSequence();
-            parse_Q1_data(m_std);
-            
-            clear();
-            timeFormat = 120;
-            m_std.updateMatchedPairs();
-            addTrack(m_std);
+            count_filtered(filter);
+            continue;
+        }
+        
+        uint8_t& on = num_on[((rev.status & 0x0F) << 7) | (rev.data1 & 0x7F)];
+        const bool note_on = ((rev.status & 0xF0) == 0x90) && !is_note_off(ev);
+        
+        if ( events.size() > MSQ_RAW_MAX_EVENTS )
+        {
+            // already past what fits, only the note offs of notes kept
+            // sounding still go in, the rest is counted
+            if ( is_note_off(ev) && on )
+            {
+                on--;
+                events.push_back(ev);
+            }
+            else if ( !is_note_off(ev) )
+                num_over++;
+            continue;
         }
+        
+        if ( note_on && (on < 0xFF) )
+            on++;
+        else if ( is_note_off(ev) && on )
+            on--;
+        
+        events.push_back(ev);
+    }
+    
+    ctx->stats.num_sysex = raw.get_stats().num_sysex;
+    
+    if ( events.size() == 1 )
+    {
+        ctx->valid_Q1_data = FALSE;
+        return FALSE;
     }
     
-    delete temp_data;
+    // the encoder completes the last measure on the track end
+    msq_tick_event trk_end = { events.back().tick, 0xFF, 0x2F, 0, 0 };
+    events.push_back(trk_end);
+    
+    encode_Q1_track(events, time_sigs, filters);
+    ctx->stats.num_cut += num_over;
+    
+    return TRUE;
 }
 
 
-// inserts Q1 block break code, updates current block size
-int MSQ_100_SysEx::insert_Q1_block_break(uint8_t* q_ptr, int* curr_blk_size, bool track_end)
+//  Encodes the events, optimized if filters say so, and replaces the
+//  file with the SysEx blocks of the Q1 data
+//
+void MSQ_100_SysEx::encode_Q1_track(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs,
+                                    uint32_t filters)
 {
     int i = 0;
     
-    q_ptr[i++] = 0xFE;   // block break;
-    (*curr_blk_size)++;
-    
-    if( ((*curr_blk_size & 0x01) != 0) && ((*curr_blk_size / 7) != 1) && !track_end )
+    if ( ctx->filt_opts & ENCODE_OPT_OPTIMIZE )
     {
-        // want even number of bytes
-        q_ptr[i++] = 0xFE;   // extra break byte;
-        (*curr_blk_size)++;
+        // encode as-is first, for the bytes saved report
+        std::vector<msq_tick_event> opt_events (events);
+
+        ctx->filt_opts &= ~ENCODE_OPT_OPTIMIZE;
+        ctx->q1_base_size = convert_to_Q1_data(events, time_sigs);
+        ctx->filt_opts = filters;
+
+        optimize_Q1_order(opt_events, time_sigs);
+        ctx->q1_data_size = convert_to_Q1_data(opt_events, time_sigs);
+
+        if (ctx->q1_data_size > ctx->q1_base_size)
+        {
+            // block padding can occasionally eat the savings
+            ctx->filt_opts &= ~ENCODE_OPT_OPTIMIZE;
+            ctx->q1_data_size = convert_to_Q1_data(events, time_sigs);
+            ctx->filt_opts = filters;
+        }
+    }
+    else
+    {
+        ctx->q1_data_size = convert_to_Q1_data(events, time_sigs);
+        ctx->q1_base_size = ctx->q1_data_size;
     }
-    num_syx_blks++;
 
-    // also start the next block's header, unless this was the last one
-    if (!track_end)
+    if ( ctx->filt_opts & ENCODE_OPT_COUNT )
     {
-        q_ptr[i++] = 0xFD;
-        q_ptr[i++] = 'P';  // 0x50
-        q_ptr[i++] = 0x00;
-        q_ptr[i++] = 0x00;
+        // analysis only, no frames: the file and its tracks stay as they
+        // are, the Q1 data is left as decoding a dump of it would
+        ctx->q1_data_size = q1_strip_blocks(ctx->q1_data, ctx->q1_data_size,
+                                            juce::jmin (ctx->num_syx_blks, Q1_MAX_SYX_BLKS));
+        ctx->valid_Q1_data = FALSE;
+        return;
     }
     
-    return(i);
+    if (perf_count) perf_count->begin(MSQ_STAGE_FRAME);
+    
+    // clear the file
+    clear();
+    standard_midi = FALSE;
+    timeFormat = (short)120;
+    
+    // a reused ctx still holds the previous dump past the end, its
+    // end marks mustn't run on from ours
+    ctx->q1_data[ctx->q1_data_size] = 0x00;
+    
+    // filled in place, addTrack would copy every block again
+    juce::MidiMessageSequence* msyx = new juce::MidiMessageSequence();
+
+    for (int m_id = 0; (m_id < ctx->num_syx_blks) && (m_id < Q1_MAX_SYX_BLKS); m_id++)
+    {
+        int raw_used;
+        uint8_t* frame = &ctx->syx_frames[ctx->syx_frames_size];
+        
+        // framed, packed and summed in one go, write_syx sends these
+        const int frame_size = q1_emit_block(frame, m_id, &ctx->q1_data[i], 217, &raw_used);
+        i += raw_used;
+        ctx->syx_frames_size += frame_size;
+
+        // the track keeps the blocks for everything else, block number as timestamp
+        msyx->addEvent(juce::MidiMessage (frame, frame_size, (double)m_id));
+    }
+    
+    tracks.add(msyx);
 }
 
 
-// will break down time delta, updates current block size
-int MSQ_100_SysEx::insert_Q1_delta(uint8_t* q_ptr, int m_delta, int to_meas_end, int* ticks_this_meas, int* blk_count)
+// SysEx should initially be stored in one track sequence of SysEx messages
+void MSQ_100_SysEx::msq_syx_to_smf(uint32_t filters)
 {
-    int i = 0;
+    ctx->syx_frames_size = 0;
+
+    ctx->num_syx_blks = 0;
+    ctx->q1_data_size = 0;
+    ctx->valid_Q1_data = FALSE;
+    raw_sysex = TRUE;
+    ctx->filt_opts = filters;
+    
+    if ( getNumTracks() > 0 )
+    {
+        juce::MidiMessageSequence& msyx = *tracks.getUnchecked (0);
+        
+        // message numbers only go to 127
+        const int num_msgs = juce::jmin (msyx.getNumEvents(), 128);
+        
+        uint8_t* blk_data = new uint8_t[(num_msgs + 1) * Q1_BLK_BUF_SIZE];
+        int* blk_size = new int[num_msgs + 1];
+        int* blk_status = new int[num_msgs + 1];
+        int* blk_offset = new int[num_msgs + 1];
+        int num_copy = 0;
+        
+        int num_threads = num_msgs / Q1_BLKS_PER_THREAD;
+        num_threads = juce::jmin (num_threads, (int) std::thread::hardware_concurrency());
+        
+        // decode and verify every block on its own
+        if (num_threads > 1)
+        {
+            std::vector<std::thread> workers;
+            for (int t = 0; t < num_threads; t++)
+                workers.push_back(std::thread(&MSQ_100_SysEx::decode_Q1_blocks, this, &msyx, t, num_threads,
+                                              num_msgs, blk_data, blk_size, blk_status));
+            for (int t = 0; t < num_threads; t++)
+                workers[t].join();
+        }
+        else
+        {
+            decode_Q1_blocks(&msyx, 0, 1, num_msgs, blk_data, blk_size, blk_status);
+        }
+        
+        // offsets into ctx->q1_data, up to the first bad block
+        // a block failing its checksum still has its data kept
+        for (int m_id = 0; m_id < num_msgs; m_id++)
+        {
+            if (blk_status[m_id] == Q1_BLK_BAD_HEADER) break;
+            
+            blk_offset[m_id] = ctx->q1_data_size;
+            ctx->q1_data_size += blk_size[m_id];
+            num_copy++;
+            
+            if (blk_status[m_id] != Q1_BLK_VALID) break;
+            ctx->num_syx_blks++;
+        }
+        
+        // concatenate
+        if (num_threads > 1)
+        {
+            std::vector<std::thread> workers;
+            for (int t = 0; t < num_threads; t++)
+                workers.push_back(std::thread(&MSQ_100_SysEx::copy_Q1_blocks, this, t, num_threads,
+                                              num_copy, blk_data, blk_size, blk_offset));
+            for (int t = 0; t < num_threads; t++)
+                workers[t].join();
+        }
+        else
+        {
+            copy_Q1_blocks(0, 1, num_copy, blk_data, blk_size, blk_offset);
+        }
+        
+        delete[] blk_data;
+        delete[] blk_size;
+        delete[] blk_status;
+        delete[] blk_offset;
+        
+        
+        make_Q1_track();
+    }
+}
+
+
+//  The frames are taken straight from the file data, read_RawSysEx
+//  would stop at the first one broken off
+//
+void MSQ_100_SysEx::salvage_syx_to_smf(const void* syx_data, size_t syx_size, uint32_t filters)
+{
+    int pos = 0;
+    
+    clear();
+    ctx->syx_frames_size = 0;
+    ctx->valid_Q1_data = FALSE;
+    raw_sysex = TRUE;
+    ctx->filt_opts = filters;
+    
+    ctx->q1_data_size = q1_salvage((const uint8_t*) syx_data, (int) syx_size, &pos, ctx->q1_data, &ctx->salvage);
+    ctx->num_syx_blks = ctx->salvage.num_blks;
+    
+    make_Q1_track();
+}
+
+
+// the decoded blocks in ctx->q1_data become the only track
+void MSQ_100_SysEx::make_Q1_track()
+{
+    if (ctx->num_syx_blks)
+    {
+        ctx->valid_Q1_data = TRUE;
+        //Q1 data block chunks must be decoded and concatenated
+        //  prior to calling this
+        
+        // parse_Q1_data pairs the notes, hand the sequence over
+        // as is, addTrack's copy would match them all over again
+        juce::MidiMessageSequence* m_std = new juce::MidiMessageSequence();
+        parse_Q1_data(*m_std);
+        
+        clear();
+        timeFormat = 120;
+        tracks.add(m_std);
+    }
+}
+
+
+//  Validates and decodes one SysEx block, see q1_decode_block
+//  Uses no member state.
+//
+int MSQ_100_SysEx::decode_Q1_block(const juce::MidiMessage& mm, int m_id, uint8_t* blk_data, int* payload_size)
+{
+    return q1_decode_block(mm.getRawData(), mm.getRawDataSize(), m_id, blk_data, payload_size);
+}
+
+
+// decodes blocks first, first + stride, ... into their own buffer slots
+void MSQ_100_SysEx::decode_Q1_blocks(const juce::MidiMessageSequence* msyx, int first, int stride, int num_blks,
+                                     uint8_t* blk_data, int* blk_size, int* blk_status)
+{
+    for (int m_id = first; m_id < num_blks; m_id += stride)
+    {
+        blk_status[m_id] = decode_Q1_block(msyx->getEventPointer(m_id)->message, m_id,
+                                           &blk_data[m_id * Q1_BLK_BUF_SIZE], &blk_size[m_id]);
+    }
+}
+
+
+// copies decoded block payloads to their offsets in ctx->q1_data
+void MSQ_100_SysEx::copy_Q1_blocks(int first, int stride, int num_blks,
+                                   const uint8_t* blk_data, const int* blk_size, const int* blk_offset)
+{
+    for (int m_id = first; m_id < num_blks; m_id += stride)
+    {
+        std::memcpy(&ctx->q1_data[blk_offset[m_id]], &blk_data[m_id * Q1_BLK_BUF_SIZE + 4], blk_size[m_id]);
+    }
+}
+
+
+// inserts Q1 block break code, updates current block size
+int MSQ_100_SysEx::insert_Q1_block_break(uint8_t* q_ptr, int* curr_blk_size, bool track_end)
+{
+    int i = 0;
+    
+    q_ptr[i++] = 0xFE;   // block break;
+    (*curr_blk_size)++;
+    
+    if( ((*curr_blk_size & 0x01) != 0) && ((*curr_blk_size / 7) != 1) && !track_end )
+    {
+        // want even number of bytes
+        q_ptr[i++] = 0xFE;   // extra break byte;
+        (*curr_blk_size)++;
+    }
+    ctx->num_syx_blks++;
+
+    // also start the next block's header, unless this was the last one
+    if (!track_end)
+    {
+        q_ptr[i++] = 0xFD;
+        q_ptr[i++] = 'P';  // 0x50
+        q_ptr[i++] = 0x00;
+        q_ptr[i++] = 0x00;
+    }
+    
+    return(i);
+}
+
+
+// will break down time delta, updates current block size
+int MSQ_100_SysEx::insert_Q1_delta(uint8_t* q_ptr, int m_delta, int to_meas_end, int* ticks_this_meas, int* blk_count)
+{
+    int i = 0;
     
     do
     {
@@ -427,7 +995,8 @@ int MSQ_100_SysEx::insert_Q1_delta(uint8_t* q_ptr, int m_delta, int to_meas_end,
 //  max total Q1 data = 26670 bytes
 //  makes calls to helper function insert insert_Q1_block_break
 //  
-int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
+int MSQ_100_SysEx::convert_to_Q1_data(const std::vector<msq_tick_event>& events,
+                                      const std::vector<msq_tick_event>& time_sigs)
 {
     q1_file_ctrl_block  *fcb;
     q1_phrase_block_hdr *fpd;
@@ -438,11 +1007,6 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
     bool sig_changed = FALSE;
     bool immediate_sig_chng = FALSE;
     
-    bool filt_prog_change = TRUE;
-    bool filt_contrls = TRUE;
-    bool filt_aftrtch = TRUE;
-    bool filt_ptchbnd = FALSE;
-    
     bool mtl_debug = FALSE;
     
     int i, j;
@@ -453,13 +1017,12 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
     int curr_meas_length = (480 / curr_t_sig_denominator) * curr_t_sig_numerator;
     //int msq_tempo = 100;      // MSQ's default
   
-    uint32_t midi_MPQN = (60000000 / 120);  // default
-    
     //int meas_ticks = 0;
     //int last_meas_t = 0;
     int lastTick = 0;
     int last_sig_change = -480;
     int ticks_this_measure = 0;
+    int bar_start;
     
     //uint8_t m_key_num;
     //uint8_t m_key_vel;
@@ -468,21 +1031,23 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
     bool running_stat = FALSE;
     
     
-    filt_prog_change = (bool)(filt_opts & FILTER_OPT_PRGCHNG);
-    filt_aftrtch = (bool)(filt_opts & FILTER_OPT_AFTRTCH);
-    filt_ptchbnd = (bool)(filt_opts & FILTER_OPT_PTCHBND);
-    filt_contrls = (bool)(filt_opts & FILTER_OPT_CCNTRLS);
-    //filt_contrls = FALSE;
-    
     // register uint8_t q_byte;  // for debugging purposes
     //m_seq.getNextIndexAtTime(double timeStamp);
     
     // First block is always the Q1 FCB (file Control Block)
     //blk_num = 0;
-    num_syx_blks = 0;
+    ctx->num_syx_blks = 0;
+    ctx->num_bars = 0;
     i = 0;
     curr_block_start = 0;
     
+    // counted again on each pass, SysEx and channel filtering happen before
+    const uint32_t num_sysex = ctx->stats.num_sysex;
+    const uint32_t num_channel = ctx->stats.num_channel;
+    std::memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.num_sysex = num_sysex;
+    ctx->stats.num_channel = num_channel;
+    
     // init, copy headers
     fcb = new q1_file_ctrl_block;
     fcb->field.header = 0xFD;
@@ -500,10 +1065,10 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
     fcb->field.EOB[1] = 0xFE;
     
     curr_block_size = sizeof(q1_file_ctrl_block);
-    std::memcpy(full_q1_data, fcb, curr_block_size);  //??
+    std::memcpy(ctx->q1_data, fcb, curr_block_size);  //??
     i = curr_block_size;
     delete fcb;
-    num_syx_blks++;
+    ctx->num_syx_blks++;
     
     fpd = new q1_phrase_block_hdr;
     fpd->field.header = 0xFD;
@@ -517,39 +1082,54 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
     curr_block_start = i;
     
     // each Q1 Phrase Block header is always 4 bytes
-    std::memcpy(&full_q1_data[i], fpd, sizeof(q1_phrase_block_hdr));
+    std::memcpy(&ctx->q1_data[i], fpd, sizeof(q1_phrase_block_hdr));
 
     i += sizeof(q1_phrase_block_hdr);
     delete fpd;
     
     // need to insert special fundtion at beginning of first phrase block
-    full_q1_data[i++] = 0x00;
-    full_q1_data[i++] = 0xFA;  // special function
-    full_q1_data[i++] = 0x01;
-    full_q1_data[i++] = 0x7F;  // switch to maintain Note On Velocity
+    ctx->q1_data[i++] = 0x00;
+    ctx->q1_data[i++] = 0xFA;  // special function
+    ctx->q1_data[i++] = 0x01;
+    ctx->q1_data[i++] = 0x7F;  // switch to maintain Note On Velocity
+    bar_start = i;
     
-    juce::MidiMessageSequence sig_chngs = juce::MidiMessageSequence();
-    findAllTimeSigEvents(sig_chngs);
+    std::vector<msq_tick_event> sig_chngs (time_sigs);
     
+    if ( ctx->filt_opts & ENCODE_OPT_OPTIMIZE )
+        prune_time_sigs(sig_chngs, time_sigs);
     
+    const int num_events = (int) events.size();
     j = 0;
     
-    // move through Midi Message Sequence for events to convert
-    while ( (j < m_seq.getNumEvents()) && !trk_end )
+    // move through the events to convert
+    while ( (j < num_events) && !trk_end )
     {
-        const juce::MidiMessage& mm = m_seq.getEventPointer(j++)->message;
+        const msq_tick_event& mm = events[j++];
         int delta;
         
-        if (mm.isEndOfTrackMetaEvent() || (num_syx_blks > 126))
+        if (is_meta_event(mm, 0x2F) || (ctx->num_syx_blks > 126))
         {
             trk_end = TRUE;
+            
+            if ( !is_meta_event(mm, 0x2F) )
+            {
+                // out of blocks, count what doesn't make it
+                for (int k = j - 1; k < num_events; k++)
+                {
+                    const msq_tick_event& mc = events[k];
+                    if ( (mc.status != 0xFF) && (mc.status != 0xF0) && !is_note_off(mc) && !is_filtered(mc) )
+                        ctx->stats.num_cut++;
+                }
+            }
         }
 
-        else if( mm.isMetaEvent() && !trk_end )
+        else if( (mm.status == 0xFF) && !trk_end )
         {
-            if ( mm.isTimeSignatureMetaEvent() )
+            if ( is_meta_event(mm, 0x58) )
             {
-                mm.getTimeSignatureInfo (curr_t_sig_numerator, curr_t_sig_denominator);
+                curr_t_sig_numerator = mm.data2;
+                curr_t_sig_denominator = 1 << mm.data3;
                 /*
                 if (ticks_this_measure == curr_meas_length)
                 {
@@ -561,7 +1141,7 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 //curr_meas_length = 120 * curr_t_sig_numerator;
                 // at measure end?
                 //if ( !sig_changed || ticks_this_measure )
-                if ( !sig_changed && (last_sig_change != juce::roundToInt (mm.getTimeStamp()) ) )
+                if ( !sig_changed && (last_sig_change != mm.tick) )
                 {                    
                     sig_change_request = TRUE;
                 }
@@ -572,11 +1152,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                     continue;
                 }
             }
-            else if ( mm.isTempoMetaEvent() )
+            else if ( is_meta_event(mm, 0x51) )
             {
-                midi_MPQN = mm.MidiMessage::getTempoMicroSecondsPerQuarterNote();
-                
-                // MSQ doesn't store tempo changes
+                // MSQ doesn't store tempo changes, see build_tempo_map
                 continue;
             }
             else
@@ -585,26 +1163,14 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 continue;
             }
         }
-        else if( (mm.isProgramChange() || mm.isControllerOfType(0x00)) && filt_prog_change )
-        {
-            continue;
-        }
-        else if ( (mm.isController() && !mm.isControllerOfType(0x01)) && filt_contrls )
-        {
-            continue;  // let's mod wheel pass
-        }
-        else if ( mm.isPitchWheel() && filt_ptchbnd )
-        {
-            continue;
-        }
-        else if ( (mm.isAftertouch() || mm.isChannelPressure()) && filt_aftrtch )
+        else if ( const uint32_t filter = is_filtered(mm) )
         {
+            count_filtered(filter);
             continue;
         }
         
-        const int tick = juce::roundToInt (mm.getTimeStamp());
-        delta = juce::jmax (0, tick - lastTick);
-        lastTick = tick;
+        delta = juce::jmax (0, mm.tick - lastTick);
+        lastTick = mm.tick;
         
         if ( (lastTick == -900) && mtl_debug )
         {
@@ -623,7 +1189,7 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             // break delta into muliple parts
             const int to_meas_end = curr_meas_length - ticks_this_measure;
 
-            if (mm.isNoteOff() && (delta == to_meas_end) && (delta < 240))
+            if (is_note_off(mm) && (delta == to_meas_end) && (delta < 240))
             {
                 // place Note Off messages before Measure Change
                 ticks_this_measure += delta;
@@ -632,8 +1198,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             else if ((delta >= to_meas_end) && (to_meas_end < 240))
             {
                 // insert measure end MPU message
-                full_q1_data[i++] = (uint8_t) to_meas_end;
-                full_q1_data[i++] = 0xF9;
+                ctx->q1_data[i++] = (uint8_t) to_meas_end;
+                ctx->q1_data[i++] = 0xF9;
+                count_bar(i, &bar_start);
                 
                 sig_changed = FALSE;
 
@@ -653,15 +1220,16 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 // check for signature change event at this time!
                 // change code MUST occur immediately after meausre end if so
                 // and before any note status
-                int si = sig_chngs.getNextIndexAtTime( lastTick - to_meas_end );
-                if (si != sig_chngs.getNumEvents())
+                const int si = next_time_sig(sig_chngs, lastTick - to_meas_end);
+                if (si != (int) sig_chngs.size())
                 {
-                    const juce::MidiMessage& msi = sig_chngs.getEventPointer(si)->message;
-                    if( ((lastTick - ticks_this_measure) == (int)msi.getTimeStamp()) && msi.isTimeSignatureMetaEvent() )
+                    const msq_tick_event& msi = sig_chngs[si];
+                    if( ((lastTick - ticks_this_measure) == msi.tick) && is_meta_event(msi, 0x58) )
                     {
-                        msi.getTimeSignatureInfo (curr_t_sig_numerator, curr_t_sig_denominator);
+                        curr_t_sig_numerator = msi.data2;
+                        curr_t_sig_denominator = 1 << msi.data3;
                         immediate_sig_chng = TRUE;
-                        last_sig_change = (int)msi.getTimeStamp();
+                        last_sig_change = msi.tick;
                         
                         if (mtl_debug) std::cout << " and " << curr_t_sig_numerator << "/" << curr_t_sig_denominator << " sig change";
                     }
@@ -671,7 +1239,7 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             else if (delta >= 240)
             {
                 // insert time overflow MPU messege
-                full_q1_data[i++] = 0xF8;
+                ctx->q1_data[i++] = 0xF8;
                 ticks_this_measure += 240;
                 
                 delta -= 240;
@@ -689,8 +1257,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             else if (sig_change_request && (ticks_this_measure % curr_meas_length))
             {
                 // insert measure end MPU message
-                full_q1_data[i++] = 0x00;
-                full_q1_data[i++] = 0xF9;
+                ctx->q1_data[i++] = 0x00;
+                ctx->q1_data[i++] = 0xF9;
+                count_bar(i, &bar_start);
                 
                 sig_changed = FALSE;
                 
@@ -714,16 +1283,16 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             curr_block_size = i - curr_block_start;
             if (curr_block_size >= 210)
             {
-                i += insert_Q1_block_break(&full_q1_data[i], &curr_block_size, FALSE);
+                i += insert_Q1_block_break(&ctx->q1_data[i], &curr_block_size, FALSE);
                 curr_block_size = 4;
                 curr_block_start = i-4;
             }
 
             if ( immediate_sig_chng )
             {
-                full_q1_data[i++] = 0x00;  // always zero
-                full_q1_data[i++] = 0xFA;  // special function
-                full_q1_data[i++] = 0x00;  // Beats Per Measure change
+                ctx->q1_data[i++] = 0x00;  // always zero
+                ctx->q1_data[i++] = 0xFA;  // special function
+                ctx->q1_data[i++] = 0x00;  // Beats Per Measure change
                 
                 // considered status change for MSQ-100
                 lastStatusByte = 0xFA;
@@ -746,9 +1315,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 }
                  
                 if ( (curr_t_sig_denominator == 4) && (curr_t_sig_numerator >= 1) &&  (curr_t_sig_numerator <= 8) )
-                    full_q1_data[i++] = (uint8_t) curr_t_sig_numerator;
+                    ctx->q1_data[i++] = (uint8_t) curr_t_sig_numerator;
                 else
-                    full_q1_data[i++] = 0x00;
+                    ctx->q1_data[i++] = 0x00;
                 
                 // curr_meas_length = 120 * curr_t_sig_numerator;
                 curr_meas_length = (480 / curr_t_sig_denominator) * curr_t_sig_numerator;
@@ -760,7 +1329,7 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 curr_block_size = i - curr_block_start;
                 if (curr_block_size >= 210)
                 {
-                    i += insert_Q1_block_break(&full_q1_data[i], &curr_block_size, FALSE);
+                    i += insert_Q1_block_break(&ctx->q1_data[i], &curr_block_size, FALSE);
                     curr_block_size = 4;
                     curr_block_start = i-4;
                 }
@@ -774,17 +1343,17 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
         if( trk_end )
         {
             // data end
-            full_q1_data[i++] = 0x00;
-            full_q1_data[i++] = 0xFC;  // Track End MPU mark
+            ctx->q1_data[i++] = 0x00;
+            ctx->q1_data[i++] = 0xFC;  // Track End MPU mark
         }
         else if( sig_change_request )
         {
             // sig_changed = TRUE;  // debug line
             if ( !sig_changed || (lastTick == 0))
             {
-                full_q1_data[i++] = 0x00;  // always zero
-                full_q1_data[i++] = 0xFA;  // special function
-                full_q1_data[i++] = 0x00;  // Beats Per Measure change
+                ctx->q1_data[i++] = 0x00;  // always zero
+                ctx->q1_data[i++] = 0xFA;  // special function
+                ctx->q1_data[i++] = 0x00;  // Beats Per Measure change
                 
                 // considered status change for MSQ-100
                 lastStatusByte = 0xFA;
@@ -807,9 +1376,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 }
                 
                 if ( (curr_t_sig_denominator == 4) && (curr_t_sig_numerator >= 1) &&  (curr_t_sig_numerator <= 8) )
-                    full_q1_data[i++] = (uint8_t) curr_t_sig_numerator;
+                    ctx->q1_data[i++] = (uint8_t) curr_t_sig_numerator;
                 else
-                    full_q1_data[i++] = 0x00;
+                    ctx->q1_data[i++] = 0x00;
                 
                 // curr_meas_length = 120 * curr_t_sig_numerator;
                 curr_meas_length = (480 / curr_t_sig_denominator) * curr_t_sig_numerator;
@@ -826,22 +1395,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
         }
         else
         {
-            const uint8_t* data = mm.getRawData();
-            int dataSize = mm.getRawDataSize();
-            
-            // dataSize should never exceed 3 at this point
-            
-            uint8_t statusByte = data[0];
-            if ( (statusByte >= 0xC0) && (statusByte <= 0xDF) )
-            {
-                dataSize = 2;
-            }
-            else
-            {
-                dataSize = 3;
-            }
+            uint8_t statusByte = mm.status;
             
-            if(mm.isNoteOff())
+            if(is_note_off(mm))
             {
                 // change to Note on with velocity = 0
                 statusByte = 0x90 | (statusByte & 0x0F);
@@ -850,12 +1406,9 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
             
             if (statusByte == lastStatusByte
                 && (statusByte & 0xf0) != 0xf0
-                && dataSize > 1
                 && j > 0)
             {
                 running_stat = TRUE;
-                ++data;
-                --dataSize;
             }
             else
             {
@@ -871,32 +1424,236 @@ int MSQ_100_SysEx::convert_to_Q1_data(const juce::MidiMessageSequence& m_seq)
                 }
             }
             
-            full_q1_data[i++] = (uint8_t) delta;
-            while (dataSize--)
+            ctx->q1_data[i++] = (uint8_t) delta;
+            if ( !running_stat )
             {
-                full_q1_data[i++] =  *(data++);
+                // from statusByte, so Note Offs also go out as 0x9n
+                ctx->q1_data[i++] = statusByte;
             }
-            if(mm.isNoteOff()) full_q1_data[i-1] = 0x00;  //force key velocity zero;
+            ctx->q1_data[i++] = mm.data1;
+            if ( (statusByte < 0xC0) || (statusByte > 0xDF) )
+                ctx->q1_data[i++] = mm.data2;
+            if(is_note_off(mm)) ctx->q1_data[i-1] = 0x00;  //force key velocity zero;
             
             lastStatusByte = statusByte;
+            
+            ctx->stats.num_events++;
+            ctx->stats.chan_events[statusByte & 0x0F]++;
         }
         
         curr_block_size = i - curr_block_start;
         if ( trk_end || ((curr_block_size) >= 210))
         {
-            i += insert_Q1_block_break(&full_q1_data[i], &curr_block_size, trk_end);
+            i += insert_Q1_block_break(&ctx->q1_data[i], &curr_block_size, trk_end);
             curr_block_size = 4;
             curr_block_start = i-4;
         }
     }
 
     
-    if (i) valid_Q1_data = TRUE;
+    if (i) ctx->valid_Q1_data = TRUE;
     
     return (i);  // Q1 bytes processed
 }
 
 
+// the filter option removing ev, 0 for messages that stay
+uint32_t MSQ_100_SysEx::is_filtered(const msq_tick_event& ev)
+{
+    const uint8_t type = ev.status & 0xF0;
+    
+    if ( ((type == 0xC0) || ((type == 0xB0) && (ev.data1 == 0x00))) && (ctx->filt_opts & FILTER_OPT_PRGCHNG) )
+        return FILTER_OPT_PRGCHNG;
+    
+    if ( ((type == 0xB0) && (ev.data1 != 0x01)) && (ctx->filt_opts & FILTER_OPT_CCNTRLS) )
+        return FILTER_OPT_CCNTRLS;  // let's mod wheel pass
+    
+    if ( (type == 0xE0) && (ctx->filt_opts & FILTER_OPT_PTCHBND) )
+        return FILTER_OPT_PTCHBND;
+    
+    if ( ((type == 0xA0) || (type == 0xD0)) && (ctx->filt_opts & FILTER_OPT_AFTRTCH) )
+        return FILTER_OPT_AFTRTCH;
+    
+    return 0;
+}
+
+
+void MSQ_100_SysEx::count_filtered(uint32_t filter)
+{
+    switch (filter)
+    {
+        case FILTER_OPT_PRGCHNG: ctx->stats.num_prgchng++; break;
+        case FILTER_OPT_CCNTRLS: ctx->stats.num_ccntrls++; break;
+        case FILTER_OPT_PTCHBND: ctx->stats.num_ptchbnd++; break;
+        case FILTER_OPT_AFTRTCH: ctx->stats.num_aftrtch++; break;
+        default: break;
+    }
+}
+
+
+// after each 0xF9 written, q1_pos just past it
+void MSQ_100_SysEx::count_bar(int q1_pos, int* bar_start)
+{
+    if ( (q1_pos - *bar_start) > ctx->stats.longest_bar )
+    {
+        ctx->stats.longest_bar = q1_pos - *bar_start;
+        ctx->stats.longest_bar_num = ctx->num_bars;
+    }
+    ctx->num_bars++;
+    *bar_start = q1_pos;
+}
+
+
+//  Removes time signature events which restate the signature in effect
+//  on one of its bar lines.  Every 0xFA change costs 4 bytes and resets
+//  running status
+//
+void MSQ_100_SysEx::prune_time_sigs(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs)
+{
+    std::vector<bool> restated (time_sigs.size(), FALSE);
+    size_t kept = 0;
+    int bar_tick = 0;
+    
+    // the encoder ends the bar at any signature, so one off the bar
+    // lines of the signature in effect forces a bar line and stays
+    for (size_t si = 1; si < time_sigs.size(); si++)
+    {
+        const msq_tick_event& prev = time_sigs[si - 1];
+        const msq_tick_event& ts = time_sigs[si];
+        const int meas_length = (480 >> (prev.data3 & 0x07)) * prev.data2;
+        
+        if ( !restated[si - 1] )
+            bar_tick = prev.tick;
+        
+        restated[si] = (ts.data2 == prev.data2) && (ts.data3 == prev.data3)
+                       && (meas_length > 0) && (((ts.tick - bar_tick) % meas_length) == 0);
+    }
+    
+    for (size_t k = 0; k < events.size(); k++)
+    {
+        const msq_tick_event& ev = events[k];
+        
+        if ( is_meta_event(ev, 0x58) )
+        {
+            const int si = next_time_sig(time_sigs, ev.tick);
+            
+            if ( (si < (int) time_sigs.size()) && restated[si] )
+                continue;
+        }
+        
+        events[kept++] = ev;
+    }
+    
+    events.resize(kept);
+}
+
+
+// status byte as written to Q1 data, Note Offs become 0x9n
+static uint8_t q1_status_byte(const msq_tick_event& ev)
+{
+    if ( is_note_off(ev) )
+        return (0x90 | (ev.status & 0x0F));
+    
+    return (ev.status);
+}
+
+
+//  Regroups events sharing one tick, so consecutive Q1 events share
+//  a status byte as often as possible.  Events of one channel keep
+//  their order, meta events stay put and split the group they are in.
+//  Note Offs count as 0x9n, since that is how they are written
+//
+void MSQ_100_SysEx::optimize_Q1_order(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs)
+{
+    std::vector<msq_tick_event> m_opt;
+    std::vector<int> chan_q[16];
+    int chan_head[16];
+    uint8_t lastStatusByte = 0;
+    int j = 0;
+    
+    prune_time_sigs(events, time_sigs);
+    
+    const int num_events = (int) events.size();
+    m_opt.reserve(num_events);
+    
+    while (j < num_events)
+    {
+        const msq_tick_event& mm = events[j];
+        const int tick = mm.tick;
+        
+        if ( (mm.status == 0xFF) || (mm.status == 0xF0) )
+        {
+            if ( is_meta_event(mm, 0x58) )
+                lastStatusByte = 0xFA;  // resets running status
+            
+            m_opt.push_back(mm);
+            j++;
+            continue;
+        }
+        
+        // queue up channel events at this tick, per channel
+        for (int c = 0; c < 16; c++)
+        {
+            chan_q[c].clear();
+            chan_head[c] = 0;
+        }
+        
+        while (j < num_events)
+        {
+            const msq_tick_event& mq = events[j];
+            if ( (mq.status == 0xFF) || (mq.status == 0xF0) || (mq.tick != tick) ) break;
+            
+            chan_q[mq.status & 0x0F].push_back(j++);
+        }
+        
+        for (;;)
+        {
+            int pick = -1;
+            int best_run = 0;
+            
+            for (int c = 0; c < 16; c++)
+            {
+                if ( chan_head[c] >= (int)chan_q[c].size() ) continue;
+                
+                const msq_tick_event& mc = events[chan_q[c][chan_head[c]]];
+                uint8_t statusByte = q1_status_byte(mc);
+                
+                if ( (statusByte == lastStatusByte) || is_filtered(mc) )
+                {
+                    // free, or continues running status
+                    pick = c;
+                    break;
+                }
+                
+                // otherwise start the longest run, earliest first on a tie
+                int run = 0;
+                for (int r = chan_head[c]; r < (int)chan_q[c].size(); r++, run++)
+                {
+                    if ( q1_status_byte(events[chan_q[c][r]]) != statusByte ) break;
+                }
+                
+                if ( (run > best_run)
+                    || ((run == best_run) && (chan_q[c][chan_head[c]] < chan_q[pick][chan_head[pick]])) )
+                {
+                    best_run = run;
+                    pick = c;
+                }
+            }
+            
+            if (pick < 0) break;
+            
+            const msq_tick_event& mp = events[chan_q[pick][chan_head[pick]++]];
+            if ( !is_filtered(mp) )
+                lastStatusByte = q1_status_byte(mp);
+            
+            m_opt.push_back(mp);
+        }
+    }
+    
+    events.swap(m_opt);
+}
+
+
 void MSQ_100_SysEx::mergeTimeSig(int trk_num)
 {
     juce::MidiMessageSequence t_events = juce::MidiMessageSequence();
@@ -911,332 +1668,622 @@ void MSQ_100_SysEx::mergeTimeSig(int trk_num)
 
 
 
-//  Parse MSQ-100's Q1 Header + Phrase Data Block (PDB)
-//  to (Standard) Midi message Sequence
-//  Q1 data block chunks must be decoded and concatenated
-//  prior to calling this
-//
-int MSQ_100_SysEx::parse_Q1_data(juce::MidiMessageSequence& m_seq)
+static bool smf_event_order(const juce::MidiMessage& first, const juce::MidiMessage& second)
 {
-    int ticks_this_meas = 0;
-    int last_meas_t = 0;
-
-    int delta = 0;
+    const double diff = first.getTimeStamp() - second.getTimeStamp();
     
-    int last_time = 0;
-    int curr_time = 0;
-    int curr_t_sig = 4;
-    int curr_measure_length;
-    //int curr_tempo = 100;
+    if (diff != 0) return (diff < 0);
     
-    uint8_t m_key_num, m_key_vel;
-    uint8_t last_status = 0xF9;
-    uint8_t curr_status = 0xFA;
-    //bool running_stat = FALSE;
+    return ( first.isNoteOff() && second.isNoteOn() );
+}
+
+
+// big endian chunk fields
+static inline uint32_t smf_read_32(const uint8_t* data)
+{
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+
+//  Loads an SMF held in memory, usually a mapped file, for converting
+//  src_track.  The MTrk chunks are only indexed first; the track to
+//  convert is decoded like readFrom does, the others are only scanned
+//  for the time signatures and tempos.  -t 0 of a Format 1 file
+//  merges every track, so that decodes them all.
+//  Returns FALSE if the data is no SMF.
+//
+bool MSQ_100_SysEx::read_smf_track(const void* smf_data, size_t smf_size, int src_track)
+{
+    const uint8_t* data = (const uint8_t*) smf_data;
     
+    clear();
     
-    const unsigned char msq_track_title[] =
-    {
-        0xFF, 0x03, 0x10, 'M', 'S', 'Q', '-', '1',
-        '0', '0', ' ', 'S', 'e', 'q', 'u', 'e', 'n', 'c', 'e'
-    };
+    if ( (data == 0) || (smf_size < 14) || std::memcmp(data, "MThd", 4) ) return FALSE;
     
-    int i = 0;
-    register uint8_t q_byte;  // for debugging purposes
+    const size_t hdr_size = smf_read_32(&data[4]);
+    const int expected_trks = (data[10] << 8) | data[11];
+    timeFormat = (short)((data[12] << 8) | data[13]);
     
-    // juce::MidiMessage& mm;  // temp pointer to new MIDI message
-
-    i = 36; // skip over first 36 bytes or validate them
+    // index the tracks
+    std::vector<const uint8_t*> trk_data;
+    std::vector<int> trk_size;
+    size_t pos = 8 + hdr_size;
     
-    if (valid_Q1_data)
+    while ( (pos + 8 <= smf_size) && ((int) trk_data.size() < expected_trks) )
     {
-        raw_sysex = FALSE;
-        m_seq.clear();
+        size_t chunk_size = smf_read_32(&data[pos + 4]);
+        if (chunk_size > smf_size - pos - 8)
+            chunk_size = smf_size - pos - 8;
         
-        const juce::MidiMessage mt = juce::MidiMessage (msq_track_title, sizeof(msq_track_title), 0.00f);
-        m_seq.addEvent(mt);
-        
-        const juce::MidiMessage mtmpo = juce::MidiMessage::tempoMetaEvent( 60000000 / 100 );  // 100 BPM
-        m_seq.addEvent(mtmpo);
-        
-        //const juce::MidiMessage mtsig = juce::MidiMessage::timeSignatureMetaEvent(4, 4);
-        //m_seq.addEvent(mtsig);
+        if ( !std::memcmp(&data[pos], "MTrk", 4) )
+        {
+            trk_data.push_back(&data[pos + 8]);
+            trk_size.push_back((int) chunk_size);
+        }
+        pos += 8 + chunk_size;
     }
     
+    const int num_trks = (int) trk_data.size();
     
-    last_time = 0;
-    curr_time = 0;
-    curr_measure_length = curr_t_sig * 120;
-    q_byte = 0xF9;
+    // same choice as prepare_smf_track
+    if (num_trks < 2)
+        src_track = 0;
+    else if (src_track >= num_trks)
+        src_track = 1;
     
-    while ((q_byte != 0xFC) && (i < q1_data_size))
+    for (int t = 0; t < num_trks; t++)
     {
-        // get time
-        q_byte = full_q1_data[i++];
-        if (q_byte == 0xFE)
-        {
-            // just indicated end of data block, skip over next header
-            q_byte = full_q1_data[i++];
-            if (q_byte == 0xFE) i++;
-            // i += 2;
-            continue;
-        }
-        else if (q_byte == 0xF8)
-        {
-            delta = 240;  // half note, 2 X 120 PPQN
-        }
-        else
-        {
-            delta = (int)q_byte;
-        }
+        const bool decode_all = (num_trks > 1) && (src_track == 0);
         
-        last_time = curr_time;
-        curr_time += delta;
+        read_smf_events(trk_data[t], trk_size[t], !decode_all && (t != src_track));
+    }
+    
+    return TRUE;
+}
+
+
+// a variable length value within size bytes, -1 if it runs past them
+static int read_smf_length(const uint8_t* data, int size, int& bytes_used)
+{
+    int value = 0;
+    
+    for (bytes_used = 0; (bytes_used < 4) && (bytes_used < size); )
+    {
+        const uint8_t b = data[bytes_used++];
+        value = (value << 7) | (b & 0x7F);
         
-        ticks_this_meas += delta;
-        if (i > 250)
-        {
-            // std::cout << " index " << i << " at time " << curr_time << std::endl;
-        }
+        if ( !(b & 0x80) ) return (value);
+    }
+    
+    return (-1);
+}
+
+
+//  Decodes one MTrk chunk into a new track as readFrom would, or with
+//  time_sigs_only skips over everything but time signature and tempo events
+//
+void MSQ_100_SysEx::read_smf_events(const uint8_t* data, int size, bool time_sigs_only)
+{
+    std::vector<juce::MidiMessage> events;
+    uint8_t lastStatusByte = 0;
+    double time = 0;
+    
+    while (size > 0)
+    {
+        int bytesUsed;
+        const int delta = read_smf_length(data, size, bytesUsed);
+        if (delta < 0) break;
         
-        if (q_byte == 0xF8) continue;
+        time += delta;
+        data += bytesUsed;
+        size -= bytesUsed;
+        if (size <= 0) break;
         
-        // get status
-        q_byte = full_q1_data[i++];
-        if ((0xF0 & q_byte) == 0xF0)
+        if (time_sigs_only)
         {
-            // Meta type events
-            if (q_byte == 0xF9)
+            uint8_t statusByte = *data;
+            int messSize;
+            
+            if (size < 2) break;
+            
+            if (statusByte == 0xFF)
             {
-                // measure end
-                if (ticks_this_meas != last_meas_t)
-                {
-                    // need to check time signature change
-                    // creat time signature meta event
-                }
+                // type, then the length, both inside the chunk
+                if (size < 3) break;
                 
-                last_meas_t = ticks_this_meas;
-                ticks_this_meas = 0;
-                continue;
+                int lenBytes;
+                const int metaSize = read_smf_length(data + 2, size - 2, lenBytes);
+                if ( (metaSize < 0) || (2 + lenBytes + metaSize > size) ) break;
+                messSize = 2 + lenBytes + metaSize;
+                
+                if ( (data[1] == 0x58) || (data[1] == 0x51) )
+                    events.push_back(juce::MidiMessage(data, messSize, time));
             }
-            else if (q_byte == 0xFA)
+            else if ( (statusByte == 0xF0) || (statusByte == 0xF7) )
             {
-                // special functions
-                q_byte = full_q1_data[i++];
-                if (q_byte == 0x01)
-                {
-                    // switch to maintain NOTE ON Velocity ?
-                    q_byte = full_q1_data[i++];
-                }
-                else
-                {
-                    // time sig change (delta) ??
-                    curr_t_sig = full_q1_data[i++];
-                    if (!curr_t_sig)
-                        curr_t_sig = 4;
-                    curr_measure_length = curr_t_sig * 120;
-                    
-                    // need to create Set Tempto Meta event
-                    // Set tempo event MUST occur on MIDI clock grid (24 PPQN)
-                    // in the MSQ-100 case (120 PPQN), the event time must be evenly
-                    // divisible by 5. Any timing adjustment here require us to
-                    // sort the midi message sequence at the end of this function
-                    //event_time = 5 * (curr_time / 5);
-                    //curr_tempo = 100; // ?
-                    
-                    juce::MidiMessage mtsg = juce::MidiMessage(juce::MidiMessage::timeSignatureMetaEvent(curr_t_sig, 4), (double) curr_time);
-                    m_seq.addEvent(mtsg);
-                }
-                continue;
+                int lenBytes;
+                const int syxSize = read_smf_length(data + 1, size - 1, lenBytes);
+                if (syxSize < 0) break;
+                messSize = 1 + lenBytes + syxSize;
             }
-            else if (q_byte == 0xFC)
+            else if (statusByte < 0x80)
             {
-                // data end
-                break;
+                // running status
+                messSize = juce::MidiMessage::getMessageLengthFromFirstByte(lastStatusByte) - 1;
             }
-            else if (q_byte == 0xFE)
+            else
             {
-                // just indicated end of data block, skip over next header
-                q_byte = full_q1_data[i++];
-                if (q_byte == 0xFE) i++;
-                // i += 2;
-                continue;
+                messSize = juce::MidiMessage::getMessageLengthFromFirstByte(statusByte);
+                lastStatusByte = statusByte;
             }
-        }
-        else if (0x80 & q_byte)
-        {
-            // new status
-            curr_status = q_byte;
-            last_status = curr_status;
-
-            m_key_num = full_q1_data[i++];  // key number
+            
+            if ( (messSize <= 0) || (messSize > size) ) break;
+            data += messSize;
+            size -= messSize;
         }
         else
         {
-            // q_data already contians key number
-            // running status
-            m_key_num = q_byte;
+            int messSize = 0;
+            const juce::MidiMessage mm (data, size, messSize, lastStatusByte, time);
+            if (messSize <= 0) break;
+            
+            size -= messSize;
+            data += messSize;
             
-            if ( curr_status != last_status ) break;  // error - should never happen
+            events.push_back(mm);
+            
+            const uint8_t firstByte = *(mm.getRawData());
+            if ((firstByte & 0xf0) != 0xf0)
+                lastStatusByte = firstByte;
         }
+    }
+    
+    // note offs before note ons at the same time, as MidiFile sorts
+    std::stable_sort(events.begin(), events.end(), smf_event_order);
+    
+    juce::MidiMessageSequence result;
+    for (size_t e = 0; e < events.size(); e++)
+        result.addEvent(events[e]);
+    
+    addTrack(result);
+    tracks.getLast()->updateMatchedPairs();
+}
+
+
+//  The tracks of src, as read_smf_track leaves the ones it doesn't
+//  convert: time signature and tempo events only
+//
+void MSQ_100_SysEx::read_smf_meta(const MSQ_100_SysEx& src)
+{
+    clear();
+    timeFormat = src.getTimeFormat();
+    
+    for (int t = 0; t < src.getNumTracks(); t++)
+    {
+        const juce::MidiMessageSequence* trk = src.getTrack(t);
+        juce::MidiMessageSequence result;
         
-        
-        if ( (curr_status >= 0xC0) && (curr_status <= 0xDF) )
+        for (int e = 0; e < trk->getNumEvents(); e++)
         {
-            // program change or channel aftertouch - one more byte only
-            // Note
-            const juce::MidiMessage mm = juce::MidiMessage (curr_status, m_key_num, double(curr_time));
-            m_seq.addEvent(mm);
-        }
-        else if ( (curr_status >= 0x80) && (curr_status <= 0xEF) )
-        {            
-            // one more byte - key veolocity
-            m_key_vel = full_q1_data[i++];
+            const juce::MidiMessage& mm = trk->getEventPointer(e)->message;
             
-            uint8_t mod_status = curr_status;
-            if ( (m_key_vel == 0) && ((curr_status & 0xF0) == 0x90) )
-            {
-                // Note Off
-                mod_status &= 0xEF;
-            }
-            // Note
-            const juce::MidiMessage mm = juce::MidiMessage (mod_status, m_key_num, m_key_vel, double(curr_time));
-            m_seq.addEvent(mm);
+            if ( mm.isTimeSignatureMetaEvent() || mm.isTempoMetaEvent() )
+                result.addEvent(mm);
         }
+        
+        addTrack(result);
     }
+}
+
+
+//  src read with every track decoded, meta made from it by read_smf_meta.
+//  Copies src_track, and the others from meta unless all are merged
+//
+void MSQ_100_SysEx::read_smf_part(const MSQ_100_SysEx& src, const MSQ_100_SysEx& meta, int src_track)
+{
+    clear();
+    timeFormat = src.getTimeFormat();
+    
+    const int num_trks = src.getNumTracks();
+    const bool decode_all = (num_trks > 1) && (src_track == 0);
     
-    if ((int) curr_status)
+    for (int t = 0; t < num_trks; t++)
     {
-        const juce::MidiMessage mm_eot = juce::MidiMessage::endOfTrack();
-        m_seq.addEvent( mm_eot );
+        if ( decode_all || (t == src_track) )
+            addTrack(*src.getTrack(t));
+        else
+            addTrack(*meta.getTrack(t));
         
-        m_seq.updateMatchedPairs();
-        m_seq.sort();
+        tracks.getLast()->updateMatchedPairs();
     }
-    
-    return ((int)curr_status);
 }
 
 
+//  Picks the track of a freshly read SMF to convert, Format 1 tracks
+//  get the time signatures merged in, and rescales to 120 PPQN
+//  returns the track number to pass to smf_to_msq_syx
+//
+int MSQ_100_SysEx::prepare_smf_track(int src_track)
+{
+    if (getNumTracks() > 1)
+    {
+        // MIDI Fromat 1
+        if ( src_track >= getNumTracks() )
+            src_track = 1;
+        mergeTimeSig(src_track);
+    }
+    else
+    {
+        // MIDI Fromat 0
+        src_track = 0;
+    }
+    
+    // if timebase is different, change to 120 PPQN for MSQ-100
+    if (getTimeFormat() != 120)
+        changePPQN((short) 120);
+    
+    return (src_track);
+}
 
 
-
-// returns new size
-// required for allocating destination buffer
+//  Collects the tempo events of all tracks.  A source without any
+//  leaves the map empty, nothing is saved or written back then
 //
-// examples 212 -> 243
-//           42 ->  48
-int MSQ_100_SysEx::encode_7_8_size(int size)
+void MSQ_100_SysEx::build_tempo_map()
 {
-    int remainder;
-    
-    remainder = size % 7;
-    if (remainder) remainder++;
+    juce::MidiMessageSequence tempos;
+    findAllTempoEvents(tempos);
     
-    return (8 * (size / 7) + remainder);
+    tempo_map.clear(getTimeFormat());
+    for (int i = 0; i < tempos.getNumEvents(); i++)
+    {
+        const juce::MidiMessage& mm = tempos.getEventPointer(i)->message;
+        tempo_map.add_tempo(juce::roundToInt (mm.getTimeStamp()), (uint32_t) mm.getTempoMicroSecondsPerQuarterNote());
+    }
 }
 
 
-// returns new size
-// works on one block at a time
-// stops at EOB (End of Block) 0xFE bytes or size limit
-int MSQ_100_SysEx::encode_7_8_bytes(uint8_t* block_data, uint8_t* raw_data, int size)
+MSQ_TempoMap& MSQ_100_SysEx::get_tempo_map()
+{
+    return (tempo_map);
+}
+
+
+MSQ_BarIndex& MSQ_100_SysEx::get_bar_index()
+{
+    return (bar_index);
+}
+
+
+const msq_fingerprint& MSQ_100_SysEx::get_fingerprint()
 {
-    uint8_t msig_bits;
-    int i = 0; int j = 0; int k = 0;
-    bool end_of_block = FALSE;
+    return fingerprint.get();
+}
+
+
+//  Parse MSQ-100's Q1 Header + Phrase Data Block (PDB)
+//  to (Standard) Midi message Sequence
+//  Q1 data block chunks must be decoded and concatenated
+//  prior to calling this
+//
+int MSQ_100_SysEx::parse_Q1_data(juce::MidiMessageSequence& m_seq)
+{
+    q1_parser parser;
+    q1_event ev;
     
-    while ( !end_of_block )
+    const unsigned char msq_track_title[] =
     {
-        // break down into 7 byte chunks and encode as 8
-        msig_bits = 0x00;
-        for (j = 0; j < 7; j++)
+        0xFF, 0x03, 0x10, 'M', 'S', 'Q', '-', '1',
+        '0', '0', ' ', 'S', 'e', 'q', 'u', 'e', 'n', 'c', 'e'
+    };
+    
+    if (ctx->valid_Q1_data)
+    {
+        raw_sysex = FALSE;
+        m_seq.clear();
+        
+        const juce::MidiMessage mt = juce::MidiMessage (msq_track_title, sizeof(msq_track_title), 0.00f);
+        m_seq.addEvent(mt);
+        
+    }
+    
+    // the dump has no tempo, write the saved map or 100 BPM
+    if (tempo_map.get_num_tempos() == 0)
+    {
+        tempo_map.clear(120);
+        tempo_map.add_tempo(0, MSQ_TEMPO_MSQ_DEFAULT);
+    }
+    const int tempo_scale = tempo_map.get_ppqn();
+    int next_tempo = 0;
+    
+    q1_parse_init(&parser, ctx->q1_data, ctx->q1_data_size);
+    bar_index.begin(&parser);
+    fingerprint.begin();
+    
+    // the parser goes forward in time, so events are only appended and
+    // each key has at most one note on waiting for its note off
+    juce::MidiMessageSequence::MidiEventHolder* open_notes[16][128];
+    std::memset(open_notes, 0, sizeof(open_notes));
+    bool in_order = TRUE;
+    int last_tick = 0;
+    
+    while ( ctx->valid_Q1_data && (next_tempo < tempo_map.get_num_tempos()) )
+    {
+        // changes at the start go right after the title
+        if (tempo_map.get_tick(next_tempo) != 0) break;
+        m_seq.addEvent(juce::MidiMessage::tempoMetaEvent((int) tempo_map.get_mpqn(next_tempo++)));
+    }
+    
+    while ( q1_parse_next(&parser, &ev) )
+    {
+        if (ev.tick < last_tick) in_order = FALSE;
+        last_tick = ev.tick;
+        fingerprint.add(ev);
+        
+        // later changes merge in by time, past the last event they are dropped
+        while ( (next_tempo < tempo_map.get_num_tempos())
+                && (((int64_t) tempo_map.get_tick(next_tempo) * 120) / tempo_scale <= ev.tick) )
         {
-            if (end_of_block)
-            {
-                if (raw_data[i] == 0xFE)
-                {
-                    //  seen two End Block marks
-                }
-                else
-                {
-                    break;
-                }
-            }
-            else if( raw_data[i] == 0xFE )
+            const int tempo_tick = (int)(((int64_t) tempo_map.get_tick(next_tempo) * 120) / tempo_scale);
+            const juce::MidiMessage mtmpo = juce::MidiMessage(juce::MidiMessage::tempoMetaEvent((int) tempo_map.get_mpqn(next_tempo++)), (double) tempo_tick);
+            m_seq.addEvent(mtmpo);
+        }
+        
+        if (ev.status == 0xFF)
+        {
+            juce::MidiMessage mtsg = juce::MidiMessage(juce::MidiMessage::timeSignatureMetaEvent(ev.data1, 4), (double) ev.tick);
+            m_seq.addEvent(mtsg);
+        }
+        else if (ev.size == 2)
+        {
+            // program change or channel aftertouch
+            const juce::MidiMessage mm = juce::MidiMessage (ev.status, ev.data1, double(ev.tick));
+            m_seq.addEvent(mm);
+        }
+        else
+        {
+            const juce::MidiMessage mm = juce::MidiMessage (ev.status, ev.data1, ev.data2, double(ev.tick));
+            juce::MidiMessageSequence::MidiEventHolder*& open_note = open_notes[ev.status & 0x0F][ev.data1 & 0x7F];
+            
+            if ( mm.isNoteOn() && open_note )
             {
-                end_of_block = TRUE;
+                // key struck again while still on, end the first note
+                // here like updateMatchedPairs does
+                const juce::MidiMessage moff = juce::MidiMessage (juce::MidiMessage::noteOff((ev.status & 0x0F) + 1, ev.data1), double(ev.tick));
+                m_seq.addEvent(moff);
+                open_note->noteOffObject = m_seq.getEventPointer(m_seq.getNumEvents() - 1);
+                open_note = 0;
             }
-            else if (i >= size)
+            
+            m_seq.addEvent(mm);
+            
+            if ( mm.isNoteOn() )
             {
-                // safety - should never get here
-                end_of_block = TRUE;
-                break;
+                open_note = m_seq.getEventPointer(m_seq.getNumEvents() - 1);
             }
-            
-            if(0x80 & raw_data[i])
+            else if ( mm.isNoteOff() && open_note )
             {
-                msig_bits |= (0x01 << j);
+                open_note->noteOffObject = m_seq.getEventPointer(m_seq.getNumEvents() - 1);
+                open_note = 0;
             }
-            block_data[++k] = 0x7F & raw_data[i++];
         }
-        block_data[k-j]  = msig_bits;
-        ++k;
+    }
+    ctx->num_bars = parser.num_bars;
+    bar_index.end(&parser);
+    fingerprint.end();
+    
+    if ((int) parser.curr_status)
+    {
+        const juce::MidiMessage mm_eot = juce::MidiMessage(juce::MidiMessage::endOfTrack(), (double) last_tick);
+        m_seq.addEvent( mm_eot );
         
+        if (!in_order)
+        {
+            m_seq.updateMatchedPairs();
+            m_seq.sort();
+        }
     }
     
-    return(k);
+    return ((int) parser.curr_status);
+}
+
+
+
+
+
+// 7-8 bit helpers, see MSQ_Q1.cpp
+int MSQ_100_SysEx::encode_7_8_size(int size)
+{
+    return q1_encode_7_8_size(size);
+}
+
+
+int MSQ_100_SysEx::encode_7_8_bytes(uint8_t* block_data, uint8_t* raw_data, int size)
+{
+    return q1_encode_7_8_bytes(block_data, raw_data, size);
 }
 
 
-// returns new size
-// required for allocating destination buffer
-//
-// new size = 7 * (size / 8) + (size % 8) - 1
-//
-// examples 243 -> 212
-//           48 ->  42
 int MSQ_100_SysEx::decode_8_7_size(int size)
 {
-    int remainder;
+    return q1_decode_8_7_size(size);
+}
+
+
+int MSQ_100_SysEx::decode_8_7_bytes(uint8_t* raw_data, uint8_t* block_data, int size)
+{
+    return q1_decode_8_7_bytes(raw_data, block_data, size);
+}
+
+
+uint8_t MSQ_100_SysEx::byte_checksum(uint8_t* block_data, int b_size)
+{
+    return q1_byte_checksum(block_data, b_size);
+}
+
+
+
+//==============================================================================
+//  Reentrant conversions.  The MSQ_100_SysEx each one works through is
+//  local and runs on ctx, so calls share nothing but constant tables
+//
+bool msq_convert_smf(msq_conv_ctx& ctx, const void* smf_data, size_t smf_size, int src_track,
+                     uint32_t filters, MSQ_TempoMap* tempo_map, juce::OutputStream& syx_out)
+{
+    MSQ_100_SysEx msq_sysex (ctx);
+    
+    msq_sysex.read_smf_track(smf_data, smf_size, src_track);
+    if (!msq_sysex.getNumTracks())
+        return FALSE;
+    
+    msq_sysex.smf_to_msq_syx(msq_sysex.prepare_smf_track(src_track), filters);
     
-    remainder = size % 8;
-    if (remainder) remainder--;
+    if (tempo_map)
+        *tempo_map = msq_sysex.get_tempo_map();
     
-    return(7 * (size / 8) + remainder);
+    return msq_sysex.write_syx(syx_out);
 }
 
 
-// returns new size 
-int MSQ_100_SysEx::decode_8_7_bytes(uint8_t* raw_data, uint8_t* block_data, int size)
+//  Straight from the decoded Q1 data to SMF bytes, see MSQ_Transcode.h,
+//  with no MidiMessageSequence in between.  Makes what msq_syx_to_smf,
+//  changePPQN and write_smf would
+//
+bool msq_convert_syx(msq_conv_ctx& ctx, const void* syx_data, size_t syx_size, short n_timebase,
+                     uint32_t filters, const MSQ_TempoMap* tempo_map, juce::OutputStream& smf_out)
 {
-    uint8_t msig_bits;
-    int i = 0; int k = 0;
+    ctx.syx_frames_size = 0;
+    ctx.filt_opts = filters;
+    ctx.num_bars = 0;
     
-    while ( i < size )
+    if (filters & DECODE_OPT_SALVAGE)
     {
-        // break down into 8 byte chunks and extract 7
-        msig_bits = block_data[i++];
+        int pos = 0;
         
-        for (int j = 7; j > 0 ; j--)
-        {
-            raw_data[k++] = (0x80 & (msig_bits << j)) | block_data[i++];
+        ctx.q1_data_size = q1_salvage((const uint8_t*) syx_data, (int) syx_size, &pos, ctx.q1_data, &ctx.salvage);
+        ctx.num_syx_blks = ctx.salvage.num_blks;
+    }
+    else
+    {
+        ctx.q1_data_size = q1_decode_dump((const uint8_t*) syx_data, (int) syx_size, ctx.q1_data, &ctx.num_syx_blks);
+    }
+    
+    ctx.valid_Q1_data = (ctx.num_syx_blks > 0);
+    if ( !ctx.valid_Q1_data )
+        return FALSE;
+    
+    const MSQ_TempoMap no_tempo;
+    if (!tempo_map)
+        tempo_map = &no_tempo;
+    
+    uint8_t* smf_data = new uint8_t[q1_smf_size_bound(ctx.q1_data_size, *tempo_map)];
+    const int smf_size = q1_transcode_smf(ctx.q1_data, ctx.q1_data_size, *tempo_map, n_timebase, smf_data);
+    
+    const bool written = smf_out.write(smf_data, smf_size);
+    delete[] smf_data;
+    
+    return (written);
+}
 
-            if ( i >= size ) break;
-        }
+
+// any channel voice message, so the track has something to play
+static bool smf_track_has_channel_events(const juce::MidiMessageSequence* trk)
+{
+    for (int e = 0; e < trk->getNumEvents(); e++)
+    {
+        if ( *(trk->getEventPointer(e)->message.getRawData()) < 0xF0 )
+            return TRUE;
     }
     
-    return(k);
+    return FALSE;
 }
 
 
-uint8_t MSQ_100_SysEx::byte_checksum(uint8_t* block_data, int b_size)
+// every stride-th dump, starting at first
+static void convert_track_dumps(const MSQ_100_SysEx* src, const MSQ_100_SysEx* meta, uint32_t filters,
+                                std::vector<msq_track_dump>* dumps, int first, int stride)
 {
-    uint8_t c_sum = block_data[--b_size];
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+    msq_conv_init(ctx);
     
-    while ( b_size )
-        c_sum += block_data[--b_size];
+    for (int d = first; d < (int) dumps->size(); d += stride)
+    {
+        msq_track_dump& dump = (*dumps)[d];
+        const int num_trks = src->getNumTracks();
+        
+        // no such track, left unconverted
+        if ( (dump.src_track < 0) || (dump.src_track >= num_trks) || ((num_trks < 2) && (dump.src_track != 0)) )
+            continue;
+        
+        MSQ_100_SysEx msq_sysex (*ctx);
+        
+        msq_sysex.read_smf_part(*src, *meta, dump.src_track);
+        msq_sysex.smf_to_msq_syx(msq_sysex.prepare_smf_track(dump.src_track), filters);
+        
+        dump.tempo_map = msq_sysex.get_tempo_map();
+        
+        juce::MemoryOutputStream syx_stream (dump.syx, FALSE);
+        dump.converted = msq_sysex.write_syx(syx_stream);
+    }
     
-    return (c_sum & 0x7F);
+    delete ctx;
 }
 
+
+int msq_convert_smf_tracks(const void* smf_data, size_t smf_size, const std::vector<int>& src_tracks,
+                           uint32_t filters, int num_threads, std::vector<msq_track_dump>& dumps)
+{
+    MSQ_100_SysEx src;
+    MSQ_100_SysEx meta;
+    
+    dumps.clear();
+    
+    // track 0 of a Format 1 file decodes them all
+    if ( !src.read_smf_track(smf_data, smf_size, 0) )
+        return (-1);
+    
+    const int num_trks = src.getNumTracks();
+    meta.read_smf_meta(src);
+    
+    std::vector<int> trks (src_tracks);
+    if (trks.empty())
+    {
+        for (int t = (num_trks > 1) ? 1 : 0; t < num_trks; t++)
+        {
+            if ( smf_track_has_channel_events(src.getTrack(t)) )
+                trks.push_back(t);
+        }
+    }
+    
+    for (size_t i = 0; i < trks.size(); i++)
+    {
+        msq_track_dump dump;
+        dump.src_track = trks[i];
+        dump.converted = FALSE;
+        dumps.push_back(dump);
+    }
+    
+    if (num_threads <= 0)
+        num_threads = juce::jmax (1, (int) std::thread::hardware_concurrency());
+    num_threads = juce::jmin (num_threads, (int) dumps.size());
+    
+    if (num_threads > 1)
+    {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < num_threads; t++)
+            workers.push_back(std::thread(convert_track_dumps, &src, &meta, filters, &dumps, t, num_threads));
+        for (int t = 0; t < num_threads; t++)
+            workers[t].join();
+    }
+    else
+        convert_track_dumps(&src, &meta, filters, &dumps, 0, 1);
+    
+    int num_converted = 0;
+    for (size_t i = 0; i < dumps.size(); i++)
+    {
+        if (dumps[i].converted)
+            num_converted++;
+    }
+    
+    return (num_converted);
+}
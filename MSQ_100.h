@@ -11,10 +11,15 @@
 #define __msq_convert__MSQ_100__
 
 #include <iostream>
+#include <vector>
 
 #include "juce_audio_basics.h"
-
-#endif /* defined(__msq_convert__MSQ_100__) */
+#include "MSQ_TempoMap.h"
+#include "MSQ_BarIndex.h"
+#include "MSQ_Fingerprint.h"
+#include "MSQ_PerfCount.h"
+#include "MSQ_RawMidi.h"
+#include "MSQ_Q1.h"
 
 
 #define FILTER_OPT_CLEAR    0x00000000UL
@@ -28,6 +33,81 @@
 #define FILTER_OPT_MASK     0xFFFF80C0UL
 #define FILTER_CHAN_MASK    0x0000001FUL
 
+#define ENCODE_OPT_OPTIMIZE 0x01000000UL    // size-optimizing Q1 encoder
+#define ENCODE_OPT_COUNT    0x02000000UL    // stats and decoded Q1 data only, no SysEx
+#define DECODE_OPT_SALVAGE  0x04000000UL    // skips damaged SysEx blocks, see q1_salvage
+
+#define MSQ_RAW_MAX_EVENTS  16384   // raw capture events kept, more than Q1 data holds
+
+// conversion stages, as the bench command counts them
+#define MSQ_STAGE_READ      0   // SMF parsed, track set up
+#define MSQ_STAGE_FILTER    1   // tracks merged, SysEx and filtered channels out, notes paired
+#define MSQ_STAGE_FLATTEN   2   // to msq_tick_event
+#define MSQ_STAGE_ENCODE    3   // convert_to_Q1_data, optimize_Q1_order
+#define MSQ_STAGE_FRAME     4   // Q1 data to SysEx blocks
+#define MSQ_STAGE_WRITE     5   // .syx bytes out
+#define MSQ_STAGE_DECODE    6   // SysEx blocks to Q1 data
+#define MSQ_STAGE_TRANSCODE 7   // Q1 data to SMF bytes
+#define MSQ_NUM_STAGES      8
+
+// MIDI wire timing, start + 8 data + stop bits per byte
+#define MIDI_BAUD_RATE      31250
+#define MIDI_BITS_PER_BYTE  10
+
+
+//  What the encoder did with a track, or found in a decoded dump
+//
+typedef struct
+{
+    uint32_t num_events;       // channel events in the Q1 data
+    uint32_t chan_events[16];
+    uint32_t num_prgchng;      // left out by the filter options, each kind
+    uint32_t num_ccntrls;
+    uint32_t num_ptchbnd;
+    uint32_t num_aftrtch;
+    uint32_t num_channel;      // muted or not soloed channels
+    uint32_t num_sysex;        // SysEx never goes into Q1 data
+    uint32_t num_cut;          // past the last block that fits
+    int longest_bar;           // Q1 bytes of the longest measure
+    int longest_bar_num;       // 0 based
+} msq_conv_stats;
+
+
+//  One event on its way into Q1 data.  A track is flattened to these
+//  once, its time rounded to whole 120 PPQN ticks there, so the encoder
+//  works on integers only and keeps 8 bytes per event
+//
+typedef struct
+{
+    int32_t tick;
+    uint8_t status;      // 0x80 - 0xEF, 0xF0 SysEx, 0xFF meta event
+    uint8_t data1;       // meta event type for 0xFF
+    uint8_t data2;       // time signature numerator
+    uint8_t data3;       // time signature denominator, as a power of 2
+} msq_tick_event;
+
+
+//  State of one conversion.  Each MSQ_100_SysEx owns one, unless made
+//  on a context the caller provides, as the msq_convert_ functions do
+//  with one on their caller's stack
+//
+typedef struct
+{
+    bool valid_Q1_data;
+    uint32_t filt_opts;
+    int num_syx_blks;    // includes FCB and all PD blocks
+    int q1_data_size;    // decoded size in bytes, not encoded size
+    int q1_base_size;    // size before ENCODE_OPT_OPTIMIZE regrouping
+    int num_bars;        // 0xF9 measure ends written or parsed
+    int syx_frames_size;
+    msq_conv_stats stats;
+    q1_salvage_report salvage;   // what salvage_syx_to_smf lost
+    uint8_t q1_data[Q1_MAX_SYX_BLKS * Q1_BLK_BUF_SIZE];
+    uint8_t syx_frames[Q1_MAX_SYX_BLKS * Q1_MAX_FRAME_SIZE];   // SysEx blocks as smf_to_msq_syx framed them
+} msq_conv_ctx;
+
+void msq_conv_init(msq_conv_ctx* ctx);
+
 
 //==============================================================================
 /**
@@ -57,6 +137,7 @@ class MSQ_100_SysEx: public juce::MidiFile
 {
 public:
     MSQ_100_SysEx();
+    explicit MSQ_100_SysEx(msq_conv_ctx& call_ctx);
 
     ~MSQ_100_SysEx();
 
@@ -66,21 +147,74 @@ public:
     bool is_MSQ_100();
 
     int smf_to_msq_syx(int trk_num, uint32_t filters);
+    
+    //  smf_to_msq_syx for a raw MIDI capture, read from raw until its end.
+    //  raw.begin() first; bpm as given it, for the tempo map.  FALSE if
+    //  the capture had no channel messages
+    //
+    bool raw_to_msq_syx(MSQ_RawMidi& raw, double bpm, uint32_t filters);
+    
     void msq_syx_to_smf(uint32_t filters);
     
+    //  msq_syx_to_smf for raw .syx data that may be damaged, whatever
+    //  survives is parsed.  get_salvage_report() tells what didn't
+    //
+    void salvage_syx_to_smf(const void* syx_data, size_t syx_size, uint32_t filters);
+    const q1_salvage_report& get_salvage_report();
+    
     void mergeTimeSig(int trk_num);
+    int prepare_smf_track(int src_track);
+    
+    // readFrom for SMF data in memory, decodes src_track only
+    bool read_smf_track(const void* smf_data, size_t smf_size, int src_track);
+    
+    //  Sets up src_track of an SMF already read, with meta holding the
+    //  time signatures and tempos of each of its tracks, as read_smf_track
+    //  would have, so every track of a Format 1 file is parsed once
+    //
+    void read_smf_part(const MSQ_100_SysEx& src, const MSQ_100_SysEx& meta, int src_track);
+    void read_smf_meta(const MSQ_100_SysEx& src);
+
+    int get_Q1_data_size();
+    int get_num_syx_blks();
+    int get_Q1_base_size();     // plain encoder size, when optimizing
+
+    int get_num_bars();         // measures in the decoded or encoded Q1 data
+    const msq_conv_stats& get_stats();
+    const uint8_t* get_Q1_data();
+
+    int get_SysEx_size();       // bytes in the SysEx track, all blocks
+    double get_transfer_time(double blk_delay_ms);  // upload time in ms
+    
+    bool write_smf(juce::OutputStream& out);   // single write, replaces writeTo
+    bool write_syx(juce::OutputStream& out);   // single write, replaces write_RawSysEx
+    
+    //  Tempo changes of the source SMF after smf_to_msq_syx, at 120 PPQN.
+    //  Load a saved map before msq_syx_to_smf to write it back instead
+    //  of the fixed 100 BPM
+    //
+    MSQ_TempoMap& get_tempo_map();
+    
+    // bar starts in get_Q1_data(), made by msq_syx_to_smf
+    MSQ_BarIndex& get_bar_index();
+    const msq_fingerprint& get_fingerprint();   // of the decoded Q1 data
+    
+    // smf_to_msq_syx counts its MSQ_STAGE_s on perf, 0 for none
+    void set_perf_count(MSQ_PerfCount* perf);
     
 private:
-    bool valid_Q1_data;
     bool raw_sysex;
     bool standard_midi;
 
-    int num_syx_blks;    // includes FCB and all PD blocks
-    int q1_data_size;    // decoded size in bytes, not encoded size
- 
-    uint8_t* full_q1_data;
+    msq_conv_ctx* ctx;
+    bool own_ctx;
+    MSQ_PerfCount* perf_count;
     
-    uint32_t filt_opts;
+    MSQ_TempoMap tempo_map;
+    MSQ_BarIndex bar_index;
+    MSQ_Fingerprint fingerprint;
+    
+    void build_tempo_map();
 
     int insert_Q1_block_break(uint8_t* q_ptr, int* blk_count, bool track_end);
     int insert_Q1_delta(uint8_t* q_ptr, int m_delta, int to_meas_end, int* ticks_tm,  int* blk_count);
@@ -88,7 +222,18 @@ private:
     //  Creates concatenated MSQ-100 Q1 FCB + PDB raw data blocks
     //  from Standard MIDI message sequence
     //
-    int convert_to_Q1_data(const juce::MidiMessageSequence& m_seq);
+    int convert_to_Q1_data(const std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs);
+    void encode_Q1_track(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs,
+                         uint32_t filters);
+
+    //  Reorders simultaneous events to favour running status
+    //  and drops time signatures that restate the current one
+    //
+    void optimize_Q1_order(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs);
+    void prune_time_sigs(std::vector<msq_tick_event>& events, const std::vector<msq_tick_event>& time_sigs);
+    uint32_t is_filtered(const msq_tick_event& ev);
+    void count_filtered(uint32_t filter);
+    void count_bar(int q1_pos, int* bar_start);
     
     //  Parse MSQ-100's Q1 Header + Phrase Data Block (PDB)
     //  to (Standard) MIDI message sequence
@@ -96,6 +241,19 @@ private:
     //  prior to calling this
     //
     int parse_Q1_data(juce::MidiMessageSequence& m_seq);
+    void make_Q1_track();
+    
+    int write_smf_track(int trk_num, uint8_t* dest);
+    void read_smf_events(const uint8_t* data, int size, bool time_sigs_only);
+
+    //  Checks and decodes SysEx blocks independently of each other,
+    //  so msq_syx_to_smf can fan them out over several threads
+    //
+    int decode_Q1_block(const juce::MidiMessage& mm, int m_id, uint8_t* blk_data, int* payload_size);
+    void decode_Q1_blocks(const juce::MidiMessageSequence* msyx, int first, int stride, int num_blks,
+                          uint8_t* blk_data, int* blk_size, int* blk_status);
+    void copy_Q1_blocks(int first, int stride, int num_blks,
+                        const uint8_t* blk_data, const int* blk_size, const int* blk_offset);
  
     // helper methods
     int encode_7_8_size(int size);
@@ -104,4 +262,46 @@ private:
     int encode_7_8_bytes(uint8_t* pdata, uint8_t* raw_data, int size);
     int decode_8_7_bytes(uint8_t* raw_data, uint8_t* pdata, int size);
     uint8_t byte_checksum(uint8_t* data, int size);
-};
\ No newline at end of file
+};
+
+
+//==============================================================================
+//  Reentrant conversions between SMF and MSQ-100 SysEx data in memory.
+//  All state of a call is in ctx and on the stack, so any number of
+//  threads can convert at once, each with its own ctx.
+//
+//  msq_convert_smf writes the dump of src_track to syx_out, and the
+//  source's tempo map to tempo_map if not 0.  msq_convert_syx writes
+//  a Format 0 SMF at n_timebase PPQN, with tempo_map's tempo if given,
+//  salvaging a damaged dump with DECODE_OPT_SALVAGE in filters, the
+//  report left in ctx.  It transcodes the Q1 data straight to SMF bytes,
+//  see MSQ_Transcode.h.  Both return FALSE if the source couldn't be
+//  converted.
+//
+bool msq_convert_smf(msq_conv_ctx& ctx, const void* smf_data, size_t smf_size, int src_track,
+                     uint32_t filters, MSQ_TempoMap* tempo_map, juce::OutputStream& syx_out);
+
+bool msq_convert_syx(msq_conv_ctx& ctx, const void* syx_data, size_t syx_size, short n_timebase,
+                     uint32_t filters, const MSQ_TempoMap* tempo_map, juce::OutputStream& smf_out);
+
+
+// one dump of msq_convert_smf_tracks
+typedef struct
+{
+    int src_track;
+    bool converted;
+    juce::MemoryBlock syx;
+    MSQ_TempoMap tempo_map;
+} msq_track_dump;
+
+//  Converts several tracks of one Format 1 SMF, each to its own dump,
+//  as msq_convert_smf would one at a time.  The SMF is parsed once and
+//  the tracks are encoded on up to num_threads threads (0 for one per
+//  core), each with its own ctx.  With src_tracks empty every track
+//  holding channel events is converted.  dumps gets one per track, in
+//  order; returns the number converted, -1 if the data is no SMF
+//
+int msq_convert_smf_tracks(const void* smf_data, size_t smf_size, const std::vector<int>& src_tracks,
+                           uint32_t filters, int num_threads, std::vector<msq_track_dump>& dumps);
+
+#endif /* defined(__msq_convert__MSQ_100__) */
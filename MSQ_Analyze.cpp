@@ -0,0 +1,301 @@
+//
+//  MSQ_Analyze.cpp
+//  msq_convert
+//
+//  Q1 statistics without output, see MSQ_Analyze.h
+//
+
+
+#include <string.h>
+#include <thread>
+
+#include "AppConfig.h"
+#include "MSQ_Analyze.h"
+#include "MSQ_Codec.h"
+
+
+MSQ_Analyze::MSQ_Analyze(int track, uint32_t filter_options)
+{
+    src_track = track;
+
+    // counting never builds the SysEx track, whatever else is asked for
+    filters = filter_options | ENCODE_OPT_COUNT;
+}
+
+
+MSQ_Analyze::~MSQ_Analyze()
+{
+}
+
+
+int MSQ_Analyze::add_path(const juce::File& path)
+{
+    juce::Array<juce::File> found;
+
+    if ( path.isDirectory() )
+        path.findChildFiles(found, juce::File::findFiles, TRUE);
+    else
+        found.add(path);
+
+    int num_added = 0;
+
+    for (int f = 0; f < found.size(); f++)
+    {
+        msq_analysis result;
+
+        // a directory's .SYX and .MID files too
+        if ( path.isDirectory() && !found.getReference(f).hasFileExtension(".syx;.mid") ) continue;
+
+        result.path = found.getReference(f).getFullPathName();
+        result.name = path.isDirectory() ? found.getReference(f).getRelativePathFrom(path)
+                                         : found.getReference(f).getFileName();
+        result.valid = FALSE;
+        results.push_back(result);
+        num_added++;
+    }
+
+    return (num_added);
+}
+
+
+void MSQ_Analyze::run(int num_threads)
+{
+    if (num_threads <= 0)
+        num_threads = juce::jmax (1, (int) std::thread::hardware_concurrency());
+    num_threads = juce::jmin (num_threads, (int) results.size());
+
+    if (num_threads > 1)
+    {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < num_threads; t++)
+            workers.push_back(std::thread(&MSQ_Analyze::analyze_files, this, t, num_threads));
+        for (int t = 0; t < num_threads; t++)
+            workers[t].join();
+    }
+    else
+    {
+        analyze_files(0, 1);
+    }
+}
+
+
+// every num_threads-th file, starting at thread_num
+void MSQ_Analyze::analyze_files(int thread_num, int num_threads)
+{
+    // too big for a thread's stack
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+
+    for (size_t f = thread_num; f < results.size(); f += num_threads)
+        analyze_file(*ctx, &results[f]);
+
+    delete ctx;
+}
+
+
+//  Size, bars and longest bar of decoded Q1 data, block headers and end
+//  marks left out, the same for a dump and for an SMF converted to one
+//
+static void measure_Q1_data(const uint8_t* q1_data, int q1_data_size, msq_analysis* result)
+{
+    MSQ_BarIndex bar_index;
+
+    result->q1_size = q1_data_size;
+    result->num_bars = bar_index.build(q1_data, q1_data_size);
+    result->stats.longest_bar = 0;
+    result->stats.longest_bar_num = 0;
+
+    for (int b = 0; b < bar_index.get_num_bars(); b++)
+    {
+        const int bar_size = bar_index.get_bar(b + 1).pos - bar_index.get_bar(b).pos;
+        if (bar_size > result->stats.longest_bar)
+        {
+            result->stats.longest_bar = bar_size;
+            result->stats.longest_bar_num = b;
+        }
+    }
+}
+
+
+void MSQ_Analyze::analyze_file(msq_conv_ctx& ctx, msq_analysis* result)
+{
+    MSQ_100_SysEx msq_sysex (ctx);
+
+    juce::MemoryMappedFile src_map (juce::File (result->path), juce::MemoryMappedFile::readOnly);
+    if (src_map.getData() == 0) return;
+
+    const msq_codec* codec = msq_sniff((const uint8_t*) src_map.getData(),
+                                       (int) juce::jmin (src_map.getSize(), (size_t) MSQ_SNIFF_SIZE));
+    if (codec == 0) return;
+
+    if (codec->format == MSQ_FMT_SMF)
+    {
+        msq_sysex.read_smf_track(src_map.getData(), src_map.getSize(), src_track);
+        if (!msq_sysex.getNumTracks()) return;
+
+        msq_sysex.smf_to_msq_syx(msq_sysex.prepare_smf_track(src_track), filters);
+
+        result->source_type = MSQ_ANALYZE_SRC_MID;
+        result->stats = msq_sysex.get_stats();
+
+        // counting leaves the Q1 data as a .syx of it decodes
+        measure_Q1_data(ctx.q1_data, ctx.q1_data_size, result);
+    }
+    else if (codec->format == MSQ_FMT_Q1_SYSEX)
+    {
+        juce::MemoryInputStream src_stream (src_map.getData(), src_map.getSize(), FALSE);
+
+        msq_sysex.read_RawSysEx(src_stream);
+        msq_sysex.msq_syx_to_smf(FILTER_OPT_CLEAR);
+        if ( !msq_sysex.is_MSQ_100() ) return;
+
+        // the dump is what it is, only its events and bars to count
+        result->source_type = MSQ_ANALYZE_SRC_SYX;
+        std::memset(&result->stats, 0, sizeof(result->stats));
+
+        q1_parser parser;
+        q1_event ev;
+        q1_parse_init(&parser, msq_sysex.get_Q1_data(), msq_sysex.get_Q1_data_size());
+        while ( q1_parse_next(&parser, &ev) )
+        {
+            if (ev.status == 0xFF) continue;
+
+            result->stats.num_events++;
+            result->stats.chan_events[ev.status & 0x0F]++;
+        }
+
+        measure_Q1_data(msq_sysex.get_Q1_data(), msq_sysex.get_Q1_data_size(), result);
+    }
+    else
+    {
+        return;
+    }
+
+    result->num_blks = msq_sysex.get_num_syx_blks();
+    result->valid = TRUE;
+}
+
+
+int MSQ_Analyze::get_num_results()
+{
+    return (int) results.size();
+}
+
+
+const msq_analysis& MSQ_Analyze::get_result(int idx)
+{
+    return results[idx];
+}
+
+
+// 1-16 as in "1,2,10"
+static juce::String channel_list(const msq_conv_stats& stats)
+{
+    juce::String list;
+
+    for (int c = 0; c < 16; c++)
+    {
+        if (!stats.chan_events[c]) continue;
+        if ( list.isNotEmpty() ) list += ",";
+        list += juce::String (c + 1);
+    }
+
+    return ( list.isNotEmpty() ) ? list : juce::String ("-");
+}
+
+
+void MSQ_Analyze::print_table(std::ostream& out)
+{
+    int num_valid = 0;
+
+    out << "blocks  Q1 bytes  bars  longest bar   events  prg  ctl  bnd  aft  chn  sysex  cut  channels  file" << std::endl;
+
+    for (size_t f = 0; f < results.size(); f++)
+    {
+        const msq_analysis& r = results[f];
+        char line[160];
+
+        if (!r.valid)
+        {
+            out << "     -         -     -            -        -    -    -    -    -    -      -    -  -         "
+                << r.name << std::endl;
+            continue;
+        }
+
+        // bars counted from 1, as the MSQ-100 shows them
+        snprintf(line, sizeof(line), "%6d  %8d  %4d  %4d @ %4d  %7u  %3u  %3u  %3u  %3u  %3u  %5u  %3u  ",
+                 r.num_blks, r.q1_size, r.num_bars, r.stats.longest_bar, r.stats.longest_bar_num + 1,
+                 r.stats.num_events, r.stats.num_prgchng, r.stats.num_ccntrls, r.stats.num_ptchbnd,
+                 r.stats.num_aftrtch, r.stats.num_channel, r.stats.num_sysex, r.stats.num_cut);
+
+        out << line << channel_list(r.stats).paddedRight(' ', 8) << "  " << r.name << std::endl;
+        num_valid++;
+    }
+
+    out << num_valid << " of " << results.size() << " files analyzed" << std::endl;
+}
+
+
+static void print_json_string(std::ostream& out, const juce::String& str)
+{
+    out << '"';
+    for (const char* s = str.toRawUTF8(); *s; s++)
+    {
+        if ( (*s == '"') || (*s == '\\') )
+            out << '\\' << *s;
+        else if ( (unsigned char) *s < 0x20 )
+            out << ' ';
+        else
+            out << *s;
+    }
+    out << '"';
+}
+
+
+void MSQ_Analyze::print_json(std::ostream& out)
+{
+    out << "[" << std::endl;
+
+    for (size_t f = 0; f < results.size(); f++)
+    {
+        const msq_analysis& r = results[f];
+
+        out << "  { \"file\": ";
+        print_json_string(out, r.name);
+
+        if (r.valid)
+        {
+            out << ", \"source\": \"" << ((r.source_type == MSQ_ANALYZE_SRC_MID) ? "mid" : "syx") << "\""
+                << ", \"blocks\": " << r.num_blks
+                << ", \"q1_bytes\": " << r.q1_size
+                << ", \"bars\": " << r.num_bars
+                << ", \"longest_bar\": { \"bar\": " << (r.stats.longest_bar_num + 1)
+                << ", \"bytes\": " << r.stats.longest_bar << " }"
+                << ", \"events\": " << r.stats.num_events
+                << ", \"filtered\": { \"program\": " << r.stats.num_prgchng
+                << ", \"control\": " << r.stats.num_ccntrls
+                << ", \"bend\": " << r.stats.num_ptchbnd
+                << ", \"aftertouch\": " << r.stats.num_aftrtch
+                << ", \"channel\": " << r.stats.num_channel
+                << ", \"sysex\": " << r.stats.num_sysex << " }"
+                << ", \"cut\": " << r.stats.num_cut
+                << ", \"channels\": {";
+
+            bool first = TRUE;
+            for (int c = 0; c < 16; c++)
+            {
+                if (!r.stats.chan_events[c]) continue;
+                out << (first ? " " : ", ") << "\"" << (c + 1) << "\": " << r.stats.chan_events[c];
+                first = FALSE;
+            }
+            out << (first ? "}" : " }");
+        }
+        else
+        {
+            out << ", \"error\": \"not a MIDI file or MSQ-100 dump\"";
+        }
+
+        out << " }" << ((f + 1 < results.size()) ? "," : "") << std::endl;
+    }
+
+    out << "]" << std::endl;
+}
@@ -0,0 +1,66 @@
+//
+//  MSQ_Analyze.h
+//  msq_convert
+//
+//  Dry run over SMF files and MSQ-100 dumps: what the Q1 data comes to
+//  (blocks, bytes, bars, what the filters leave out, channels used) without
+//  framing SysEx or writing anything.  Files go to several threads, each
+//  converting on its own msq_conv_ctx
+//
+
+#ifndef __msq_convert__MSQ_Analyze__
+#define __msq_convert__MSQ_Analyze__
+
+#include <iostream>
+#include <vector>
+
+#include "MSQ_100.h"
+
+
+#define MSQ_ANALYZE_SRC_SYX   0
+#define MSQ_ANALYZE_SRC_MID   1
+
+
+// one per file
+struct msq_analysis
+{
+    juce::String path;
+    juce::String name;       // as printed, relative to the directory given
+    bool valid;              // FALSE if not an SMF or Q1 dump, or unreadable
+    int source_type;         // MSQ_ANALYZE_SRC_...
+    int num_blks;            // FCB included
+    int q1_size;             // decoded Q1 data, FCB and phrase data, for SMF as well
+    int num_bars;
+    msq_conv_stats stats;
+};
+
+
+class MSQ_Analyze
+{
+public:
+    MSQ_Analyze(int src_track, uint32_t filters);
+
+    ~MSQ_Analyze();
+
+    // a file, or every .mid and .syx below a directory
+    int add_path(const juce::File& path);
+
+    // 0 threads for one per core
+    void run(int num_threads);
+
+    int get_num_results();
+    const msq_analysis& get_result(int idx);
+
+    void print_table(std::ostream& out);
+    void print_json(std::ostream& out);
+
+private:
+    int src_track;
+    uint32_t filters;
+    std::vector<msq_analysis> results;
+
+    void analyze_files(int thread_num, int num_threads);
+    void analyze_file(msq_conv_ctx& ctx, msq_analysis* result);
+};
+
+#endif /* defined(__msq_convert__MSQ_Analyze__) */
@@ -0,0 +1,167 @@
+//
+//  MSQ_BarIndex.cpp
+//  msq_convert
+//
+//  Bar start index of Q1 data, see MSQ_BarIndex.h
+//
+
+
+#include <stdio.h>
+
+#include "MSQ_BarIndex.h"
+
+
+MSQ_BarIndex::MSQ_BarIndex()
+{
+    q1_size = 0;
+    q1_data_hash = 0;
+}
+
+
+MSQ_BarIndex::~MSQ_BarIndex()
+{
+}
+
+
+void MSQ_BarIndex::clear()
+{
+    bars.clear();
+    q1_size = 0;
+    q1_data_hash = 0;
+}
+
+
+// FNV-1a, only to tell a stale index file from a matching one
+uint32_t MSQ_BarIndex::q1_hash(const uint8_t* q1_data, int q1_data_size)
+{
+    uint32_t hash = 2166136261UL;
+
+    for (int i = 0; i < q1_data_size; i++)
+    {
+        hash ^= q1_data[i];
+        hash *= 16777619UL;
+    }
+
+    return (hash);
+}
+
+
+void MSQ_BarIndex::begin(q1_parser* parser)
+{
+    q1_size = parser->size;
+    q1_data_hash = q1_hash(parser->data, parser->size);
+
+    // every 0xF9 comes after a time byte
+    bars.resize(q1_size / 2 + 2);
+    q1_parse_bars(parser, &bars[0], (int) bars.size());
+}
+
+
+void MSQ_BarIndex::end(const q1_parser* parser)
+{
+    int num_entries = parser->num_bars + 1;
+    if (num_entries > parser->max_bars)
+        num_entries = parser->max_bars;
+
+    bars.resize(num_entries);
+}
+
+
+int MSQ_BarIndex::build(const uint8_t* q1_data, int q1_data_size)
+{
+    q1_parser parser;
+    q1_event ev;
+
+    q1_parse_init(&parser, q1_data, q1_data_size);
+    begin(&parser);
+    while ( q1_parse_next(&parser, &ev) )
+        ;
+    end(&parser);
+
+    return get_num_bars();
+}
+
+
+int MSQ_BarIndex::get_num_bars() const
+{
+    return bars.empty() ? 0 : (int) bars.size() - 1;
+}
+
+
+const q1_bar& MSQ_BarIndex::get_bar(int bar_num) const
+{
+    return bars[bar_num];
+}
+
+
+bool MSQ_BarIndex::seek(q1_parser* parser, int bar_num) const
+{
+    if ( (bar_num < 0) || (bar_num >= (int) bars.size()) ) return FALSE;
+
+    q1_parse_seek(parser, &bars[bar_num], bar_num);
+
+    return TRUE;
+}
+
+
+bool MSQ_BarIndex::save(const char* path) const
+{
+    msq_bars_hdr hdr;
+    hdr.magic = MSQ_BARS_MAGIC;
+    hdr.version = MSQ_BARS_VERSION;
+    hdr.num_bars = (uint32_t) get_num_bars();
+    hdr.q1_size = (uint32_t) q1_size;
+    hdr.q1_hash = q1_data_hash;
+
+    FILE* bars_file = fopen(path, "wb");
+    if (bars_file == 0) return FALSE;
+
+    bool written = (fwrite(&hdr, sizeof(hdr), 1, bars_file) == 1);
+    if ( written && !bars.empty() )
+        written = (fwrite(&bars[0], sizeof(q1_bar), bars.size(), bars_file) == bars.size());
+
+    return ( (fclose(bars_file) == 0) && written );
+}
+
+
+bool MSQ_BarIndex::load(const char* path, const uint8_t* q1_data, int q1_data_size)
+{
+    msq_bars_hdr hdr;
+
+    clear();
+
+    FILE* bars_file = fopen(path, "rb");
+    if (bars_file == 0) return FALSE;
+
+    bool valid = (fread(&hdr, sizeof(hdr), 1, bars_file) == 1)
+                 && (hdr.magic == MSQ_BARS_MAGIC) && (hdr.version == MSQ_BARS_VERSION)
+                 && (hdr.q1_size == (uint32_t) q1_data_size)
+                 && (hdr.num_bars <= (uint32_t) q1_data_size / 2 + 1)
+                 && (hdr.q1_hash == q1_hash(q1_data, q1_data_size));
+
+    if (valid)
+    {
+        bars.resize(hdr.num_bars + 1);
+        valid = (fread(&bars[0], sizeof(q1_bar), bars.size(), bars_file) == bars.size());
+    }
+    fclose(bars_file);
+
+    for (size_t i = 0; valid && (i < bars.size()); i++)
+    {
+        // offsets out of the data would make the parser read past it
+        if ( (bars[i].pos < Q1_PARSE_START) || (bars[i].pos > q1_data_size) )
+            valid = FALSE;
+    }
+
+    if (valid)
+    {
+        q1_size = q1_data_size;
+        q1_data_hash = hdr.q1_hash;
+    }
+    else
+    {
+        clear();
+    }
+
+    return (valid);
+}
@@ -0,0 +1,74 @@
+//
+//  MSQ_BarIndex.h
+//  msq_convert
+//
+//  Bar start offsets of a dump's Q1 data, so a player or editor can
+//  start decoding at any bar instead of walking from byte 36.  The
+//  index can be saved next to the .syx, it carries the size and a hash
+//  of the Q1 data it was made from.  Plain C++, see MSQ_Q1.h
+//
+
+#ifndef __msq_convert__MSQ_BarIndex__
+#define __msq_convert__MSQ_BarIndex__
+
+#include <vector>
+
+#include "MSQ_Q1.h"
+
+
+#define MSQ_BARS_MAGIC      0x4253514DUL   // 'MSQB'
+#define MSQ_BARS_VERSION    1
+
+
+// bar index file layout: header, then num_bars + 1 q1_bar entries
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_bars;
+    uint32_t q1_size;
+    uint32_t q1_hash;
+} msq_bars_hdr;
+
+
+class MSQ_BarIndex
+{
+public:
+    MSQ_BarIndex();
+
+    ~MSQ_BarIndex();
+
+    void clear();
+
+    //  Building while decoding: begin() hooks the index into a parser
+    //  fresh from q1_parse_init, end() after the parse is through
+    //
+    void begin(q1_parser* parser);
+    void end(const q1_parser* parser);
+
+    // on demand, parses the Q1 data once
+    int build(const uint8_t* q1_data, int q1_data_size);
+
+    //  Bars 0 to get_num_bars() - 1 hold events, one more entry marks
+    //  where the last 0xF9 leaves off
+    //
+    int get_num_bars() const;
+    const q1_bar& get_bar(int bar_num) const;
+
+    // returns FALSE if bar_num isn't indexed
+    bool seek(q1_parser* parser, int bar_num) const;
+
+    bool save(const char* path) const;
+
+    // fails if the file was made from other Q1 data
+    bool load(const char* path, const uint8_t* q1_data, int q1_data_size);
+
+    static uint32_t q1_hash(const uint8_t* q1_data, int q1_data_size);
+
+private:
+    std::vector<q1_bar> bars;
+    int q1_size;
+    uint32_t q1_data_hash;
+};
+
+#endif /* defined(__msq_convert__MSQ_BarIndex__) */
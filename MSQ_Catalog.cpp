@@ -0,0 +1,337 @@
+//
+//  MSQ_Catalog.cpp
+//  msq_convert
+//
+//  Binary index of an archive of MSQ-100 SysEx dumps and SMF files
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "AppConfig.h"
+#include "MSQ_Catalog.h"
+#include "MSQ_Codec.h"
+
+
+MSQ_Catalog::MSQ_Catalog()
+{
+    hdr = 0;
+    entries = 0;
+    names = 0;
+}
+
+
+MSQ_Catalog::~MSQ_Catalog()
+{
+}
+
+
+//  Walks the archive, converting each file once.  SMF files are converted
+//  to SysEx with the default options and then decoded again, so both kinds
+//  of source are described the same way, as the dump the MSQ-100 gets
+//
+int MSQ_Catalog::build_index(const juce::File& archive_dir, const juce::File& index_file)
+{
+    juce::Array<juce::File> found;
+    std::vector<msq_catalog_entry> new_entries;
+    juce::MemoryOutputStream new_names;
+
+    // any case of extension, old archives have .SYX and .MID
+    archive_dir.findChildFiles(found, juce::File::findFiles, TRUE);
+
+    for (int f = 0; f < found.size(); f++)
+    {
+        const juce::File& src_file = found.getReference(f);
+        MSQ_100_SysEx msq_sysex;
+        msq_catalog_entry entry;
+
+        if ( !src_file.hasFileExtension(".syx;.mid") ) continue;
+
+        std::memset(&entry, 0, sizeof(entry));
+
+        juce::MemoryMappedFile src_map (src_file, juce::MemoryMappedFile::readOnly);
+        if (src_map.getData() == 0) continue;
+
+        // by content, anything but SMF and Q1 dumps is left out unconverted
+        const msq_codec* codec = msq_sniff((const uint8_t*) src_map.getData(),
+                                           (int) juce::jmin (src_map.getSize(), (size_t) MSQ_SNIFF_SIZE));
+        if (codec == 0) continue;
+
+        if (codec->format == MSQ_FMT_SMF)
+        {
+            entry.source_type = MSQ_CATALOG_SRC_MID;
+            msq_sysex.read_smf_track(src_map.getData(), src_map.getSize(), 1);
+            if (!msq_sysex.getNumTracks()) continue;
+
+            msq_sysex.smf_to_msq_syx(msq_sysex.prepare_smf_track(1), FILTER_OPT_CLEAR);
+        }
+        else if (codec->format == MSQ_FMT_Q1_SYSEX)
+        {
+            juce::MemoryInputStream src_stream (src_map.getData(), src_map.getSize(), FALSE);
+
+            entry.source_type = MSQ_CATALOG_SRC_SYX;
+            msq_sysex.read_RawSysEx(src_stream);
+        }
+        else
+        {
+            continue;
+        }
+
+        if ( !index_dump(msq_sysex, &entry) ) continue;
+
+        const juce::String name (src_file.getRelativePathFrom(archive_dir));
+        entry.name_offset = (uint32_t) new_names.getDataSize();
+        new_names.write(name.toRawUTF8(), strlen(name.toRawUTF8()) + 1);
+
+        new_entries.push_back(entry);
+    }
+
+    msq_catalog_hdr new_hdr;
+    std::memset(&new_hdr, 0, sizeof(new_hdr));
+    new_hdr.magic = MSQ_CATALOG_MAGIC;
+    new_hdr.version = MSQ_CATALOG_VERSION;
+    new_hdr.num_entries = (uint32_t) new_entries.size();
+    new_hdr.entry_size = sizeof(msq_catalog_entry);
+    new_hdr.names_offset = sizeof(msq_catalog_hdr) + new_hdr.num_entries * sizeof(msq_catalog_entry);
+    new_hdr.names_size = (uint32_t) new_names.getDataSize();
+
+    // the index may be mapped right now, let go of it first
+    mapped_index = 0;
+    hdr = 0;
+
+    index_file.deleteFile();
+    juce::ScopedPointer <juce::FileOutputStream> index_stream (index_file.createOutputStream());
+    if (index_stream == 0) return (-1);
+
+    index_stream->write(&new_hdr, sizeof(new_hdr));
+    if (new_hdr.num_entries)
+        index_stream->write(&new_entries[0], new_hdr.num_entries * sizeof(msq_catalog_entry));
+    index_stream->write(new_names.getData(), new_names.getDataSize());
+    index_stream->flush();
+
+    return (int) new_hdr.num_entries;
+}
+
+
+// fills in entry from SysEx data held in the first track
+bool MSQ_Catalog::index_dump(MSQ_100_SysEx& msq_sysex, msq_catalog_entry* entry)
+{
+    entry->syx_size = msq_sysex.get_SysEx_size();
+
+    msq_sysex.msq_syx_to_smf(FILTER_OPT_CLEAR);
+    if ( !msq_sysex.is_MSQ_100() ) return FALSE;
+
+    entry->num_blks = (uint16_t) msq_sysex.get_num_syx_blks();
+    entry->q1_size = msq_sysex.get_Q1_data_size();
+    entry->num_bars = (uint16_t) msq_sysex.get_num_bars();
+
+    // FNV-1a
+    const uint8_t* q1_data = msq_sysex.get_Q1_data();
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint32_t i = 0; i < entry->q1_size; i++)
+    {
+        hash ^= q1_data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    entry->content_hash = hash;
+    entry->fingerprint = msq_sysex.get_fingerprint();
+
+    const juce::MidiMessageSequence& m_seq = *msq_sysex.getTrack(0);
+
+    for (int j = 0; j < m_seq.getNumEvents(); j++)
+    {
+        const juce::MidiMessage& mm = m_seq.getEventPointer(j)->message;
+
+        if ( mm.isTimeSignatureMetaEvent() )
+        {
+            int numerator, denominator;
+            mm.getTimeSignatureInfo(numerator, denominator);
+
+            if (entry->num_sigs < MSQ_CATALOG_MAX_SIGS)
+                entry->sigs[entry->num_sigs] = (uint8_t) numerator;
+            if (entry->num_sigs < 0xFF)
+                entry->num_sigs++;
+            continue;
+        }
+
+        if ( mm.getChannel() )
+            entry->channel_mask |= (uint16_t)(1 << (mm.getChannel() - 1));
+
+        if ( mm.isNoteOn() )
+            entry->num_notes++;
+        else if ( mm.isController() )
+            entry->num_ctrls++;
+        else if ( mm.isProgramChange() )
+            entry->num_progs++;
+        else if ( mm.isPitchWheel() )
+            entry->num_bends++;
+        else if ( mm.isAftertouch() || mm.isChannelPressure() )
+            entry->num_touch++;
+    }
+
+    return TRUE;
+}
+
+
+bool MSQ_Catalog::open_index(const juce::File& index_file)
+{
+    hdr = 0;
+    entries = 0;
+    names = 0;
+
+    mapped_index = new juce::MemoryMappedFile (index_file, juce::MemoryMappedFile::readOnly);
+
+    const uint8_t* index_data = (const uint8_t*) mapped_index->getData();
+    const size_t index_size = mapped_index->getSize();
+
+    if ( (index_data == 0) || (index_size < sizeof(msq_catalog_hdr)) ) return FALSE;
+
+    const msq_catalog_hdr* h = (const msq_catalog_hdr*) index_data;
+
+    if ( (h->magic != MSQ_CATALOG_MAGIC) || (h->version != MSQ_CATALOG_VERSION)
+        || (h->entry_size != sizeof(msq_catalog_entry)) ) return FALSE;
+
+    if ( ((size_t) h->names_offset + h->names_size > index_size)
+        || (sizeof(msq_catalog_hdr) + (size_t) h->num_entries * sizeof(msq_catalog_entry) > h->names_offset) ) return FALSE;
+
+    // names are NUL terminated, the last one inside the block too
+    if ( h->names_size && (index_data[(size_t) h->names_offset + h->names_size - 1] != 0x00) ) return FALSE;
+
+    const msq_catalog_entry* e = (const msq_catalog_entry*) (index_data + sizeof(msq_catalog_hdr));
+
+    for (uint32_t i = 0; i < h->num_entries; i++)
+    {
+        if (e[i].name_offset >= h->names_size) return FALSE;
+    }
+
+    hdr = h;
+    entries = e;
+    names = (const char*) (index_data + h->names_offset);
+
+    return TRUE;
+}
+
+
+int MSQ_Catalog::get_num_entries()
+{
+    return hdr ? (int) hdr->num_entries : 0;
+}
+
+
+const msq_catalog_entry* MSQ_Catalog::get_entry(int idx)
+{
+    return &entries[idx];
+}
+
+
+const char* MSQ_Catalog::get_name(int idx)
+{
+    return &names[entries[idx].name_offset];
+}
+
+
+// splits "blocks>100" or "sig=7/4" into key, op and value(s)
+bool MSQ_Catalog::parse_term(const juce::String& term, char* key, char* op, int* value, int* value2)
+{
+    const char* t = term.toRawUTF8();
+    int k = 0;
+
+    while ( *t && (*t != '=') && (*t != '<') && (*t != '>') )
+    {
+        if (k < 7) key[k++] = *t;
+        ++t;
+    }
+    key[k] = '\0';
+
+    if ( !*t || !k ) return FALSE;
+    *op = *t++;
+
+    if ( (*t < '0') || (*t > '9') ) return FALSE;
+    *value = std::atoi(t);
+
+    *value2 = 4;
+    while ( (*t >= '0') && (*t <= '9') ) ++t;
+    if (*t == '/')
+        *value2 = std::atoi(++t);
+
+    return TRUE;
+}
+
+
+bool MSQ_Catalog::is_valid_query(const juce::StringArray& terms)
+{
+    for (int q = 0; q < terms.size(); q++)
+    {
+        char key[8], op;
+        int value, value2;
+
+        if ( !parse_term(terms[q], key, &op, &value, &value2) ) return FALSE;
+
+        if ( strcmp(key, "sig") && strcmp(key, "chan") && strcmp(key, "blocks") && strcmp(key, "bars")
+            && strcmp(key, "size") && strcmp(key, "syx") && strcmp(key, "notes") ) return FALSE;
+
+        // a dump has several of these, only "has one equal to" makes sense
+        if ( (!strcmp(key, "sig") || !strcmp(key, "chan")) && (op != '=') ) return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+bool MSQ_Catalog::matches_query(const msq_catalog_entry* entry, const juce::StringArray& terms)
+{
+    for (int q = 0; q < terms.size(); q++)
+    {
+        char key[8], op;
+        int value, value2;
+        int field = 0;
+
+        if ( !parse_term(terms[q], key, &op, &value, &value2) ) return FALSE;
+
+        if ( (!strcmp(key, "sig") || !strcmp(key, "chan")) && (op != '=') ) return FALSE;
+
+        if ( !strcmp(key, "sig") )
+        {
+            // any of the dump's time signatures, MSQ-100 only has x/4
+            bool found = FALSE;
+            int n = juce::jmin ((int) entry->num_sigs, MSQ_CATALOG_MAX_SIGS);
+
+            for (int s = 0; s < n; s++)
+                if ( (entry->sigs[s] == value) && (value2 == 4) ) found = TRUE;
+
+            if (!found) return FALSE;
+            continue;
+        }
+        else if ( !strcmp(key, "chan") )
+        {
+            if ( (value < 1) || (value > 16) || !(entry->channel_mask & (1 << (value - 1))) ) return FALSE;
+            continue;
+        }
+        else if ( !strcmp(key, "blocks") ) field = entry->num_blks;
+        else if ( !strcmp(key, "bars") )   field = entry->num_bars;
+        else if ( !strcmp(key, "size") )   field = (int) entry->q1_size;
+        else if ( !strcmp(key, "syx") )    field = (int) entry->syx_size;
+        else if ( !strcmp(key, "notes") )  field = (int) entry->num_notes;
+        else return FALSE;
+
+        if ( (op == '=') && (field != value) ) return FALSE;
+        if ( (op == '<') && (field >= value) ) return FALSE;
+        if ( (op == '>') && (field <= value) ) return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+void MSQ_Catalog::find_duplicates(int min_similarity, std::vector<int>& group_of)
+{
+    std::vector<msq_fingerprint> fps (get_num_entries());
+
+    for (int e = 0; e < get_num_entries(); e++)
+        fps[e] = entries[e].fingerprint;
+
+    msq_fp_group(fps, min_similarity, group_of);
+}
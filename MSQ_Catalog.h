@@ -0,0 +1,96 @@
+//
+//  MSQ_Catalog.h
+//  msq_convert
+//
+//  Binary index of an archive of MSQ-100 SysEx dumps and SMF files,
+//  answers queries from the memory mapped index alone
+//
+
+#ifndef __msq_convert__MSQ_Catalog__
+#define __msq_convert__MSQ_Catalog__
+
+#include <vector>
+
+#include "MSQ_100.h"
+
+
+#define MSQ_CATALOG_MAGIC     0x4351534DUL   // 'MSQC'
+#define MSQ_CATALOG_VERSION   3
+#define MSQ_CATALOG_MAX_SIGS  8
+
+#define MSQ_CATALOG_SRC_SYX   0
+#define MSQ_CATALOG_SRC_MID   1
+
+
+// index file layout: header, entry table, '\0' terminated file names
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t entry_size;     // sizeof(msq_catalog_entry)
+    uint32_t names_offset;   // from start of file
+    uint32_t names_size;
+    uint32_t reserved[2];
+} msq_catalog_hdr;
+
+
+// one per dump, describes the Q1 data as the MSQ-100 would get it
+typedef struct
+{
+    uint64_t content_hash;   // FNV-1a of the decoded Q1 data
+    uint32_t name_offset;    // into the names table
+    uint32_t syx_size;       // SysEx bytes, all blocks
+    uint32_t q1_size;        // decoded Q1 bytes
+    uint16_t num_blks;
+    uint16_t num_bars;
+    uint16_t channel_mask;   // bit 0 = channel 1
+    uint8_t  source_type;    // MSQ_CATALOG_SRC_SYX or _MID
+    uint8_t  num_sigs;       // time signature changes, all of them
+    uint8_t  sigs[MSQ_CATALOG_MAX_SIGS];  // beats per measure (x/4), first ones
+    uint32_t num_notes;
+    uint32_t num_ctrls;
+    uint32_t num_progs;
+    uint32_t num_bends;
+    uint32_t num_touch;      // poly and channel aftertouch
+    msq_fingerprint fingerprint;   // of the music, for finding copies
+} msq_catalog_entry;
+
+
+class MSQ_Catalog
+{
+public:
+    MSQ_Catalog();
+
+    ~MSQ_Catalog();
+
+    // converts every .syx and .mid file below archive_dir once
+    // returns number of files indexed, -1 if index can't be written
+    int build_index(const juce::File& archive_dir, const juce::File& index_file);
+
+    bool open_index(const juce::File& index_file);
+
+    int get_num_entries();
+    const msq_catalog_entry* get_entry(int idx);
+    const char* get_name(int idx);
+
+    // all terms must hold, e.g. "sig=7" "chan=10" "blocks>100"
+    // keys: sig chan blocks bars size syx notes, ops: = < >, sig and chan = only
+    bool matches_query(const msq_catalog_entry* entry, const juce::StringArray& terms);
+    bool is_valid_query(const juce::StringArray& terms);
+
+    // group_of[e] is the first entry entry e duplicates, or e, see msq_fp_group
+    void find_duplicates(int min_similarity, std::vector<int>& group_of);
+
+private:
+    juce::ScopedPointer<juce::MemoryMappedFile> mapped_index;
+
+    const msq_catalog_hdr* hdr;
+    const msq_catalog_entry* entries;
+    const char* names;
+
+    bool index_dump(MSQ_100_SysEx& msq_sysex, msq_catalog_entry* entry);
+    bool parse_term(const juce::String& term, char* key, char* op, int* value, int* value2);
+};
+
+#endif /* defined(__msq_convert__MSQ_Catalog__) */
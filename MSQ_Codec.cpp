@@ -0,0 +1,85 @@
+//
+//  MSQ_Codec.cpp
+//  msq_convert
+//
+//  Format table and sniffer, see MSQ_Codec.h
+//
+
+
+#include "MSQ_Codec.h"
+
+
+static const uint8_t smf_magic[] = { 'M', 'T', 'h', 'd' };
+
+// the dump starts with block 0, the FCB
+static const uint8_t q1_magic[] = { 0xF0, Q1_SYX_MAN_ID, Q1_SYX_FUNCT_TYPE, Q1_SYX_DATA_TYPE, 0x00 };
+
+static const uint8_t roland_magic[] = { 0xF0, Q1_SYX_MAN_ID };
+static const uint8_t sysex_magic[] = { 0xF0 };
+
+
+static const msq_codec codecs[MSQ_NUM_FORMATS] =
+{
+    { "Standard MIDI File", MSQ_FMT_SMF, MSQ_CODEC_TO_Q1, smf_magic, sizeof(smf_magic) },
+    { "MSQ-100 Q1 SysEx", MSQ_FMT_Q1_SYSEX, MSQ_CODEC_TO_SMF, q1_magic, sizeof(q1_magic) },
+    { "Roland SysEx", MSQ_FMT_ROLAND_SYSEX, MSQ_CODEC_NONE, roland_magic, sizeof(roland_magic) },
+    { "SysEx", MSQ_FMT_SYSEX, MSQ_CODEC_NONE, sysex_magic, sizeof(sysex_magic) }
+};
+
+
+const msq_codec* msq_get_codec(int format)
+{
+    return ( (format >= 0) && (format < MSQ_NUM_FORMATS) ) ? &codecs[format] : 0;
+}
+
+
+const msq_codec* msq_sniff(const uint8_t* data, int size)
+{
+    uint32_t candidates = (1UL << MSQ_NUM_FORMATS) - 1;
+
+    if (size > MSQ_SNIFF_SIZE)
+        size = MSQ_SNIFF_SIZE;
+
+    // a format whose magic is longer than the data can't match
+    for (int c = 0; c < MSQ_NUM_FORMATS; c++)
+    {
+        if (codecs[c].magic_size > size)
+            candidates &= ~(1UL << c);
+    }
+
+    for (int i = 0; (i < size) && candidates; i++)
+    {
+        for (int c = 0; c < MSQ_NUM_FORMATS; c++)
+        {
+            if ( (candidates & (1UL << c)) && (i < codecs[c].magic_size)
+                 && (codecs[c].magic[i] != data[i]) )
+                candidates &= ~(1UL << c);
+        }
+    }
+
+    const msq_codec* found = 0;
+
+    for (int c = 0; c < MSQ_NUM_FORMATS; c++)
+    {
+        if ( !(candidates & (1UL << c)) ) continue;
+
+        if ( !found || (codecs[c].magic_size > found->magic_size) )
+            found = &codecs[c];
+    }
+
+    return (found);
+}
+
+
+bool msq_sniff_q1_frame(const uint8_t* data, int size)
+{
+    // q1_magic less the message number
+    if (size < (int) sizeof(q1_magic) - 1) return FALSE;
+
+    for (int i = 0; i < (int) sizeof(q1_magic) - 1; i++)
+    {
+        if (data[i] != q1_magic[i]) return FALSE;
+    }
+
+    return TRUE;
+}
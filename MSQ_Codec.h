@@ -0,0 +1,64 @@
+//
+//  MSQ_Codec.h
+//  msq_convert
+//
+//  The sequencer data formats msqconvert knows, and a sniffer that
+//  tells them apart by their first bytes, so a file goes to the right
+//  converter whatever its extension says.  Plain C++.
+//
+//  The table is fixed: the direction picks one of the two converters
+//  built into msqconvert, other SysEx is only recognized and reported.
+//  A new format gets its entry here along with its converter.
+//
+
+#ifndef __msq_convert__MSQ_Codec__
+#define __msq_convert__MSQ_Codec__
+
+#include <stdint.h>
+
+#include "MSQ_Q1.h"
+
+
+#define MSQ_SNIFF_SIZE      16      // bytes the sniffer looks at, at most
+
+// what msqconvert does with a format, same values as its direction
+#define MSQ_CODEC_NONE      -1      // recognized only
+#define MSQ_CODEC_TO_SMF    0       // reverse, the MSQ-100 dump decoder
+#define MSQ_CODEC_TO_Q1     1       // forward, the Q1 encoder
+
+// the formats, in table order
+enum
+{
+    MSQ_FMT_SMF = 0,
+    MSQ_FMT_Q1_SYSEX,
+    MSQ_FMT_ROLAND_SYSEX,
+    MSQ_FMT_SYSEX,
+    MSQ_NUM_FORMATS
+};
+
+
+typedef struct
+{
+    const char* name;
+    int format;
+    int direction;              // MSQ_CODEC_...
+    const uint8_t* magic;       // leading bytes, up to MSQ_SNIFF_SIZE
+    int magic_size;
+} msq_codec;
+
+
+const msq_codec* msq_get_codec(int format);
+
+//  Walks the first bytes once, dropping formats as their magic stops
+//  matching.  Of all formats matching, the one with the longest magic
+//  wins, MSQ-100 SysEx over Roland over any SysEx.  Returns 0 for data
+//  no format matches.
+//
+const msq_codec* msq_sniff(const uint8_t* data, int size);
+
+//  TRUE if data starts with any MSQ-100 frame, F0 41 57 70 whatever the
+//  message number, for salvaging a dump that lost block 0
+//
+bool msq_sniff_q1_frame(const uint8_t* data, int size);
+
+#endif /* defined(__msq_convert__MSQ_Codec__) */
@@ -0,0 +1,503 @@
+//
+//  MSQ_FileIO.cpp
+//  msq_convert
+//
+//  Batched whole-file reads and writes for converting many files
+//
+//  With io_uring a batch costs two io_uring_enter calls: one submitting
+//  all the opens, one submitting each file's read or write hard linked
+//  to its close.  No per file syscalls, and no separate delete before
+//  rewriting an output file, O_TRUNC does that.
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+ #define MSQ_HAVE_URING 1
+#else
+ #define MSQ_HAVE_URING 0
+#endif
+
+#include "AppConfig.h"
+#include "MSQ_FileIO.h"
+
+
+// low bits of a completion's user_data, the rest is the msq_io_file
+#define MSQ_IO_OP_OPEN      0
+#define MSQ_IO_OP_RW        1
+#define MSQ_IO_OP_CLOSE     2
+#define MSQ_IO_OP_MASK      3
+
+
+MSQ_File_IO::MSQ_File_IO(bool try_uring)
+{
+    opens_pending = 0;
+    reads_pending = 0;
+    writes_pending = 0;
+    read_files = 0;
+    num_read_files = 0;
+
+    ring_fd = -1;
+    sq_ptr = cq_ptr = sqes_ptr = 0;
+    sq_map_size = cq_map_size = sqes_map_size = 0;
+    sq_queued = 0;
+
+    use_uring = try_uring && uring_setup();
+}
+
+
+MSQ_File_IO::~MSQ_File_IO()
+{
+    wait_reads();
+    wait_writes();
+    uring_release();
+}
+
+
+bool MSQ_File_IO::is_uring()
+{
+    return (use_uring);
+}
+
+
+void MSQ_File_IO::submit_reads(msq_io_file* files, int num_files)
+{
+    read_files = files;
+    num_read_files = num_files;
+
+    for (int f = 0; f < num_files; f++)
+    {
+        files[f].is_write = FALSE;
+        files[f].result = 0;
+        files[f].size = 0;
+        files[f].fd = -1;
+    }
+
+    if (!use_uring)
+    {
+        for (int f = 0; f < num_files; f++)
+            if (files[f].path.isNotEmpty()) posix_read(&files[f]);
+        return;
+    }
+
+#if MSQ_HAVE_URING
+    uring_open(files, num_files, O_RDONLY | O_CLOEXEC);
+
+    for (int f = 0; f < num_files; f++)
+    {
+        if (files[f].fd < 0) continue;
+
+        files[f].data.setSize(MSQ_IO_READ_SIZE);
+
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*) uring_get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = files[f].fd;
+        sqe->addr = (uint64_t)(uintptr_t) files[f].data.getData();
+        sqe->len = (uint32_t) files[f].data.getSize();
+        sqe->off = 0;
+        sqe->flags = IOSQE_IO_HARDLINK;   // close even after a short read
+        sqe->user_data = (uint64_t)(uintptr_t) &files[f] | MSQ_IO_OP_RW;
+
+        sqe = (struct io_uring_sqe*) uring_get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[f].fd;
+        sqe->user_data = (uint64_t)(uintptr_t) &files[f] | MSQ_IO_OP_CLOSE;
+
+        reads_pending++;
+    }
+
+    uring_submit(0);
+#endif
+}
+
+
+void MSQ_File_IO::wait_reads()
+{
+    while (reads_pending)
+        uring_reap(TRUE);
+
+    // a file filling the whole first read may have more to it
+    for (int f = 0; f < num_read_files; f++)
+    {
+        if ( use_uring && (read_files[f].result == 0) && (read_files[f].size == MSQ_IO_READ_SIZE) )
+            posix_read(&read_files[f]);
+    }
+    num_read_files = 0;
+}
+
+
+void MSQ_File_IO::submit_writes(msq_io_file* files, int num_files)
+{
+    for (int f = 0; f < num_files; f++)
+    {
+        files[f].is_write = TRUE;
+        files[f].result = 0;
+        files[f].fd = -1;
+    }
+
+    if (!use_uring)
+    {
+        for (int f = 0; f < num_files; f++)
+            if (files[f].path.isNotEmpty()) posix_write(&files[f]);
+        return;
+    }
+
+#if MSQ_HAVE_URING
+    uring_open(files, num_files, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+
+    for (int f = 0; f < num_files; f++)
+    {
+        if (files[f].fd < 0) continue;
+
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*) uring_get_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = files[f].fd;
+        sqe->addr = (uint64_t)(uintptr_t) files[f].data.getData();
+        sqe->len = (uint32_t) files[f].size;
+        sqe->off = 0;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = (uint64_t)(uintptr_t) &files[f] | MSQ_IO_OP_RW;
+
+        sqe = (struct io_uring_sqe*) uring_get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[f].fd;
+        sqe->user_data = (uint64_t)(uintptr_t) &files[f] | MSQ_IO_OP_CLOSE;
+
+        writes_pending++;
+    }
+
+    uring_submit(0);
+#endif
+}
+
+
+void MSQ_File_IO::wait_writes()
+{
+    while (writes_pending)
+        uring_reap(TRUE);
+}
+
+
+//==============================================================================
+// plain POSIX fallback, one file at a time
+
+void MSQ_File_IO::posix_read(msq_io_file* file)
+{
+    file->size = 0;
+    file->result = 0;
+
+    int fd = open(file->path.toRawUTF8(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        file->result = -errno;
+        return;
+    }
+
+    file->data.setSize(MSQ_IO_READ_SIZE);
+
+    for (;;)
+    {
+        if (file->size == file->data.getSize())
+            file->data.setSize(2 * file->data.getSize());
+
+        ssize_t n = read(fd, (char*) file->data.getData() + file->size, file->data.getSize() - file->size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            file->result = -errno;
+            break;
+        }
+        if (n == 0) break;
+
+        file->size += n;
+    }
+
+    close(fd);
+}
+
+
+void MSQ_File_IO::posix_write(msq_io_file* file)
+{
+    size_t done = 0;
+
+    file->result = 0;
+
+    int fd = open(file->path.toRawUTF8(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        file->result = -errno;
+        return;
+    }
+
+    while (done < file->size)
+    {
+        ssize_t n = write(fd, (const char*) file->data.getData() + done, file->size - done);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            file->result = -errno;
+            break;
+        }
+        done += n;
+    }
+
+    if ( (close(fd) < 0) && !file->result )
+        file->result = -errno;
+}
+
+
+//==============================================================================
+// io_uring, driven through the raw syscalls
+
+#if MSQ_HAVE_URING
+
+bool MSQ_File_IO::uring_setup()
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    ring_fd = (int) syscall(__NR_io_uring_setup, MSQ_IO_RING_SIZE, &params);
+    if (ring_fd < 0) return FALSE;
+
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_map_size > sq_map_size) sq_map_size = cq_map_size;
+        cq_map_size = 0;
+    }
+
+    sq_ptr = mmap(0, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        sq_ptr = 0;
+        uring_release();
+        return FALSE;
+    }
+
+    if (cq_map_size)
+    {
+        cq_ptr = mmap(0, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            cq_ptr = 0;
+            uring_release();
+            return FALSE;
+        }
+    }
+    else
+    {
+        cq_ptr = sq_ptr;
+    }
+
+    sqes_ptr = mmap(0, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED)
+    {
+        sqes_ptr = 0;
+        uring_release();
+        return FALSE;
+    }
+
+    sq_head = (unsigned*) ((char*) sq_ptr + params.sq_off.head);
+    sq_tail = (unsigned*) ((char*) sq_ptr + params.sq_off.tail);
+    sq_mask = (unsigned*) ((char*) sq_ptr + params.sq_off.ring_mask);
+    sq_array = (unsigned*) ((char*) sq_ptr + params.sq_off.array);
+    cq_head = (unsigned*) ((char*) cq_ptr + params.cq_off.head);
+    cq_tail = (unsigned*) ((char*) cq_ptr + params.cq_off.tail);
+    cq_mask = (unsigned*) ((char*) cq_ptr + params.cq_off.ring_mask);
+    cqes = (char*) cq_ptr + params.cq_off.cqes;
+
+    // open, read, write and close all need to be there (Linux 5.6)
+    const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, probe_size);
+    bool supported = FALSE;
+
+    if ( probe && (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0) )
+    {
+        const int needed_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+        supported = TRUE;
+
+        for (int n = 0; n < 4; n++)
+        {
+            if ( (needed_ops[n] > probe->last_op)
+                || !(probe->ops[needed_ops[n]].flags & IO_URING_OP_SUPPORTED) )
+                supported = FALSE;
+        }
+    }
+    free(probe);
+
+    if (!supported)
+    {
+        uring_release();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+void MSQ_File_IO::uring_release()
+{
+    if (sqes_ptr) munmap(sqes_ptr, sqes_map_size);
+    if (cq_ptr && (cq_ptr != sq_ptr)) munmap(cq_ptr, cq_map_size);
+    if (sq_ptr) munmap(sq_ptr, sq_map_size);
+    if (ring_fd >= 0) close(ring_fd);
+
+    sq_ptr = cq_ptr = sqes_ptr = 0;
+    ring_fd = -1;
+}
+
+
+// next free submission entry, zeroed, flushing the queue when full
+void* MSQ_File_IO::uring_get_sqe()
+{
+    unsigned tail = *sq_tail + sq_queued;
+
+    if ( tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask )
+    {
+        uring_submit(0);
+        tail = *sq_tail;
+    }
+
+    const unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &((struct io_uring_sqe*) sqes_ptr)[idx];
+
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[idx] = idx;
+    sq_queued++;
+
+    return sqe;
+}
+
+
+// hands queued entries to the kernel, waiting for wait_nr completions
+void MSQ_File_IO::uring_submit(unsigned wait_nr)
+{
+    unsigned to_submit = sq_queued;
+
+    __atomic_store_n(sq_tail, *sq_tail + sq_queued, __ATOMIC_RELEASE);
+    sq_queued = 0;
+
+    if (!to_submit && !wait_nr) return;
+
+    for (;;)
+    {
+        int ret = (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            to_submit -= juce::jmin (to_submit, (unsigned) ret);
+            if (!to_submit) break;
+        }
+        else if ( (errno == EAGAIN) || (errno == EBUSY) )
+        {
+            // completion queue full, make room
+            uring_reap(FALSE);
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+}
+
+
+// handles available completions, if there are none and wait is set
+// blocks for at least one
+void MSQ_File_IO::uring_reap(bool wait)
+{
+    unsigned head = *cq_head;
+
+    if ( wait && (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) )
+        uring_submit(1);
+
+    while ( head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) )
+    {
+        const struct io_uring_cqe* cqe = &((const struct io_uring_cqe*) cqes)[head & *cq_mask];
+        msq_io_file* file = (msq_io_file*)(uintptr_t)(cqe->user_data & ~(uint64_t) MSQ_IO_OP_MASK);
+        const int res = cqe->res;
+
+        switch (cqe->user_data & MSQ_IO_OP_MASK)
+        {
+            case MSQ_IO_OP_OPEN:
+                if (res >= 0)
+                    file->fd = res;
+                else
+                    file->result = res;
+                opens_pending--;
+                break;
+
+            case MSQ_IO_OP_RW:
+                if (res < 0)
+                    file->result = res;
+                else if (file->is_write && ((size_t) res != file->size))
+                    file->result = -EIO;
+                else if (!file->is_write)
+                    file->size = res;
+                break;
+
+            case MSQ_IO_OP_CLOSE:
+                if ( (res < 0) && !file->result )
+                    file->result = res;
+                file->fd = -1;
+                if (file->is_write)
+                    writes_pending--;
+                else
+                    reads_pending--;
+                break;
+        }
+
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+
+// opens all files in one submission, waits for the descriptors
+void MSQ_File_IO::uring_open(msq_io_file* files, int num_files, int flags)
+{
+    for (int f = 0; f < num_files; f++)
+    {
+        if (files[f].path.isEmpty()) continue;
+
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*) uring_get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t) files[f].path.toRawUTF8();
+        sqe->len = 0644;
+        sqe->open_flags = flags;
+        sqe->user_data = (uint64_t)(uintptr_t) &files[f] | MSQ_IO_OP_OPEN;
+
+        opens_pending++;
+    }
+
+    uring_submit(0);
+
+    while (opens_pending)
+        uring_reap(TRUE);
+}
+
+#else
+
+bool MSQ_File_IO::uring_setup()                 { return FALSE; }
+void MSQ_File_IO::uring_release()               {}
+void* MSQ_File_IO::uring_get_sqe()              { return 0; }
+void MSQ_File_IO::uring_submit(unsigned)        {}
+void MSQ_File_IO::uring_reap(bool)              {}
+void MSQ_File_IO::uring_open(msq_io_file*, int, int) {}
+
+#endif
@@ -0,0 +1,88 @@
+//
+//  MSQ_FileIO.h
+//  msq_convert
+//
+//  Batched whole-file reads and writes for converting many files,
+//  io_uring backed on Linux with plain POSIX I/O as the fallback
+//
+
+#ifndef __msq_convert__MSQ_FileIO__
+#define __msq_convert__MSQ_FileIO__
+
+#include "juce_audio_basics.h"
+
+
+#define MSQ_IO_READ_SIZE    65536   // first read per file, grows if needed
+#define MSQ_IO_RING_SIZE    256     // io_uring submission queue entries
+
+
+// one file of a batch
+struct msq_io_file
+{
+    juce::String path;
+    juce::MemoryBlock data;   // contents read, or to be written
+    size_t size;              // valid bytes in data
+    int fd;
+    int result;               // 0, or -errno of the failing step
+    bool is_write;
+};
+
+
+class MSQ_File_IO
+{
+public:
+    MSQ_File_IO(bool try_uring);
+
+    ~MSQ_File_IO();
+
+    bool is_uring();      // io_uring backend active
+
+    //  Reads start with submit_reads and are complete once wait_reads
+    //  returns, writes likewise.  The files must stay put in between,
+    //  conversion can run meanwhile.  Writes replace existing files,
+    //  files with an empty path are skipped.
+    //
+    void submit_reads(msq_io_file* files, int num_files);
+    void wait_reads();
+
+    void submit_writes(msq_io_file* files, int num_files);
+    void wait_writes();
+
+private:
+    bool use_uring;
+    int opens_pending;
+    int reads_pending;
+    int writes_pending;
+
+    msq_io_file* read_files;   // batch of the last submit_reads
+    int num_read_files;
+
+    int ring_fd;
+    void* sq_ptr;
+    void* cq_ptr;
+    void* sqes_ptr;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_map_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    unsigned sq_queued;
+
+    bool uring_setup();
+    void uring_release();
+    void* uring_get_sqe();
+    void uring_submit(unsigned wait_nr);
+    void uring_reap(bool wait);
+    void uring_open(msq_io_file* files, int num_files, int flags);
+
+    void posix_read(msq_io_file* file);
+    void posix_write(msq_io_file* file);
+};
+
+#endif /* defined(__msq_convert__MSQ_FileIO__) */
@@ -0,0 +1,277 @@
+//
+//  MSQ_Fingerprint.cpp
+//  msq_convert
+//
+//  Musical content fingerprint of Q1 data, see MSQ_Fingerprint.h
+//
+
+
+#include <algorithm>
+
+#include "MSQ_Fingerprint.h"
+
+
+// murmur3 finalizer, spreads every input bit over the result
+static uint32_t fp_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35UL;
+    h ^= h >> 16;
+
+    return (h);
+}
+
+
+static void fp_hash_word(uint64_t* hash, uint32_t w)
+{
+    for (int b = 0; b < 4; b++)
+    {
+        *hash ^= (uint8_t)(w >> (8 * b));
+        *hash *= 0x100000001B3ULL;
+    }
+}
+
+
+MSQ_Fingerprint::MSQ_Fingerprint()
+{
+    begin();
+}
+
+
+MSQ_Fingerprint::~MSQ_Fingerprint()
+{
+}
+
+
+void MSQ_Fingerprint::begin()
+{
+    fp.exact = 0xCBF29CE484222325ULL;
+    fp.num_onsets = 0;
+    for (int k = 0; k < MSQ_FP_NUM_HASHES; k++)
+        fp.minhash[k] = MSQ_FP_EMPTY;
+
+    group.clear();
+    in_group = FALSE;
+    group_tick = 0;
+    for (int c = 0; c < 16; c++)
+    {
+        prev_onset_tick[c] = -1;
+        prev_onset_key[c] = 0;
+    }
+}
+
+
+void MSQ_Fingerprint::add(const q1_event& ev)
+{
+    if ( in_group && (ev.tick != group_tick) )
+        flush_group();
+
+    group_tick = ev.tick;
+    in_group = TRUE;
+
+    // data2 of 2 byte messages is whatever the parser left there
+    const uint8_t data2 = (ev.size == 3) ? ev.data2 : 0;
+    group.push_back(((uint32_t) ev.status << 16) | ((uint32_t) ev.data1 << 8) | data2);
+}
+
+
+void MSQ_Fingerprint::end()
+{
+    if (in_group)
+        flush_group();
+}
+
+
+//  Events at one tick go in sorted, so the order a sequencer or a
+//  filter left them in doesn't count, only what happens when
+//
+void MSQ_Fingerprint::flush_group()
+{
+    std::sort(group.begin(), group.end());
+
+    // FNV-1a over the tick and the sorted events
+    fp_hash_word(&fp.exact, (uint32_t) group_tick);
+    for (size_t e = 0; e < group.size(); e++)
+        fp_hash_word(&fp.exact, group[e]);
+
+    // notes struck here, against the lowest one of the channel's previous
+    // onset.  Time and interval only, so a copy shifted in time or
+    // transposed has the same shingles, per channel so a muted channel
+    // takes only its own along
+    int lowest_key[16];
+    for (int c = 0; c < 16; c++)
+        lowest_key[c] = -1;
+
+    for (size_t e = 0; e < group.size(); e++)
+    {
+        const uint8_t status = (uint8_t)(group[e] >> 16);
+        const uint8_t key = (uint8_t)(group[e] >> 8);
+        const int chan = status & 0x0F;
+
+        if ( ((status & 0xF0) != 0x90) || !(group[e] & 0xFF) ) continue;
+
+        if (prev_onset_tick[chan] >= 0)
+        {
+            const uint32_t dt = (uint32_t) std::min (group_tick - prev_onset_tick[chan], 0x3FFF);
+            const uint32_t interval = (uint32_t)(key - prev_onset_key[chan] + 128);
+            add_shingle(((uint32_t) chan << 28) | (dt << 14) | interval);
+        }
+        if (lowest_key[chan] < 0)
+            lowest_key[chan] = key;
+        fp.num_onsets++;
+    }
+
+    for (int c = 0; c < 16; c++)
+    {
+        if (lowest_key[c] < 0) continue;
+
+        prev_onset_tick[c] = group_tick;
+        prev_onset_key[c] = lowest_key[c];
+    }
+
+    group.clear();
+    in_group = FALSE;
+}
+
+
+void MSQ_Fingerprint::add_shingle(uint32_t shingle)
+{
+    for (int k = 0; k < MSQ_FP_NUM_HASHES; k++)
+    {
+        const uint32_t h = fp_mix(shingle ^ (0x9E3779B9UL * (uint32_t)(k + 1)));
+        if (h < fp.minhash[k])
+            fp.minhash[k] = h;
+    }
+}
+
+
+const msq_fingerprint& MSQ_Fingerprint::get() const
+{
+    return (fp);
+}
+
+
+const msq_fingerprint& MSQ_Fingerprint::build(const uint8_t* q1_data, int q1_data_size)
+{
+    q1_parser parser;
+    q1_event ev;
+
+    q1_parse_init(&parser, q1_data, q1_data_size);
+    begin();
+    while ( q1_parse_next(&parser, &ev) )
+        add(ev);
+    end();
+
+    return (fp);
+}
+
+
+int MSQ_Fingerprint::similarity(const msq_fingerprint& a, const msq_fingerprint& b)
+{
+    if (a.exact == b.exact) return 100;
+
+    // nothing to compare, no notes on one side or both
+    if ( (a.minhash[0] == MSQ_FP_EMPTY) || (b.minhash[0] == MSQ_FP_EMPTY) ) return 0;
+
+    int same = 0;
+    for (int k = 0; k < MSQ_FP_NUM_HASHES; k++)
+    {
+        if (a.minhash[k] == b.minhash[k])
+            same++;
+    }
+
+    return (100 * same) / MSQ_FP_NUM_HASHES;
+}
+
+
+static int fp_find(std::vector<int>& parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return (i);
+}
+
+
+// the lower index stays the root, so groups are named by their first entry
+static void fp_union(std::vector<int>& parent, int a, int b)
+{
+    a = fp_find(parent, a);
+    b = fp_find(parent, b);
+
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+
+void msq_fp_group(const std::vector<msq_fingerprint>& fps, int min_similarity,
+                  std::vector<int>& group_of)
+{
+    const int n = (int) fps.size();
+    std::vector<std::pair<uint64_t, int> > keys;
+
+    group_of.resize(n);
+    for (int i = 0; i < n; i++)
+        group_of[i] = i;
+
+    keys.reserve(n);
+
+    // exact copies, one sort
+    for (int i = 0; i < n; i++)
+        keys.push_back(std::make_pair(fps[i].exact, i));
+    std::sort(keys.begin(), keys.end());
+
+    for (int i = 1; i < n; i++)
+    {
+        if (keys[i].first == keys[i - 1].first)
+            fp_union(group_of, keys[i - 1].second, keys[i].second);
+    }
+
+    // near copies share at least one band of MinHash values, likely so
+    // from 60 % similar on.  Within a band's run of equal keys each one
+    // is held against the run's first and its neighbour only, so a
+    // crowded band can't turn this into all pairs
+    for (int band = 0; band < MSQ_FP_NUM_HASHES; band += MSQ_FP_BAND_ROWS)
+    {
+        keys.clear();
+        for (int i = 0; i < n; i++)
+        {
+            if (fps[i].minhash[0] == MSQ_FP_EMPTY) continue;
+
+            uint64_t key = 0xCBF29CE484222325ULL;
+            for (int r = band; r < band + MSQ_FP_BAND_ROWS; r++)
+            {
+                key ^= fps[i].minhash[r];
+                key *= 0x100000001B3ULL;
+            }
+            keys.push_back(std::make_pair(key, i));
+        }
+        std::sort(keys.begin(), keys.end());
+
+        size_t run_start = 0;
+        for (size_t i = 1; i < keys.size(); i++)
+        {
+            if (keys[i].first != keys[i - 1].first)
+            {
+                run_start = i;
+                continue;
+            }
+
+            const msq_fingerprint& fp = fps[keys[i].second];
+
+            if (MSQ_Fingerprint::similarity(fps[keys[run_start].second], fp) >= min_similarity)
+                fp_union(group_of, keys[run_start].second, keys[i].second);
+            if (MSQ_Fingerprint::similarity(fps[keys[i - 1].second], fp) >= min_similarity)
+                fp_union(group_of, keys[i - 1].second, keys[i].second);
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        group_of[i] = fp_find(group_of, i);
+}
@@ -0,0 +1,80 @@
+//
+//  MSQ_Fingerprint.h
+//  msq_convert
+//
+//  Fingerprint of the music in Q1 data rather than of its bytes, so
+//  copies of a sequence that differ in name, padding, block breaks or
+//  filter settings still come out alike.  Built from the parser's event
+//  stream in one pass: an exact hash of the events, simultaneous ones
+//  sorted, and a MinHash of per channel note onset shingles for near
+//  duplicates, which msq_fp_group() finds by banding instead of
+//  comparing all pairs.  Plain C++, see MSQ_Q1.h
+//
+
+#ifndef __msq_convert__MSQ_Fingerprint__
+#define __msq_convert__MSQ_Fingerprint__
+
+#include <vector>
+
+#include "MSQ_Q1.h"
+
+
+#define MSQ_FP_NUM_HASHES   16      // MinHash values
+#define MSQ_FP_BAND_ROWS    4       // values per band, 4 bands
+#define MSQ_FP_EMPTY        0xFFFFFFFFUL   // MinHash of a sequence without notes
+
+
+typedef struct
+{
+    uint64_t exact;          // all events, simultaneous ones in sorted order
+    uint32_t num_onsets;     // notes struck
+    uint32_t minhash[MSQ_FP_NUM_HASHES];
+} msq_fingerprint;
+
+
+class MSQ_Fingerprint
+{
+public:
+    MSQ_Fingerprint();
+
+    ~MSQ_Fingerprint();
+
+    //  Streaming: begin(), add() for each event q1_parse_next returns,
+    //  end() once the parse is through
+    //
+    void begin();
+    void add(const q1_event& ev);
+    void end();
+
+    const msq_fingerprint& get() const;
+
+    // on demand, parses the Q1 data once
+    const msq_fingerprint& build(const uint8_t* q1_data, int q1_data_size);
+
+    // estimated share of note shingles in common, 0 - 100
+    static int similarity(const msq_fingerprint& a, const msq_fingerprint& b);
+
+private:
+    msq_fingerprint fp;
+
+    int group_tick;                  // events held back until the tick moves on
+    std::vector<uint32_t> group;
+    bool in_group;
+
+    int prev_onset_tick[16];         // lowest note struck at the channel's previous onset
+    int prev_onset_key[16];
+
+    void flush_group();
+    void add_shingle(uint32_t shingle);
+};
+
+
+//  Clusters near duplicates.  group_of gets, for each fingerprint, the
+//  index of the first fingerprint of its group, itself if it has none.
+//  Only pairs sharing a band are compared, then kept at min_similarity
+//  or above; equal exact hashes always group.
+//
+void msq_fp_group(const std::vector<msq_fingerprint>& fps, int min_similarity,
+                  std::vector<int>& group_of);
+
+#endif /* defined(__msq_convert__MSQ_Fingerprint__) */
@@ -0,0 +1,369 @@
+//
+//  MSQ_Pack.cpp
+//  msq_convert
+//
+//  Packed Q1 data of many dumps in one file, see MSQ_Pack.h
+//
+
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "AppConfig.h"
+#include "MSQ_Pack.h"
+#include "MSQ_Codec.h"
+
+
+MSQ_Pack::MSQ_Pack()
+{
+    hdr = 0;
+    entries = 0;
+    names = 0;
+}
+
+
+MSQ_Pack::~MSQ_Pack()
+{
+}
+
+
+// zeros up to a multiple of align, the tables after data are read in place
+static void pack_align(juce::OutputStream& pack_out, int align)
+{
+    static const uint8_t zeros[8] = { 0 };
+    const int pad = (int)((align - (pack_out.getPosition() % align)) % align);
+
+    if (pad)
+        pack_out.write(zeros, pad);
+}
+
+
+//  Header first as a placeholder, then each dump's data as it comes,
+//  the entry table and names at the end, and the header again
+//
+int MSQ_Pack::build_pack(const juce::Array<juce::File>& src_files, const juce::File& pack_file,
+                         int src_track, uint32_t filters)
+{
+    std::vector<msq_pack_entry> new_entries;
+    juce::MemoryOutputStream new_names;
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+
+    msq_pack_hdr new_hdr;
+    std::memset(&new_hdr, 0, sizeof(new_hdr));
+
+    // the pack may be mapped right now, let go of it first
+    mapped_pack = 0;
+    hdr = 0;
+
+    pack_file.deleteFile();
+    juce::ScopedPointer <juce::FileOutputStream> pack_out (pack_file.createOutputStream());
+    if (pack_out == 0)
+    {
+        delete ctx;
+        return (-1);
+    }
+
+    pack_out->write(&new_hdr, sizeof(new_hdr));
+
+    for (int f = 0; f < src_files.size(); f++)
+    {
+        juce::Array<juce::File> found;
+        const juce::File& src = src_files.getReference(f);
+
+        // any case of extension, old archives have .SYX and .MID
+        if ( src.isDirectory() )
+            src.findChildFiles(found, juce::File::findFiles, TRUE);
+        else
+            found.add(src);
+
+        for (int d = 0; d < found.size(); d++)
+        {
+            if ( src.isDirectory() && !found.getReference(d).hasFileExtension(".syx;.mid") ) continue;
+
+            juce::MemoryMappedFile src_map (found.getReference(d), juce::MemoryMappedFile::readOnly);
+            MSQ_TempoMap tempo_map;
+            msq_pack_entry entry;
+            bool packed = FALSE;
+
+            std::memset(&entry, 0, sizeof(entry));
+            if (src_map.getData() == 0) continue;
+
+            const msq_codec* codec = msq_sniff((const uint8_t*) src_map.getData(),
+                                               (int) juce::jmin (src_map.getSize(), (size_t) MSQ_SNIFF_SIZE));
+            if (codec == 0) continue;
+
+            if (codec->format == MSQ_FMT_SMF)
+            {
+                // as it would go to the MSQ-100
+                juce::MemoryBlock syx_block;
+                bool converted;
+                {
+                    juce::MemoryOutputStream syx_stream (syx_block, FALSE);
+                    converted = msq_convert_smf(*ctx, src_map.getData(), src_map.getSize(), src_track,
+                                                filters, &tempo_map, syx_stream);
+                }
+
+                entry.source_type = MSQ_PACK_SRC_MID;
+                packed = converted && pack_dump((const uint8_t*) syx_block.getData(), (int) syx_block.getSize(),
+                                                tempo_map, *pack_out, &entry);
+            }
+            else if (codec->format == MSQ_FMT_Q1_SYSEX)
+            {
+                // the tempo the dump's source had, if saved next to it
+                tempo_map.load(found.getReference(d).withFileExtension(".tempo").getFullPathName().toRawUTF8());
+
+                entry.source_type = MSQ_PACK_SRC_SYX;
+                packed = pack_dump((const uint8_t*) src_map.getData(), (int) src_map.getSize(),
+                                   tempo_map, *pack_out, &entry);
+            }
+            if (!packed) continue;
+
+            const juce::String name (src.isDirectory() ? found.getReference(d).getRelativePathFrom(src)
+                                                       : found.getReference(d).getFileName());
+            entry.name_offset = (uint32_t) new_names.getDataSize();
+            new_names.write(name.toRawUTF8(), strlen(name.toRawUTF8()) + 1);
+
+            new_entries.push_back(entry);
+        }
+    }
+    delete ctx;
+
+    pack_align(*pack_out, 8);
+
+    new_hdr.magic = MSQ_PACK_MAGIC;
+    new_hdr.version = MSQ_PACK_VERSION;
+    new_hdr.num_entries = (uint32_t) new_entries.size();
+    new_hdr.entry_size = sizeof(msq_pack_entry);
+    new_hdr.entries_offset = (uint32_t) pack_out->getPosition();
+    new_hdr.names_offset = new_hdr.entries_offset + new_hdr.num_entries * sizeof(msq_pack_entry);
+    new_hdr.names_size = (uint32_t) new_names.getDataSize();
+
+    if (new_hdr.num_entries)
+        pack_out->write(&new_entries[0], new_hdr.num_entries * sizeof(msq_pack_entry));
+    pack_out->write(new_names.getData(), new_names.getDataSize());
+
+    pack_out->setPosition(0);
+    pack_out->write(&new_hdr, sizeof(new_hdr));
+    pack_out->flush();
+
+    return (int) new_hdr.num_entries;
+}
+
+
+//  Decodes the blocks of one dump as msq_syx_to_smf does, up to the
+//  first that isn't valid, and appends what the entry points to
+//
+bool MSQ_Pack::pack_dump(const uint8_t* syx_data, int syx_size, const MSQ_TempoMap& tempo_map,
+                         juce::OutputStream& pack_out, msq_pack_entry* entry)
+{
+    std::vector<uint8_t> q1_data;
+    std::vector<msq_pack_blk> blks;
+    uint8_t blk_data[Q1_BLK_BUF_SIZE];
+    const uint8_t* msg;
+    int msg_size;
+    int pos = 0;
+
+    while ( (blks.size() < Q1_MAX_SYX_BLKS) && ((msg_size = q1_next_sysex(syx_data, syx_size, &pos, &msg)) > 0) )
+    {
+        int payload_size;
+
+        if (q1_decode_block(msg, msg_size, (int) blks.size(), blk_data, &payload_size) != Q1_BLK_VALID) break;
+
+        msq_pack_blk blk;
+        std::memcpy(blk.header, blk_data, 4);
+        blk.payload_size = (uint8_t) payload_size;
+
+        // the end marks after the payload, one or two
+        const int decoded_size = q1_decode_8_7_size(msg_size - 7);
+        int end = 4 + payload_size;
+        while ( (end < decoded_size) && (blk_data[end] == 0xFE) )
+            end++;
+        blk.end_size = (uint8_t)(end - 4 - payload_size);
+
+        q1_data.insert(q1_data.end(), &blk_data[4], &blk_data[4 + payload_size]);
+        blks.push_back(blk);
+    }
+    if ( blks.empty() || q1_data.empty() ) return FALSE;
+
+    q1_parser parser;
+    q1_event ev;
+    q1_parse_init(&parser, &q1_data[0], (int) q1_data.size());
+    while ( q1_parse_next(&parser, &ev) )
+        ;
+
+    entry->content_hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < q1_data.size(); i++)
+    {
+        entry->content_hash ^= q1_data[i];
+        entry->content_hash *= 0x100000001B3ULL;
+    }
+
+    entry->q1_offset = (uint32_t) pack_out.getPosition();
+    entry->q1_size = (uint32_t) q1_data.size();
+    entry->num_blks = (uint16_t) blks.size();
+    entry->num_bars = (uint16_t) parser.num_bars;
+    pack_out.write(&q1_data[0], q1_data.size());
+
+    entry->blks_offset = (uint32_t) pack_out.getPosition();
+    pack_out.write(&blks[0], blks.size() * sizeof(msq_pack_blk));
+
+    pack_align(pack_out, 4);
+    entry->tempo_offset = (uint32_t) pack_out.getPosition();
+    entry->num_tempos = (uint16_t) juce::jmin (tempo_map.get_num_tempos(), 0xFFFF);
+    entry->tempo_ppqn = (uint16_t) tempo_map.get_ppqn();
+    for (int t = 0; t < entry->num_tempos; t++)
+    {
+        const uint32_t tempo[2] = { (uint32_t) tempo_map.get_tick(t), tempo_map.get_mpqn(t) };
+        pack_out.write(tempo, sizeof(tempo));
+    }
+
+    return TRUE;
+}
+
+
+bool MSQ_Pack::open_pack(const juce::File& pack_file)
+{
+    hdr = 0;
+    entries = 0;
+    names = 0;
+
+    mapped_pack = new juce::MemoryMappedFile (pack_file, juce::MemoryMappedFile::readOnly);
+
+    const uint8_t* pack_data = (const uint8_t*) mapped_pack->getData();
+    const size_t size = mapped_pack->getSize();
+
+    if ( (pack_data == 0) || (size < sizeof(msq_pack_hdr)) ) return FALSE;
+
+    const msq_pack_hdr* h = (const msq_pack_hdr*) pack_data;
+
+    if ( (h->magic != MSQ_PACK_MAGIC) || (h->version != MSQ_PACK_VERSION)
+        || (h->entry_size != sizeof(msq_pack_entry)) ) return FALSE;
+
+    if ( ((size_t) h->names_offset + h->names_size > size)
+        || ((size_t) h->entries_offset + (size_t) h->num_entries * sizeof(msq_pack_entry) > h->names_offset)
+        || (h->entries_offset % 8) ) return FALSE;
+
+    // names are NUL terminated, the last one inside the block too
+    if ( h->names_size && (pack_data[(size_t) h->names_offset + h->names_size - 1] != 0x00) ) return FALSE;
+
+    const msq_pack_entry* e = (const msq_pack_entry*) (pack_data + h->entries_offset);
+
+    // every entry's data in the file, so reads through it can't fault
+    for (uint32_t i = 0; i < h->num_entries; i++)
+    {
+        if ( ((size_t) e[i].q1_offset + e[i].q1_size > h->entries_offset)
+            || ((size_t) e[i].blks_offset + e[i].num_blks * sizeof(msq_pack_blk) > h->entries_offset)
+            || ((size_t) e[i].tempo_offset + e[i].num_tempos * 2 * sizeof(uint32_t) > h->entries_offset)
+            || (e[i].tempo_offset % 4) || (e[i].num_blks > Q1_MAX_SYX_BLKS)
+            || (e[i].name_offset >= h->names_size) ) return FALSE;
+    }
+
+    hdr = h;
+    entries = e;
+    names = (const char*) (pack_data + h->names_offset);
+
+    return TRUE;
+}
+
+
+int MSQ_Pack::get_num_entries()
+{
+    return hdr ? (int) hdr->num_entries : 0;
+}
+
+
+const msq_pack_entry* MSQ_Pack::get_entry(int idx)
+{
+    return &entries[idx];
+}
+
+
+const char* MSQ_Pack::get_name(int idx)
+{
+    return &names[entries[idx].name_offset];
+}
+
+
+int MSQ_Pack::find_entry(const char* name)
+{
+    for (int e = 0; e < get_num_entries(); e++)
+    {
+        if ( !strcmp(get_name(e), name) ) return (e);
+    }
+
+    return (-1);
+}
+
+
+const uint8_t* MSQ_Pack::get_Q1_data(int idx)
+{
+    return (const uint8_t*) mapped_pack->getData() + entries[idx].q1_offset;
+}
+
+
+void MSQ_Pack::get_tempo_map(int idx, MSQ_TempoMap& tempo_map)
+{
+    const uint32_t* tempo = (const uint32_t*) ((const uint8_t*) mapped_pack->getData() + entries[idx].tempo_offset);
+
+    tempo_map.clear(entries[idx].tempo_ppqn);
+    for (int t = 0; t < entries[idx].num_tempos; t++)
+        tempo_map.add_tempo((int) tempo[2 * t], tempo[2 * t + 1]);
+}
+
+
+bool MSQ_Pack::write_syx(int idx, juce::OutputStream& syx_out)
+{
+    const msq_pack_entry& entry = entries[idx];
+    const msq_pack_blk* blks = (const msq_pack_blk*) ((const uint8_t*) mapped_pack->getData() + entry.blks_offset);
+    const uint8_t* q1_data = get_Q1_data(idx);
+    uint32_t q1_pos = 0;
+    bool written = TRUE;
+
+    for (int m_id = 0; m_id < entry.num_blks; m_id++)
+    {
+        uint8_t raw[Q1_BLK_BUF_SIZE + 8];
+        uint8_t frame[Q1_MAX_FRAME_SIZE];
+        int raw_used;
+
+        const int payload_size = blks[m_id].payload_size;
+        const int end_size = juce::jmin ((int) blks[m_id].end_size, 2);
+
+        if (q1_pos + payload_size > entry.q1_size) return FALSE;
+
+        // the block as it was before decoding
+        std::memcpy(raw, blks[m_id].header, 4);
+        std::memcpy(&raw[4], &q1_data[q1_pos], payload_size);
+        std::memset(&raw[4 + payload_size], 0xFE, end_size);
+        q1_pos += payload_size;
+
+        // q1_emit_block takes end marks as long as they come, stop
+        // them where the encoder has the next block's header
+        raw[4 + payload_size + end_size] = 0xFD;
+
+        const int frame_size = q1_emit_block(frame, m_id, raw, 4 + payload_size + end_size, &raw_used);
+        written = syx_out.write(frame, frame_size) && written;
+    }
+
+    return (written);
+}
+
+
+bool MSQ_Pack::write_smf(int idx, short n_timebase, juce::OutputStream& smf_out)
+{
+    juce::MemoryBlock syx_block;
+    MSQ_TempoMap tempo_map;
+    {
+        juce::MemoryOutputStream syx_stream (syx_block, FALSE);
+        if ( !write_syx(idx, syx_stream) ) return FALSE;
+    }
+
+    get_tempo_map(idx, tempo_map);
+
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+    const bool converted = msq_convert_syx(*ctx, syx_block.getData(), syx_block.getSize(), n_timebase, FILTER_OPT_CLEAR,
+                                           (tempo_map.get_num_tempos() > 0) ? &tempo_map : 0, smf_out);
+    delete ctx;
+
+    return (converted);
+}
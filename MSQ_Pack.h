@@ -0,0 +1,107 @@
+//
+//  MSQ_Pack.h
+//  msq_convert
+//
+//  One file holding the decoded Q1 data of many dumps, instead of a
+//  .syx each.  Opened memory mapped, an entry's Q1 data is read in place,
+//  and any entry can be written back out as .syx or .mid.  The block
+//  headers and sizes are kept, so a dump comes back out byte for byte.
+//
+
+#ifndef __msq_convert__MSQ_Pack__
+#define __msq_convert__MSQ_Pack__
+
+#include "MSQ_100.h"
+
+
+#define MSQ_PACK_MAGIC      0x5051534DUL   // 'MSQP'
+#define MSQ_PACK_VERSION    1
+
+#define MSQ_PACK_SRC_SYX    0
+#define MSQ_PACK_SRC_MID    1
+
+
+// pack file layout: header, data, entry table, '\0' terminated names
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t entry_size;     // sizeof(msq_pack_entry)
+    uint32_t entries_offset; // from start of file
+    uint32_t names_offset;
+    uint32_t names_size;
+    uint32_t reserved;
+} msq_pack_hdr;
+
+
+// one per dump, offsets from the start of the file
+typedef struct
+{
+    uint64_t content_hash;   // FNV-1a of the Q1 data, as in the catalog
+    uint32_t name_offset;    // into the names table
+    uint32_t q1_offset;      // decoded Q1 data, block payloads back to back
+    uint32_t q1_size;
+    uint32_t blks_offset;    // num_blks msq_pack_blk
+    uint32_t tempo_offset;   // num_tempos tick, MPQN pairs of uint32_t
+    uint16_t num_blks;
+    uint16_t num_bars;
+    uint16_t num_tempos;
+    uint16_t tempo_ppqn;
+    uint8_t  source_type;    // MSQ_PACK_SRC_...
+    uint8_t  reserved[7];
+} msq_pack_entry;
+
+
+// what decoding takes out of a block, to put it back
+typedef struct
+{
+    uint8_t header[4];       // FD 'F' 'Q' '1' or FD 'P' and the phrase id
+    uint8_t payload_size;
+    uint8_t end_size;        // 0xFE end marks
+} msq_pack_blk;
+
+
+class MSQ_Pack
+{
+public:
+    MSQ_Pack();
+
+    ~MSQ_Pack();
+
+    //  Packs every .syx and .mid file given, directories walked for
+    //  them.  SMF files are converted with filters first.  Returns the
+    //  number of dumps packed, -1 if the pack can't be written
+    //
+    int build_pack(const juce::Array<juce::File>& src_files, const juce::File& pack_file,
+                   int src_track, uint32_t filters);
+
+    bool open_pack(const juce::File& pack_file);
+
+    int get_num_entries();
+    const msq_pack_entry* get_entry(int idx);
+    const char* get_name(int idx);
+    int find_entry(const char* name);    // -1 if not packed
+
+    // in the mapped file, no copy
+    const uint8_t* get_Q1_data(int idx);
+
+    void get_tempo_map(int idx, MSQ_TempoMap& tempo_map);
+
+    // the dump as it was packed
+    bool write_syx(int idx, juce::OutputStream& syx_out);
+
+    bool write_smf(int idx, short n_timebase, juce::OutputStream& smf_out);
+
+private:
+    juce::ScopedPointer<juce::MemoryMappedFile> mapped_pack;
+
+    const msq_pack_hdr* hdr;
+    const msq_pack_entry* entries;
+    const char* names;
+
+    bool pack_dump(const uint8_t* syx_data, int syx_size, const MSQ_TempoMap& tempo_map,
+                   juce::OutputStream& pack_out, msq_pack_entry* entry);
+};
+
+#endif /* defined(__msq_convert__MSQ_Pack__) */
@@ -0,0 +1,231 @@
+//
+//  MSQ_PerfCount.cpp
+//  msq_convert
+//
+//  Stage counters from perf_event_open, see MSQ_PerfCount.h
+//
+//  Each counter is opened on its own rather than as a group, so one the
+//  CPU lacks doesn't take the others with it.  They run from open() on
+//  and a stage is the difference of two reads; when the kernel has to
+//  share the PMU among more counters than it has, the count is scaled
+//  by enabled over running time.
+//
+
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+ #include <sys/syscall.h>
+ #include <linux/perf_event.h>
+ #define MSQ_HAVE_PERF_EVENT 1
+#else
+ #define MSQ_HAVE_PERF_EVENT 0
+#endif
+
+#include "MSQ_PerfCount.h"
+
+
+static uint64_t perf_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+#if MSQ_HAVE_PERF_EVENT
+static int perf_open_counter(int counter)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (counter)
+    {
+        case MSQ_PERF_CYCLES:        attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case MSQ_PERF_INSTRUCTIONS:  attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case MSQ_PERF_BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case MSQ_PERF_LLC_MISSES:    attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+
+        case MSQ_PERF_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+    }
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+#endif
+
+
+MSQ_PerfCount::MSQ_PerfCount()
+{
+    for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+        fds[c] = -1;
+    num_open = 0;
+    open_error = 0;
+
+    reset();
+}
+
+
+MSQ_PerfCount::~MSQ_PerfCount()
+{
+    close();
+}
+
+
+bool MSQ_PerfCount::open()
+{
+    close();
+
+#if MSQ_HAVE_PERF_EVENT
+    for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+    {
+        fds[c] = perf_open_counter(c);
+
+        if (fds[c] >= 0)
+            num_open++;
+        else if (!open_error)
+            open_error = errno;
+    }
+#else
+    open_error = ENOSYS;
+#endif
+
+    return (num_open > 0);
+}
+
+
+void MSQ_PerfCount::close()
+{
+    end();
+
+    for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+    {
+        if (fds[c] >= 0)
+            ::close(fds[c]);
+        fds[c] = -1;
+    }
+    num_open = 0;
+    open_error = 0;
+}
+
+
+bool MSQ_PerfCount::has_counter(int counter) const
+{
+    return ( (counter >= 0) && (counter < MSQ_PERF_NUM_COUNTERS) && (fds[counter] >= 0) );
+}
+
+
+int MSQ_PerfCount::get_num_counters() const
+{
+    return (num_open);
+}
+
+
+int MSQ_PerfCount::get_open_error() const
+{
+    return (open_error);
+}
+
+
+const char* MSQ_PerfCount::counter_name(int counter)
+{
+    static const char* names[MSQ_PERF_NUM_COUNTERS] =
+    {
+        "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses"
+    };
+
+    return ( (counter >= 0) && (counter < MSQ_PERF_NUM_COUNTERS) ) ? names[counter] : "";
+}
+
+
+bool MSQ_PerfCount::read_counter(int counter, uint64_t* count, uint64_t* enabled, uint64_t* running)
+{
+    uint64_t vals[3];
+
+    if (fds[counter] < 0) return FALSE;
+    if (read(fds[counter], vals, sizeof(vals)) != (ssize_t) sizeof(vals)) return FALSE;
+
+    *count = vals[0];
+    *enabled = vals[1];
+    *running = vals[2];
+
+    return TRUE;
+}
+
+
+void MSQ_PerfCount::begin(int stage)
+{
+    end();
+
+    if ( (stage < 0) || (stage >= MSQ_PERF_MAX_STAGES) ) return;
+
+    curr_stage = stage;
+
+    for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+    {
+        if ( !read_counter(c, &start_count[c], &start_enabled[c], &start_running[c]) )
+            start_count[c] = start_enabled[c] = start_running[c] = 0;
+    }
+
+    // last, so the reads above aren't timed
+    start_ns = perf_now_ns();
+}
+
+
+void MSQ_PerfCount::end()
+{
+    if (curr_stage == MSQ_PERF_NO_STAGE) return;
+
+    const uint64_t end_ns = perf_now_ns();
+    msq_perf_sample& sample = stages[curr_stage];
+
+    sample.runs++;
+    sample.ns += end_ns - start_ns;
+
+    for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+    {
+        uint64_t count, enabled, running;
+
+        if ( !read_counter(c, &count, &enabled, &running) ) continue;
+
+        const uint64_t d_count = count - start_count[c];
+        const uint64_t d_enabled = enabled - start_enabled[c];
+        const uint64_t d_running = running - start_running[c];
+
+        // not on the PMU at all during the stage, nothing to scale
+        if (!d_running) continue;
+
+        if (d_running < d_enabled)
+            sample.count[c] += (uint64_t)((double) d_count * d_enabled / d_running);
+        else
+            sample.count[c] += d_count;
+    }
+
+    curr_stage = MSQ_PERF_NO_STAGE;
+}
+
+
+void MSQ_PerfCount::reset()
+{
+    curr_stage = MSQ_PERF_NO_STAGE;
+    memset(stages, 0, sizeof(stages));
+}
+
+
+const msq_perf_sample& MSQ_PerfCount::get_stage(int stage) const
+{
+    return stages[ (stage >= 0) && (stage < MSQ_PERF_MAX_STAGES) ? stage : 0 ];
+}
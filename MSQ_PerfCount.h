@@ -0,0 +1,86 @@
+//
+//  MSQ_PerfCount.h
+//  msq_convert
+//
+//  Hardware counters around the stages of a conversion, for the bench
+//  command: cycles, instructions, branch misses, L1 data and last level
+//  cache misses, user space only, from perf_event_open.  Counters the
+//  CPU, the kernel or perf_event_paranoid won't give are left out and
+//  the rest still count; with none at all only the wall clock is kept.
+//  Not on Linux there are never counters.  Plain C++, see MSQ_Q1.h
+//
+
+#ifndef __msq_convert__MSQ_PerfCount__
+#define __msq_convert__MSQ_PerfCount__
+
+#include <stdint.h>
+
+#ifndef TRUE
+ #define TRUE   1
+ #define FALSE  0
+#endif
+
+
+#define MSQ_PERF_CYCLES         0
+#define MSQ_PERF_INSTRUCTIONS   1
+#define MSQ_PERF_BRANCH_MISSES  2
+#define MSQ_PERF_L1D_MISSES     3
+#define MSQ_PERF_LLC_MISSES     4
+#define MSQ_PERF_NUM_COUNTERS   5
+
+#define MSQ_PERF_MAX_STAGES     16
+#define MSQ_PERF_NO_STAGE       -1
+
+
+// one stage, summed over every time it ran
+typedef struct
+{
+    uint32_t runs;
+    uint64_t ns;
+    uint64_t count[MSQ_PERF_NUM_COUNTERS];   // scaled up when multiplexed
+} msq_perf_sample;
+
+
+class MSQ_PerfCount
+{
+public:
+    MSQ_PerfCount();
+
+    ~MSQ_PerfCount();
+
+    // FALSE if no counter could be opened, stages are still timed
+    bool open();
+    void close();
+
+    bool has_counter(int counter) const;
+    int get_num_counters() const;
+    int get_open_error() const;          // errno of the first counter refused
+
+    static const char* counter_name(int counter);
+
+    //  Ends the stage running, if any, and starts counting stage.
+    //  MSQ_PERF_NO_STAGE only ends it
+    //
+    void begin(int stage);
+    void end();
+
+    void reset();
+    const msq_perf_sample& get_stage(int stage) const;
+
+private:
+    int fds[MSQ_PERF_NUM_COUNTERS];
+    int num_open;
+    int open_error;
+
+    int curr_stage;
+    uint64_t start_ns;
+    uint64_t start_count[MSQ_PERF_NUM_COUNTERS];
+    uint64_t start_enabled[MSQ_PERF_NUM_COUNTERS];
+    uint64_t start_running[MSQ_PERF_NUM_COUNTERS];
+
+    msq_perf_sample stages[MSQ_PERF_MAX_STAGES];
+
+    bool read_counter(int counter, uint64_t* count, uint64_t* enabled, uint64_t* running);
+};
+
+#endif /* defined(__msq_convert__MSQ_PerfCount__) */
@@ -0,0 +1,707 @@
+//
+//  MSQ_Q1.cpp
+//  msq_convert
+//
+//  MSQ-100 Q1 codec core, no JUCE in here so that small tools can
+//  start without its static initialization
+//
+
+
+#include <string.h>
+
+#include "MSQ_Q1.h"
+
+
+// returns new size
+// required for allocating destination buffer
+//
+// examples 212 -> 243
+//           42 ->  48
+int q1_encode_7_8_size(int size)
+{
+    int remainder;
+
+    remainder = size % 7;
+    if (remainder) remainder++;
+
+    return (8 * (size / 7) + remainder);
+}
+
+
+// returns new size
+// works on one block at a time
+// stops at EOB (End of Block) 0xFE bytes or size limit
+int q1_encode_7_8_bytes(uint8_t* block_data, const uint8_t* raw_data, int size)
+{
+    uint8_t msig_bits;
+    int i = 0; int j = 0; int k = 0;
+    bool end_of_block = FALSE;
+
+    while ( !end_of_block )
+    {
+        // break down into 7 byte chunks and encode as 8
+        msig_bits = 0x00;
+        for (j = 0; j < 7; j++)
+        {
+            if (end_of_block)
+            {
+                if (raw_data[i] == 0xFE)
+                {
+                    //  seen two End Block marks
+                }
+                else
+                {
+                    break;
+                }
+            }
+            else if( raw_data[i] == 0xFE )
+            {
+                end_of_block = TRUE;
+            }
+            else if (i >= size)
+            {
+                // safety - should never get here
+                end_of_block = TRUE;
+                break;
+            }
+
+            if(0x80 & raw_data[i])
+            {
+                msig_bits |= (0x01 << j);
+            }
+            block_data[++k] = 0x7F & raw_data[i++];
+        }
+        block_data[k-j]  = msig_bits;
+        ++k;
+
+    }
+
+    return(k);
+}
+
+
+// returns new size
+// required for allocating destination buffer
+//
+// new size = 7 * (size / 8) + (size % 8) - 1
+//
+// examples 243 -> 212
+//           48 ->  42
+int q1_decode_8_7_size(int size)
+{
+    int remainder;
+
+    remainder = size % 8;
+    if (remainder) remainder--;
+
+    return(7 * (size / 8) + remainder);
+}
+
+
+// returns new size
+int q1_decode_8_7_bytes(uint8_t* raw_data, const uint8_t* block_data, int size)
+{
+    uint8_t msig_bits;
+    int i = 0; int k = 0;
+
+    while ( i < size )
+    {
+        // break down into 8 byte chunks and extract 7
+        msig_bits = block_data[i++];
+
+        for (int j = 7; j > 0 ; j--)
+        {
+            raw_data[k++] = (0x80 & (msig_bits << j)) | block_data[i++];
+
+            if ( i >= size ) break;
+        }
+    }
+
+    return(k);
+}
+
+
+uint8_t q1_byte_checksum(const uint8_t* block_data, int b_size)
+{
+    uint8_t c_sum = block_data[--b_size];
+
+    while ( b_size )
+        c_sum += block_data[--b_size];
+
+    return (c_sum & 0x7F);
+}
+
+
+int q1_emit_block(uint8_t* frame, int m_id, const uint8_t* raw_data, int raw_size, int* raw_used)
+{
+    uint8_t* out = frame;
+    uint8_t c_sum = 0;
+    int i = 0;
+    bool end_of_block = FALSE;
+
+    *out++ = 0xF0;   // SysEx start
+    *out++ = Q1_SYX_MAN_ID;
+    *out++ = Q1_SYX_FUNCT_TYPE;
+    *out++ = Q1_SYX_DATA_TYPE;
+    *out++ = (uint8_t) m_id;
+
+    // same groups as q1_encode_7_8_bytes, straight into the frame
+    while ( !end_of_block )
+    {
+        uint8_t* msig_pos = out++;
+        uint8_t msig_bits = 0x00;
+        int j;
+
+        for (j = 0; j < 7; j++)
+        {
+            if (end_of_block)
+            {
+                // only a second End Block mark joins the group
+                if (raw_data[i] != 0xFE) break;
+            }
+            else if (raw_data[i] == 0xFE)
+            {
+                end_of_block = TRUE;
+            }
+            else if (i >= raw_size)
+            {
+                end_of_block = TRUE;
+                break;
+            }
+
+            const uint8_t q_byte = raw_data[i++];
+            if (0x80 & q_byte)
+                msig_bits |= (0x01 << j);
+            *out = 0x7F & q_byte;
+            c_sum += *out++;
+        }
+
+        if (j == 0)
+        {
+            out--;
+            break;
+        }
+        *msig_pos = msig_bits;
+        c_sum += msig_bits;
+    }
+
+    *out++ = c_sum & 0x7F;
+    *out++ = 0xF7;   // SysEx end
+
+    *raw_used = i;
+
+    return (int)(out - frame);
+}
+
+
+int q1_strip_blocks(uint8_t* q1_data, int q1_size, int num_blks)
+{
+    int i = 0;
+    int j = 0;
+
+    for (int m_id = 0; (m_id < num_blks) && (i < q1_size); m_id++)
+    {
+        // a block is cut where q1_emit_block would cut it
+        const int blk_end = (i + 217 < q1_size) ? i + 217 : q1_size;
+
+        for (i += 4; (i < blk_end) && (q1_data[i] != 0xFE); i++)
+            q1_data[j++] = q1_data[i];
+        while ( (i < q1_size) && (q1_data[i] == 0xFE) )
+            i++;
+    }
+
+    return (j);
+}
+
+
+int q1_decode_block(const uint8_t* syx_msg_data, int syx_msg_size, int m_id,
+                    uint8_t* blk_data, int* payload_size)
+{
+    uint8_t cksum;
+    int decoded_blk_size;
+    int k;
+
+    *payload_size = 0;
+
+    k = syx_msg_size - 7;
+    if ( (k < 1) || (q1_decode_8_7_size(k) > Q1_BLK_BUF_SIZE) ) return Q1_BLK_BAD_HEADER;
+
+    // validate message header
+    if ( *(syx_msg_data++) != (uint8_t) 0xF0 ) return Q1_BLK_BAD_HEADER;
+    if ( *(syx_msg_data++) != (uint8_t) Q1_SYX_MAN_ID ) return Q1_BLK_BAD_HEADER;
+    if ( *(syx_msg_data++) != (uint8_t) Q1_SYX_FUNCT_TYPE ) return Q1_BLK_BAD_HEADER;
+    if ( *(syx_msg_data++) != (uint8_t) Q1_SYX_DATA_TYPE ) return Q1_BLK_BAD_HEADER;
+    if ( *(syx_msg_data++) != (uint8_t) m_id ) return Q1_BLK_BAD_HEADER;
+
+    // decode
+    decoded_blk_size = q1_decode_8_7_bytes(blk_data, syx_msg_data, k);
+
+    int j = 4;
+    while ( (j < decoded_blk_size) && (blk_data[j] != 0xFE) )
+        j++;
+    *payload_size = j - 4;
+
+    cksum = q1_byte_checksum(syx_msg_data, k);
+
+    // validate message end
+    syx_msg_data += k;
+    if( *(syx_msg_data++) != cksum ) return Q1_BLK_BAD_CHECKSUM;
+    if( *(syx_msg_data++) != (uint8_t ) 0xF7) return Q1_BLK_BAD_CHECKSUM;   // SysEx end
+
+    return Q1_BLK_VALID;
+}
+
+
+// a message cut short by the end of the data is still returned
+int q1_next_sysex(const uint8_t* syx_data, int syx_size, int* pos, const uint8_t** msg)
+{
+    int i = *pos;
+
+    while ( (i < syx_size) && (syx_data[i] != 0xF0) )
+        i++;
+    if (i >= syx_size)
+    {
+        *pos = syx_size;
+        return 0;
+    }
+
+    int j = i;
+    while ( (j < syx_size) && (syx_data[j] != 0xF7) )
+        j++;
+    if (j < syx_size) j++;
+
+    *msg = &syx_data[i];
+    *pos = j;
+
+    return (j - i);
+}
+
+
+int q1_decode_dump(const uint8_t* syx_data, int syx_size, uint8_t* q1_data, int* num_blks)
+{
+    uint8_t blk_data[Q1_BLK_BUF_SIZE];
+    int q1_size = 0;
+    int pos = 0;
+
+    *num_blks = 0;
+
+    for (int m_id = 0; m_id < Q1_MAX_SYX_BLKS; m_id++)
+    {
+        const uint8_t* msg;
+        int payload_size;
+
+        const int msg_size = q1_next_sysex(syx_data, syx_size, &pos, &msg);
+        if (!msg_size) break;
+
+        const int blk_status = q1_decode_block(msg, msg_size, m_id, blk_data, &payload_size);
+        if (blk_status == Q1_BLK_BAD_HEADER) break;
+
+        memcpy(&q1_data[q1_size], &blk_data[4], payload_size);
+        q1_size += payload_size;
+
+        if (blk_status != Q1_BLK_VALID) break;
+        (*num_blks)++;
+    }
+
+    return (q1_size);
+}
+
+
+int q1_next_frame(const uint8_t* syx_data, int syx_size, int* pos, const uint8_t** msg)
+{
+    int i = *pos;
+
+    for (;;)
+    {
+        const uint8_t* f0 = (i < syx_size) ? (const uint8_t*) memchr(&syx_data[i], 0xF0, syx_size - i) : 0;
+        if (f0 == 0)
+        {
+            *pos = syx_size;
+            return 0;
+        }
+
+        i = (int)(f0 - syx_data);
+        if ( (i + 4 <= syx_size) && (f0[1] == Q1_SYX_MAN_ID) && (f0[2] == Q1_SYX_FUNCT_TYPE)
+             && (f0[3] == Q1_SYX_DATA_TYPE) )
+            break;
+        i++;
+    }
+
+    int j = i + 1;
+    while ( (j < syx_size) && (syx_data[j] != 0xF7) && (syx_data[j] != 0xF0) )
+        j++;
+    if ( (j < syx_size) && (syx_data[j] == 0xF7) ) j++;
+
+    *msg = &syx_data[i];
+    *pos = j;
+
+    return (j - i);
+}
+
+
+// the FCB payload the encoder writes, for a dump that lost its own
+static const uint8_t q1_default_fcb[Q1_PARSE_START] =
+{
+    'M', 'S', 'Q', '-', '1', '0', '0', '.', '0', ' ',
+    ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+    ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+    0x00, 0x00, 0x01, 0x00, 0x78, 0x64
+};
+
+// how the first phrase block opens, see q1_parse_init
+static const uint8_t q1_phrase_start[4] = { 0x00, 0xFA, 0x01, 0x7F };
+
+
+//  0xF9 and 0xFC only ever stand where a status goes: times are below
+//  0xF0 but for 0xF8, data bytes below 0x80.  So bar lines can be found
+//  by their byte alone
+//
+static int q1_count_bars(const uint8_t* data, int size)
+{
+    int num_bars = 0;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (data[i] == 0xF9) num_bars++;
+    }
+
+    return (num_bars);
+}
+
+
+// offset just past the first bar line whose next event has its own
+// status byte, -1 if the data has none
+static int q1_find_rejoin(const uint8_t* data, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (data[i] != 0xF9) continue;
+
+        int j = i + 1;
+        while ( (j < size) && (data[j] == 0xF8) )
+            j++;
+
+        // the time, then the status
+        if (j + 1 >= size) break;
+        if (data[j + 1] & 0x80) return (i + 1);
+    }
+
+    return (-1);
+}
+
+
+int q1_salvage(const uint8_t* syx_data, int syx_size, int* pos, uint8_t* q1_data,
+               q1_salvage_report* report)
+{
+    uint8_t blk_data[Q1_BLK_BUF_SIZE];
+    int q1_size = 0;
+    int expected = 0;        // next message number
+    bool rejoin = FALSE;     // a phrase block is missing, wait for a bar line
+
+    memset(report, 0, sizeof(q1_salvage_report));
+    report->end_lost = TRUE;
+
+    while (expected < Q1_MAX_SYX_BLKS)
+    {
+        const uint8_t* msg;
+        const int from_pos = *pos;
+        const int msg_size = q1_next_frame(syx_data, syx_size, pos, &msg);
+
+        if (msg_size == 0)
+        {
+            report->bytes_skipped += syx_size - from_pos;
+            break;
+        }
+        report->bytes_skipped += (int)(msg - syx_data) - from_pos;
+
+        // the message number may be what's broken
+        int payload_size = 0;
+        memset(blk_data, 0, 4);
+        const int m_id = (msg_size > 4) ? msg[4] : Q1_MAX_SYX_BLKS;
+        const int blk_status = (m_id < Q1_MAX_SYX_BLKS) ? q1_decode_block(msg, msg_size, m_id, blk_data, &payload_size)
+                                                        : Q1_BLK_BAD_HEADER;
+
+        if ( (blk_status != Q1_BLK_VALID) || (blk_data[0] != 0xFD) || (blk_data[1] != ((m_id == 0) ? 'F' : 'P')) )
+        {
+            report->num_damaged++;
+            continue;
+        }
+
+        if (m_id < expected)
+        {
+            // the next dump
+            if (m_id == 0)
+            {
+                *pos = (int)(msg - syx_data);
+                break;
+            }
+
+            // sent again
+            continue;
+        }
+
+        if (m_id > expected)
+        {
+            for (int m = expected; m < m_id; m++)
+                report->lost[m] = 1;
+            report->num_lost += m_id - expected;
+
+            if (expected == 0)
+            {
+                memcpy(q1_data, q1_default_fcb, sizeof(q1_default_fcb));
+                q1_size = sizeof(q1_default_fcb);
+                report->fcb_lost = TRUE;
+            }
+
+            if ( (m_id > 1) && !rejoin )
+            {
+                // back to the last bar line before the gap
+                int cut = q1_size;
+                while ( (cut > Q1_PARSE_START + 2) && (q1_data[cut - 1] != 0xF9) )
+                    cut--;
+
+                if (cut < q1_size)
+                {
+                    report->q1_dropped += q1_size - cut;
+                    report->bars_dropped++;
+                    q1_size = cut;
+                }
+
+                if (q1_size < Q1_PARSE_START + 2)
+                {
+                    q1_size = Q1_PARSE_START;
+                    memcpy(&q1_data[q1_size], q1_phrase_start, sizeof(q1_phrase_start));
+                    q1_size += sizeof(q1_phrase_start);
+                }
+
+                rejoin = TRUE;
+            }
+        }
+
+        expected = m_id + 1;
+
+        const uint8_t* payload = &blk_data[4];
+
+        if (rejoin)
+        {
+            const int skip = q1_find_rejoin(payload, payload_size);
+            const int dropped = (skip < 0) ? payload_size : skip;
+
+            report->q1_dropped += dropped;
+            report->bars_dropped += q1_count_bars(payload, dropped);
+            if (skip < 0) continue;
+
+            payload += skip;
+            payload_size -= skip;
+            rejoin = FALSE;
+            report->num_resyncs++;
+        }
+
+        memcpy(&q1_data[q1_size], payload, payload_size);
+        q1_size += payload_size;
+        report->num_blks++;
+
+        // track end, what follows belongs to something else
+        if ( (m_id > 0) && memchr(payload, 0xFC, payload_size) )
+        {
+            report->end_lost = FALSE;
+            break;
+        }
+    }
+
+    return (q1_size);
+}
+
+
+//==============================================================================
+//  The FCB's payload is 36 bytes: name, conductor switch, track,
+//  phrase number, timebase and tempo.  Parsing starts right after it,
+//  at the "00 FA 01 7F" opening the first phrase block, which reads as
+//  the velocity switch at time 0 and adds nothing
+//
+void q1_parse_init(q1_parser* parser, const uint8_t* q1_data, int q1_size)
+{
+    parser->data = q1_data;
+    parser->size = q1_size;
+    parser->pos = Q1_PARSE_START;
+    parser->tick = 0;
+    parser->num_bars = 0;
+    parser->curr_status = 0xFA;
+    parser->key_num = 0;
+    parser->q_byte = 0xF9;
+    parser->time_sig = 4;
+    parser->bars = 0;
+    parser->max_bars = 0;
+}
+
+
+static void q1_store_bar(q1_parser* parser)
+{
+    if (parser->num_bars >= parser->max_bars) return;
+
+    q1_bar* bar = &parser->bars[parser->num_bars];
+    bar->pos = parser->pos;
+    bar->tick = parser->tick;
+    bar->time_sig = parser->time_sig;
+    bar->curr_status = parser->curr_status;
+    bar->key_num = parser->key_num;
+    bar->reserved = 0;
+}
+
+
+void q1_parse_bars(q1_parser* parser, q1_bar* bars, int max_bars)
+{
+    parser->bars = bars;
+    parser->max_bars = max_bars;
+
+    if (bars) q1_store_bar(parser);
+}
+
+
+void q1_parse_seek(q1_parser* parser, const q1_bar* bar, int bar_num)
+{
+    parser->pos = bar->pos;
+    parser->tick = bar->tick;
+    parser->num_bars = bar_num;
+    parser->time_sig = bar->time_sig;
+    parser->curr_status = bar->curr_status;
+    parser->key_num = bar->key_num;
+    parser->q_byte = 0xF9;
+}
+
+
+// next byte, the data running out reads as track end
+static uint8_t q1_parse_byte(q1_parser* parser)
+{
+    if (parser->pos >= parser->size)
+    {
+        parser->pos++;
+        return 0xFC;
+    }
+
+    return parser->data[parser->pos++];
+}
+
+
+bool q1_parse_next(q1_parser* parser, q1_event* event)
+{
+    uint8_t q_byte = parser->q_byte;
+
+    while ( (q_byte != 0xFC) && (parser->pos < parser->size) )
+    {
+        // get time
+        q_byte = q1_parse_byte(parser);
+        if (q_byte == 0xFE)
+        {
+            // just indicated end of data block, skip over next header
+            q_byte = q1_parse_byte(parser);
+            if (q_byte == 0xFE) parser->pos++;
+            continue;
+        }
+
+        parser->tick += (q_byte == 0xF8) ? 240 : (int) q_byte;   // F8: half note, 2 X 120 PPQN
+        if (q_byte == 0xF8) continue;
+
+        // get status
+        q_byte = q1_parse_byte(parser);
+        if ((0xF0 & q_byte) == 0xF0)
+        {
+            // Meta type events
+            if (q_byte == 0xF9)
+            {
+                // measure end
+                parser->num_bars++;
+                if (parser->bars) q1_store_bar(parser);
+                continue;
+            }
+            else if (q_byte == 0xFA)
+            {
+                // special functions
+                q_byte = q1_parse_byte(parser);
+                if (q_byte == 0x01)
+                {
+                    // switch to maintain NOTE ON Velocity ?
+                    q_byte = q1_parse_byte(parser);
+                    continue;
+                }
+
+                // time sig change
+                int t_sig = q1_parse_byte(parser);
+                if (!t_sig)
+                    t_sig = 4;
+                parser->time_sig = (uint8_t) t_sig;
+
+                event->tick = parser->tick;
+                event->status = 0xFF;
+                event->data1 = (uint8_t) t_sig;
+                event->data2 = 4;
+                event->size = 2;
+
+                parser->q_byte = q_byte;
+                return TRUE;
+            }
+            else if (q_byte == 0xFC)
+            {
+                // data end
+                break;
+            }
+            else if (q_byte == 0xFE)
+            {
+                // just indicated end of data block, skip over next header
+                q_byte = q1_parse_byte(parser);
+                if (q_byte == 0xFE) parser->pos++;
+                continue;
+            }
+        }
+        else if (0x80 & q_byte)
+        {
+            // new status
+            parser->curr_status = q_byte;
+            parser->key_num = q1_parse_byte(parser);  // key number
+        }
+        else
+        {
+            // running status, q_byte already is the key number
+            parser->key_num = q_byte;
+        }
+
+        const uint8_t curr_status = parser->curr_status;
+
+        if ( (curr_status >= 0xC0) && (curr_status <= 0xDF) )
+        {
+            // program change or channel aftertouch - one more byte only
+            event->tick = parser->tick;
+            event->status = curr_status;
+            event->data1 = parser->key_num;
+            event->data2 = 0;
+            event->size = 2;
+
+            parser->q_byte = q_byte;
+            return TRUE;
+        }
+        else if ( (curr_status >= 0x80) && (curr_status <= 0xEF) )
+        {
+            // one more byte - key velocity
+            const uint8_t m_key_vel = q1_parse_byte(parser);
+
+            event->tick = parser->tick;
+            event->status = curr_status;
+            event->data1 = parser->key_num;
+            event->data2 = m_key_vel;
+            event->size = 3;
+
+            if ( (m_key_vel == 0) && ((curr_status & 0xF0) == 0x90) )
+            {
+                // Note Off
+                event->status &= 0xEF;
+            }
+
+            parser->q_byte = q_byte;
+            return TRUE;
+        }
+    }
+
+    parser->q_byte = 0xFC;
+
+    return FALSE;
+}
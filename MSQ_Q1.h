@@ -0,0 +1,175 @@
+//
+//  MSQ_Q1.h
+//  msq_convert
+//
+//  MSQ-100 Q1 codec core: SysEx block framing, 7-8 bit packing and
+//  the Q1 phrase data parser.  Plain C++ without JUCE, shared by
+//  MSQ_100_SysEx and the fast-start msqfast tool
+//
+
+#ifndef __msq_convert__MSQ_Q1__
+#define __msq_convert__MSQ_Q1__
+
+#include <stdint.h>
+
+#ifndef TRUE
+ #define TRUE   1
+ #define FALSE  0
+#endif
+
+
+#define Q1_BLK_BUF_SIZE     256     // decoded bytes of one SysEx block, at most
+#define Q1_MAX_SYX_BLKS     128     // message numbers only go to 127
+#define Q1_PARSE_START      36      // parsers skip the FCB, see q1_parse_init
+
+#define Q1_MAX_FRAME_SIZE   256     // one framed SysEx block, F0 to F7
+
+// SysEx header of every block: F0 41 57 70, then the message number
+#define Q1_SYX_MAN_ID       0x41    // Roland
+#define Q1_SYX_FUNCT_TYPE   0x57
+#define Q1_SYX_DATA_TYPE    0x70    // 7-8 bit conversion
+
+// q1_decode_block results
+enum
+{
+    Q1_BLK_BAD_HEADER = 0,
+    Q1_BLK_BAD_CHECKSUM,
+    Q1_BLK_VALID
+};
+
+
+// what q1_salvage got out of a damaged dump
+typedef struct
+{
+    int num_blks;        // blocks kept, the FCB included
+    int num_damaged;     // frames failing their header or checksum
+    int num_lost;        // message numbers missing from the Q1 stream
+    int num_resyncs;     // times the stream was picked up again
+    int bytes_skipped;   // SysEx bytes outside of any frame
+    int q1_dropped;      // Q1 bytes of kept blocks cut to rejoin on a bar
+    int bars_dropped;    // whole or partial bars among those
+    bool fcb_lost;       // the default FCB stands in
+    bool end_lost;       // no 0xFC track end, the last blocks may be gone
+    uint8_t lost[Q1_MAX_SYX_BLKS];   // nonzero for each lost message number
+} q1_salvage_report;
+
+
+// one event out of the Q1 phrase data, at 120 PPQN
+typedef struct
+{
+    int tick;
+    uint8_t status;      // 0x80 - 0xEF, or 0xFF for a time signature
+    uint8_t data1;       // key, controller, program... or beats per measure
+    uint8_t data2;       // unused for 0xC0 - 0xDF and time signatures
+    uint8_t size;        // MIDI message bytes, 2 or 3
+} q1_event;
+
+
+// where a bar starts, enough to resume parsing there, see q1_parse_seek
+typedef struct
+{
+    int pos;             // Q1 byte offset, after the previous 0xF9
+    int tick;            // 120 PPQN
+    uint8_t time_sig;    // beats per measure in effect, x/4
+    uint8_t curr_status; // running status
+    uint8_t key_num;
+    uint8_t reserved;
+} q1_bar;
+
+
+// parser state, see q1_parse_next
+typedef struct
+{
+    const uint8_t* data;
+    int size;
+    int pos;
+    int tick;            // 120 PPQN, from the start of the phrase
+    int num_bars;        // 0xF9 measure ends so far
+    uint8_t curr_status;
+    uint8_t key_num;
+    uint8_t q_byte;      // last byte read, 0xFC ends the parse
+    uint8_t time_sig;    // current beats per measure
+    q1_bar* bars;        // if set, each bar start is stored, see q1_parse_bars
+    int max_bars;
+} q1_parser;
+
+
+//  SysEx 7-8 bit conversion, as used by Roland for the Q1 blocks
+//
+int q1_encode_7_8_size(int size);
+int q1_decode_8_7_size(int size);
+
+int q1_encode_7_8_bytes(uint8_t* block_data, const uint8_t* raw_data, int size);
+int q1_decode_8_7_bytes(uint8_t* raw_data, const uint8_t* block_data, int size);
+uint8_t q1_byte_checksum(const uint8_t* block_data, int size);
+
+//  Frames one block in a single pass: header, the raw Q1 bytes up to
+//  the 0xFE end mark packed 7-8, the checksum summed on the way, F7.
+//  frame needs Q1_MAX_FRAME_SIZE bytes.  Returns the frame size,
+//  *raw_used the Q1 bytes it took.
+//
+int q1_emit_block(uint8_t* frame, int m_id, const uint8_t* raw_data, int raw_size, int* raw_used);
+
+//  Moves the payloads of num_blks raw blocks, as the encoder lays them
+//  out for q1_emit_block, together in place: block headers and 0xFE end
+//  marks out, as q1_decode_dump leaves a dump of them.  Returns the
+//  payload size
+//
+int q1_strip_blocks(uint8_t* q1_data, int q1_size, int num_blks);
+
+//  Validates header, checksum and end of one SysEx block, decodes it
+//  into blk_data (Q1_BLK_BUF_SIZE bytes).  payload_size is the count of
+//  Q1 bytes after the 4 byte block header, up to the 0xFE end mark.
+//
+int q1_decode_block(const uint8_t* syx_msg_data, int syx_msg_size, int m_id,
+                    uint8_t* blk_data, int* payload_size);
+
+//  Finds the next F0 ... F7 message in raw SysEx file data from *pos,
+//  returns its size and moves *pos past it, 0 when there is none left
+//
+int q1_next_sysex(const uint8_t* syx_data, int syx_size, int* pos, const uint8_t** msg);
+
+//  Decodes the blocks of a dump into q1_data (Q1_MAX_SYX_BLKS *
+//  Q1_BLK_BUF_SIZE bytes) as msq_syx_to_smf does: up to the first bad
+//  header, a block failing its checksum still kept but the last one.
+//  num_blks gets the valid blocks.  Returns the Q1 data size
+//
+int q1_decode_dump(const uint8_t* syx_data, int syx_size, uint8_t* q1_data, int* num_blks);
+
+//  Finds the next frame starting F0 41 57 70 from *pos, a frame cut
+//  short by a lost F7 ends at the next F0.  Returns its size and moves
+//  *pos past it, 0 when there is none left
+//
+int q1_next_frame(const uint8_t* syx_data, int syx_size, int* pos, const uint8_t** msg);
+
+//  Decodes a dump whose frames may be damaged, missing or repeated.
+//  Bad frames are skipped to the next valid one, and the Q1 stream
+//  rejoins at a bar line, in the first block after the gap where a
+//  bar opens with a full status byte, so nothing after it is read with
+//  the wrong running status.  q1_data needs Q1_MAX_SYX_BLKS *
+//  Q1_BLK_BUF_SIZE bytes and gets the payloads as msq_syx_to_smf
+//  concatenates them.  Starts at *pos and stops before a second dump's
+//  FCB, *pos is left there.  Returns the Q1 data size
+//
+int q1_salvage(const uint8_t* syx_data, int syx_size, int* pos, uint8_t* q1_data,
+               q1_salvage_report* report);
+
+//  Walks concatenated block payloads as msq_syx_to_smf builds them,
+//  one MIDI event or time signature change at a time.  Parsing starts
+//  at Q1_PARSE_START, past the FCB.  q1_parse_next returns FALSE at the
+//  0xFC track end or the end of the data.
+//
+void q1_parse_init(q1_parser* parser, const uint8_t* q1_data, int q1_size);
+bool q1_parse_next(q1_parser* parser, q1_event* event);
+
+//  Stores the start of every bar in bars while parsing, bar 0 right
+//  away, bar n at the nth 0xF9.  Up to max_bars entries are kept.
+//
+void q1_parse_bars(q1_parser* parser, q1_bar* bars, int max_bars);
+
+//  Puts the parser at the start of a bar stored by q1_parse_bars, the
+//  next q1_parse_next returns its first event
+//
+void q1_parse_seek(q1_parser* parser, const q1_bar* bar, int bar_num);
+
+#endif /* defined(__msq_convert__MSQ_Q1__) */
@@ -0,0 +1,288 @@
+//
+//  MSQ_RawMidi.cpp
+//  msq_convert
+//
+//  Raw MIDI capture reader, see MSQ_RawMidi.h
+//
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MSQ_RawMidi.h"
+
+
+static int64_t raw_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int hex_digit(char c)
+{
+    if ( (c >= '0') && (c <= '9') ) return (c - '0');
+    if ( (c >= 'a') && (c <= 'f') ) return (c - 'a' + 10);
+    if ( (c >= 'A') && (c <= 'F') ) return (c - 'A' + 10);
+
+    return (-1);
+}
+
+
+MSQ_RawMidi::MSQ_RawMidi()
+{
+    begin(-1, FALSE, 100.0);
+}
+
+
+MSQ_RawMidi::~MSQ_RawMidi()
+{
+}
+
+
+void MSQ_RawMidi::begin(int fd, bool arrival_time, double bpm)
+{
+    raw_fd = fd;
+    raw_bytes = arrival_time;
+    ticks_per_us = (bpm * 120.0) / 60000000.0;
+    at_end = (fd < 0);
+
+    read_pos = read_size = 0;
+    line_size = 0;
+    chunk_pos = chunk_size = 0;
+    chunk_us = 0;
+    origin_us = -1;
+    last_tick = 0;
+
+    running_status = 0;
+    num_data = 0;
+    common_left = 0;
+    in_sysex = FALSE;
+
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+const msq_raw_stats& MSQ_RawMidi::get_stats() const
+{
+    return (stats);
+}
+
+
+// as much as one read gives, waiting for it on a FIFO
+bool MSQ_RawMidi::fill_read_buf()
+{
+    if (at_end) return FALSE;
+
+    for (;;)
+    {
+        const ssize_t n = read(raw_fd, read_buf, sizeof(read_buf));
+        if ( (n < 0) && (errno == EINTR) ) continue;
+
+        if (n <= 0)
+        {
+            at_end = TRUE;
+            return FALSE;
+        }
+
+        read_pos = 0;
+        read_size = (int) n;
+        return TRUE;
+    }
+}
+
+
+// the time and bytes of the log line in line, FALSE if it has none
+bool MSQ_RawMidi::parse_line()
+{
+    char* p = line;
+    char* end;
+
+    line[line_size] = '\0';
+    while ( (*p == ' ') || (*p == '\t') ) p++;
+    if ( (*p == '\0') || (*p == '\r') || (*p == '#') ) return FALSE;
+
+    const double ms = strtod(p, &end);
+    if (end == p)
+    {
+        stats.num_bad_lines++;
+        return FALSE;
+    }
+
+    chunk_us = (int64_t)(ms * 1000.0);
+    chunk_size = 0;
+    chunk_pos = 0;
+
+    for (p = end; ; )
+    {
+        while ( (*p == ' ') || (*p == '\t') || (*p == ',') ) p++;
+        if ( (*p == '\0') || (*p == '\r') || (*p == '#') ) break;
+
+        if ( (p[0] == '0') && ((p[1] == 'x') || (p[1] == 'X')) )
+            p += 2;
+
+        const int hi = hex_digit(p[0]);
+        const int lo = (hi >= 0) ? hex_digit(p[1]) : -1;
+        if ( (hi < 0) || (lo < 0) || ((p[2] != '\0') && (p[2] != ' ') && (p[2] != '\t') && (p[2] != ',') && (p[2] != '\r')) )
+        {
+            // the bytes up to here still count
+            stats.num_bad_lines++;
+            break;
+        }
+
+        chunk[chunk_size++] = (uint8_t)((hi << 4) | lo);
+        p += 2;
+    }
+
+    return (chunk_size > 0);
+}
+
+
+// the next chunk of bytes with its time
+bool MSQ_RawMidi::next_chunk()
+{
+    if (raw_bytes)
+    {
+        if ( (read_pos >= read_size) && !fill_read_buf() ) return FALSE;
+
+        // a read is what arrived together
+        chunk_size = read_size - read_pos;
+        memcpy(chunk, &read_buf[read_pos], chunk_size);
+        chunk_pos = 0;
+        chunk_us = raw_now_us();
+        read_pos = read_size;
+
+        return TRUE;
+    }
+
+    for (;;)
+    {
+        if ( (read_pos >= read_size) && !fill_read_buf() )
+        {
+            // a last line without its newline
+            const bool has_bytes = (line_size > 0) && parse_line();
+            line_size = 0;
+            return (has_bytes);
+        }
+
+        while (read_pos < read_size)
+        {
+            const char c = (char) read_buf[read_pos++];
+
+            if (c != '\n')
+            {
+                if (line_size < MSQ_RAW_MAX_LINE)
+                    line[line_size++] = c;
+                continue;
+            }
+
+            const bool has_bytes = parse_line();
+            line_size = 0;
+            if (has_bytes) return TRUE;
+        }
+    }
+}
+
+
+// TRUE once byte completes a channel message, put in ev
+bool MSQ_RawMidi::add_byte(uint8_t byte, q1_event* ev)
+{
+    stats.num_bytes++;
+
+    if (byte >= 0xF8)
+    {
+        // realtime, anywhere, nothing else changes
+        stats.num_realtime++;
+        return FALSE;
+    }
+
+    if (byte >= 0xF0)
+    {
+        // SysEx and system common end running status
+        running_status = 0;
+        num_data = 0;
+        common_left = 0;
+        in_sysex = FALSE;
+
+        switch (byte)
+        {
+            case 0xF0: in_sysex = TRUE; stats.num_sysex++; break;
+            case 0xF7: break;
+            case 0xF1:
+            case 0xF3: common_left = 1; stats.num_common++; break;
+            case 0xF2: common_left = 2; stats.num_common++; break;
+            default:   stats.num_common++; break;
+        }
+        return FALSE;
+    }
+
+    if (byte >= 0x80)
+    {
+        // a status ends a SysEx missing its 0xF7, and a message cut short
+        running_status = byte;
+        num_data = 0;
+        common_left = 0;
+        in_sysex = FALSE;
+        return FALSE;
+    }
+
+    if (in_sysex) return FALSE;
+
+    if (common_left)
+    {
+        common_left--;
+        return FALSE;
+    }
+
+    if (!running_status)
+    {
+        stats.num_stray++;
+        return FALSE;
+    }
+
+    msg_data[num_data++] = byte;
+
+    const uint8_t type = running_status & 0xF0;
+    const int msg_size = ( (type == 0xC0) || (type == 0xD0) ) ? 2 : 3;
+    if (num_data < msg_size - 1) return FALSE;
+
+    num_data = 0;
+
+    if (origin_us < 0)
+        origin_us = chunk_us;
+
+    int tick = (int)((double)(chunk_us - origin_us) * ticks_per_us + 0.5);
+    if (tick < last_tick)
+        tick = last_tick;
+    last_tick = tick;
+
+    ev->tick = tick;
+    ev->status = running_status;
+    ev->data1 = msg_data[0];
+    ev->data2 = (msg_size == 3) ? msg_data[1] : 0;
+    ev->size = (uint8_t) msg_size;
+
+    stats.num_events++;
+    return TRUE;
+}
+
+
+bool MSQ_RawMidi::next_event(q1_event* ev)
+{
+    for (;;)
+    {
+        while (chunk_pos < chunk_size)
+        {
+            if ( add_byte(chunk[chunk_pos++], ev) )
+                return TRUE;
+        }
+
+        if ( !next_chunk() )
+            return FALSE;
+    }
+}
@@ -0,0 +1,98 @@
+//
+//  MSQ_RawMidi.h
+//  msq_convert
+//
+//  Reads a raw MIDI capture as it comes in, for encoding it straight to
+//  Q1 data without an SMF in between.  Either a log with a line per
+//  chunk received, its time in ms and the bytes in hex:
+//
+//      1042.5  90 3C 64
+//      1043.0  F8 40 3E
+//
+//  or the bytes themselves from a FIFO or device, timed as they are
+//  read.  Messages may be split over chunks anywhere; running status
+//  carries over, realtime bytes in the middle of a message are taken
+//  out, and SysEx and system common messages are skipped.  Reads a
+//  buffer at a time, so a capture of any length takes the same memory.
+//  Plain C++, see MSQ_Q1.h
+//
+
+#ifndef __msq_convert__MSQ_RawMidi__
+#define __msq_convert__MSQ_RawMidi__
+
+#include "MSQ_Q1.h"
+
+
+#define MSQ_RAW_READ_SIZE   4096    // bytes read at a time
+#define MSQ_RAW_MAX_LINE    1024    // log characters kept of a line, the rest is dropped
+
+
+// what the stream held besides channel messages
+typedef struct
+{
+    uint64_t num_bytes;      // MIDI bytes, log lines decoded
+    uint32_t num_events;     // channel messages
+    uint32_t num_realtime;   // 0xF8 - 0xFF
+    uint32_t num_sysex;
+    uint32_t num_common;     // 0xF1 - 0xF6
+    uint32_t num_stray;      // data bytes without a status to go with
+    uint32_t num_bad_lines;  // log lines that aren't time and hex bytes
+} msq_raw_stats;
+
+
+class MSQ_RawMidi
+{
+public:
+    MSQ_RawMidi();
+
+    ~MSQ_RawMidi();
+
+    //  fd stays the caller's.  arrival_time for raw bytes, else a log.
+    //  bpm maps time to 120 PPQN ticks, the first message at tick 0
+    //
+    void begin(int fd, bool arrival_time, double bpm);
+
+    //  The next channel message, blocking on the stream for more.
+    //  FALSE at its end.  Ticks never go back, a log's late lines are
+    //  moved up to the tick before
+    //
+    bool next_event(q1_event* ev);
+
+    const msq_raw_stats& get_stats() const;
+
+private:
+    int raw_fd;
+    bool raw_bytes;
+    double ticks_per_us;
+    bool at_end;
+
+    uint8_t read_buf[MSQ_RAW_READ_SIZE];
+    int read_pos;
+    int read_size;
+
+    char line[MSQ_RAW_MAX_LINE + 1];
+    int line_size;
+
+    // the chunk the bytes come from, and when it came
+    uint8_t chunk[MSQ_RAW_READ_SIZE];
+    int chunk_pos;
+    int chunk_size;
+    int64_t chunk_us;
+    int64_t origin_us;       // of the first message, -1 until then
+    int last_tick;
+
+    uint8_t running_status;  // 0 when there is none
+    uint8_t msg_data[2];
+    int num_data;
+    int common_left;         // data bytes of a system common message to skip
+    bool in_sysex;
+
+    msq_raw_stats stats;
+
+    bool fill_read_buf();
+    bool next_chunk();
+    bool parse_line();
+    bool add_byte(uint8_t byte, q1_event* ev);
+};
+
+#endif /* defined(__msq_convert__MSQ_RawMidi__) */
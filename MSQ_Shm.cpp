@@ -0,0 +1,447 @@
+//
+//  MSQ_Shm.cpp
+//  msq_convert
+//
+//  Shared memory conversion ring, see MSQ_Shm.h
+//
+//  Every hand over is a store with release, a futex wake, and on the
+//  other side a load with acquire, so the slot's bytes are seen as
+//  written.  Waits time out every MSQ_SHM_POLL_MS to check the other
+//  side still exists; the futexes are shared, not private, as they
+//  live in memory two processes map.
+//
+//  The server holds an exclusive flock on the segment for as long as
+//  it serves.  The kernel drops it when the server exits, however it
+//  exits, where a pid would still answer kill() as a zombie or could
+//  belong to another process by then.
+//
+//  A client is only known by the pid it leaves in the slot's owner
+//  with its ticket, taken with one compare and swap so the server,
+//  passing an untaken turn over, and a late client can't both get it.
+//  A pid is good enough here: a zombie client only holds the ring up
+//  until it is reaped.
+//
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+ #include <sys/syscall.h>
+ #include <linux/futex.h>
+ #define MSQ_HAVE_FUTEX 1
+#else
+ #define MSQ_HAVE_FUTEX 0
+#endif
+
+#include "MSQ_Shm.h"
+
+
+#define MSQ_SHM_SLOT_BYTES(slot_size)   (sizeof(msq_shm_slot) + (slot_size))
+
+
+// sleeps while *addr is val, FALSE on timeout or signal
+static bool shm_futex_wait(uint32_t* addr, uint32_t val, int timeout_ms)
+{
+#if MSQ_HAVE_FUTEX
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+
+    return ( syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, 0, 0) == 0 ) || (errno == EAGAIN);
+#else
+    (void) addr; (void) val;
+    usleep(timeout_ms * 1000);
+    return FALSE;
+#endif
+}
+
+
+static void shm_futex_wake(uint32_t* addr)
+{
+#if MSQ_HAVE_FUTEX
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#else
+    (void) addr;
+#endif
+}
+
+
+// the server's lock is held
+static bool shm_locked(int fd)
+{
+    if (flock(fd, LOCK_SH | LOCK_NB) == 0)
+    {
+        flock(fd, LOCK_UN);
+        return FALSE;
+    }
+
+    return (errno == EWOULDBLOCK);
+}
+
+
+static bool shm_pid_alive(uint32_t pid)
+{
+    return pid && ( (kill((pid_t) pid, 0) == 0) || (errno == EPERM) );
+}
+
+
+static int64_t shm_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+MSQ_Shm::MSQ_Shm()
+{
+    shm_name[0] = '\0';
+    is_server = FALSE;
+    segment = 0;
+    segment_size = 0;
+    hdr = 0;
+    shm_fd = -1;
+    server_ticket = 0;
+    stall_ticket = 0;
+    stall_since_ms = 0;
+}
+
+
+MSQ_Shm::~MSQ_Shm()
+{
+    close();
+}
+
+
+bool MSQ_Shm::create(const char* name, int num_slots, int slot_size)
+{
+    close();
+
+    if (!MSQ_HAVE_FUTEX) return FALSE;
+    if (snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name) >= (int) sizeof(shm_name))
+        return FALSE;
+
+    // tickets wrap at 2^32, the slot of one must not jump when they do
+    int n = 1;
+    while ( (n * 2 <= num_slots) && (n * 2 <= MSQ_SHM_MAX_SLOTS) )
+        n *= 2;
+    slot_size = (slot_size + 63) & ~63;
+    if (slot_size <= 0) return FALSE;
+
+    // one left behind by a server that died is taken over
+    MSQ_Shm prev;
+    if ( prev.open(name) )
+        return FALSE;
+    shm_unlink(shm_name);
+
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (shm_fd < 0) return FALSE;
+    is_server = TRUE;
+
+    segment_size = sizeof(msq_shm_hdr) + (size_t) n * MSQ_SHM_SLOT_BYTES(slot_size);
+
+    if ( (flock(shm_fd, LOCK_EX | LOCK_NB) < 0) || (ftruncate(shm_fd, (off_t) segment_size) < 0) )
+    {
+        close();
+        return FALSE;
+    }
+
+    void* map = mmap(0, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close();
+        return FALSE;
+    }
+
+    // ftruncate zeroed it, every slot FREE
+    segment = (uint8_t*) map;
+    hdr = (msq_shm_hdr*) segment;
+    server_ticket = 0;
+    stall_ticket = (uint32_t) -1;
+
+    hdr->version = MSQ_SHM_VERSION;
+    hdr->num_slots = (uint32_t) n;
+    hdr->slot_size = (uint32_t) slot_size;
+    hdr->next_ticket = 0;
+    hdr->server_pid = (uint32_t) getpid();
+
+    // as if the ticket a round before each slot's first had it
+    for (int s = 0; s < n; s++)
+    {
+        slot_at((uint32_t) s)->turn = (uint32_t) s;
+        slot_at((uint32_t) s)->owner = (uint64_t)(uint32_t)(s - n) << 32;
+    }
+
+    // last, a client seeing the magic sees the rest
+    __atomic_store_n(&hdr->magic, MSQ_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+
+bool MSQ_Shm::open(const char* name)
+{
+    struct stat st;
+
+    close();
+
+    if (!MSQ_HAVE_FUTEX) return FALSE;
+    if (snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name) >= (int) sizeof(shm_name))
+        return FALSE;
+
+    shm_fd = shm_open(shm_name, O_RDWR | O_CLOEXEC, 0);
+    if (shm_fd < 0) return FALSE;
+
+    if ( (fstat(shm_fd, &st) < 0) || ((size_t) st.st_size < sizeof(msq_shm_hdr)) || !shm_locked(shm_fd) )
+    {
+        close();
+        return FALSE;
+    }
+
+    void* map = mmap(0, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close();
+        return FALSE;
+    }
+
+    segment = (uint8_t*) map;
+    segment_size = (size_t) st.st_size;
+    hdr = (msq_shm_hdr*) segment;
+
+    const bool valid = ( (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == MSQ_SHM_MAGIC)
+                         && (hdr->version == MSQ_SHM_VERSION)
+                         && hdr->num_slots && !(hdr->num_slots & (hdr->num_slots - 1))
+                         && (sizeof(msq_shm_hdr) + (size_t) hdr->num_slots * MSQ_SHM_SLOT_BYTES(hdr->slot_size) <= segment_size) );
+    if (!valid)
+        close();
+
+    return (valid);
+}
+
+
+void MSQ_Shm::close()
+{
+    if (segment)
+        munmap(segment, segment_size);
+
+    if (is_server)
+        shm_unlink(shm_name);
+
+    if (shm_fd >= 0)
+        ::close(shm_fd);
+    shm_fd = -1;
+
+    segment = 0;
+    segment_size = 0;
+    hdr = 0;
+    is_server = FALSE;
+}
+
+
+int MSQ_Shm::get_slot_size() const
+{
+    return hdr ? (int) hdr->slot_size : 0;
+}
+
+
+msq_shm_slot* MSQ_Shm::slot_at(uint32_t ticket)
+{
+    const size_t slot = ticket & (hdr->num_slots - 1);
+
+    return (msq_shm_slot*)(segment + sizeof(msq_shm_hdr) + slot * MSQ_SHM_SLOT_BYTES(hdr->slot_size));
+}
+
+
+uint8_t* MSQ_Shm::get_data(msq_shm_slot* slot)
+{
+    return (uint8_t*)(slot + 1);
+}
+
+
+uint32_t* MSQ_Shm::get_tempos(msq_shm_slot* slot)
+{
+    return (uint32_t*)(get_data(slot) + (((size_t) slot->data_size + 3) & ~(size_t) 3));
+}
+
+
+// tick, MPQN pairs that fit after the data, rounded up in size_t so a
+// data_size near 4 GB can't wrap to a small one
+int MSQ_Shm::get_tempo_room(const msq_shm_slot* slot) const
+{
+    const size_t used = ((size_t) slot->data_size + 3) & ~(size_t) 3;
+
+    return (used < hdr->slot_size) ? (int)((hdr->slot_size - used) / 8) : 0;
+}
+
+
+bool MSQ_Shm::server_alive()
+{
+    return shm_locked(shm_fd);
+}
+
+
+msq_shm_slot* MSQ_Shm::begin_request()
+{
+    if (!hdr) return 0;
+
+    const uint32_t ticket = __atomic_fetch_add(&hdr->next_ticket, 1, __ATOMIC_ACQ_REL);
+    msq_shm_slot* slot = slot_at(ticket);
+
+    for (;;)
+    {
+        const uint32_t turn = __atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE);
+        if (turn == ticket) break;
+
+        // passed over already, see pass_over()
+        if ((int32_t)(turn - ticket) > 0) return 0;
+
+        if ( !shm_futex_wait(&slot->turn, turn, MSQ_SHM_POLL_MS) && !server_alive() )
+            return 0;
+    }
+
+    // take it, unless the server has passed it over meanwhile
+    uint64_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+    if ( ((uint32_t)(owner >> 32) != ticket - hdr->num_slots)
+        || !__atomic_compare_exchange_n(&slot->owner, &owner, ((uint64_t) ticket << 32) | (uint32_t) getpid(),
+                                        FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+        return 0;
+
+    slot->data_size = 0;
+    slot->num_tempos = 0;
+    slot->tempo_ppqn = 0;
+    slot->result = MSQ_SHM_BAD_REQUEST;
+
+    return (slot);
+}
+
+
+void MSQ_Shm::post_request(msq_shm_slot* slot)
+{
+    __atomic_store_n(&slot->state, MSQ_SHM_REQUEST, __ATOMIC_RELEASE);
+    shm_futex_wake(&slot->state);
+}
+
+
+bool MSQ_Shm::wait_result(msq_shm_slot* slot)
+{
+    for (;;)
+    {
+        const uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == MSQ_SHM_DONE) return TRUE;
+
+        if ( !shm_futex_wait(&slot->state, state, MSQ_SHM_POLL_MS) && !server_alive() )
+            return FALSE;
+    }
+}
+
+
+void MSQ_Shm::end_request(msq_shm_slot* slot)
+{
+    const uint32_t turn = __atomic_load_n(&slot->turn, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->state, MSQ_SHM_FREE, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->turn, turn + hdr->num_slots, __ATOMIC_RELEASE);
+    shm_futex_wake(&slot->turn);
+}
+
+
+msq_shm_slot* MSQ_Shm::next_request(int timeout_ms)
+{
+    if ( !hdr || !is_server ) return 0;
+
+    msq_shm_slot* slot = slot_at(server_ticket);
+
+    const uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == MSQ_SHM_REQUEST)
+        return (slot);
+
+    if ( pass_over(slot) )
+        return 0;
+
+    // a client has the ticket, so look again soon in case it stalls
+    if ( (__atomic_load_n(&hdr->next_ticket, __ATOMIC_ACQUIRE) != server_ticket) && (timeout_ms > MSQ_SHM_POLL_MS) )
+        timeout_ms = MSQ_SHM_POLL_MS;
+
+    shm_futex_wait(&slot->state, state, timeout_ms);
+
+    return (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == MSQ_SHM_REQUEST) ? slot : 0;
+}
+
+
+void MSQ_Shm::post_result(msq_shm_slot* slot)
+{
+    __atomic_store_n(&slot->state, MSQ_SHM_DONE, __ATOMIC_RELEASE);
+    shm_futex_wake(&slot->state);
+    server_ticket++;
+}
+
+
+//  The turn at server_ticket, with no request posted.  Ends it for a
+//  client that died since taking it, or one that never took it within
+//  MSQ_SHM_CLAIM_MS, and the slot's previous turn if its client died
+//  before end_request().  TRUE if it moved anything on
+//
+bool MSQ_Shm::pass_over(msq_shm_slot* slot)
+{
+    const uint32_t ticket = server_ticket;
+
+    // nobody has this ticket yet
+    if (__atomic_load_n(&hdr->next_ticket, __ATOMIC_ACQUIRE) == ticket) return FALSE;
+
+    uint32_t turn = __atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE);
+    uint64_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+
+    if (turn != ticket)
+    {
+        // the previous turn has its result, its client may yet read it
+        if ( ((uint32_t)(owner >> 32) != turn) || shm_pid_alive((uint32_t) owner) ) return FALSE;
+
+        uint32_t state = MSQ_SHM_DONE;
+        __atomic_compare_exchange_n(&slot->state, &state, MSQ_SHM_FREE, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        if ( __atomic_compare_exchange_n(&slot->turn, &turn, turn + hdr->num_slots,
+                                         FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
+            shm_futex_wake(&slot->turn);
+
+        return TRUE;
+    }
+
+    if ((uint32_t)(owner >> 32) == ticket)
+    {
+        // taken, and still being filled in
+        if ( shm_pid_alive((uint32_t) owner) ) return FALSE;
+    }
+    else
+    {
+        // up but not taken, its client gets MSQ_SHM_CLAIM_MS
+        const int64_t now_ms = shm_now_ms();
+        if (stall_ticket != ticket)
+        {
+            stall_ticket = ticket;
+            stall_since_ms = now_ms;
+        }
+        if (now_ms - stall_since_ms < MSQ_SHM_CLAIM_MS) return FALSE;
+
+        if ( !__atomic_compare_exchange_n(&slot->owner, &owner, (uint64_t) ticket << 32,
+                                          FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+            return FALSE;
+    }
+
+    __atomic_store_n(&slot->state, MSQ_SHM_FREE, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->turn, ticket + hdr->num_slots, __ATOMIC_RELEASE);
+    shm_futex_wake(&slot->turn);
+    server_ticket++;
+
+    return TRUE;
+}
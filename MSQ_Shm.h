@@ -0,0 +1,141 @@
+//
+//  MSQ_Shm.h
+//  msq_convert
+//
+//  Conversion through shared memory, for a DAW plugin talking to a
+//  resident msqconvert serve instead of writing a .mid, running the
+//  CLI and reading the .syx back.  A POSIX shm segment holds a ring of
+//  slots; a client takes the next one in turn, puts the SMF or SysEx
+//  bytes and options in it, and the server leaves the converted bytes
+//  in the same slot.  Both sides sleep on futexes in the slot, so an
+//  idle server costs nothing and a request is picked up at once.
+//  Linux only, plain C++ so a plugin can build the client side on its
+//  own, with MSQ_Codec.h and MSQ_Q1.h.
+//
+//  Slots go round in ticket order.  The server passes over a turn
+//  whose client died, and one no client takes within MSQ_SHM_CLAIM_MS
+//  of it coming up, so a client killed halfway holds up the ring
+//  behind it for that long at most.
+//
+
+#ifndef __msq_convert__MSQ_Shm__
+#define __msq_convert__MSQ_Shm__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "MSQ_Codec.h"
+
+
+#define MSQ_SHM_MAGIC       0x5351534DUL   // 'MSQS'
+#define MSQ_SHM_VERSION     2
+#define MSQ_SHM_NUM_SLOTS   4              // a power of 2, tickets wrap
+#define MSQ_SHM_MAX_SLOTS   64
+#define MSQ_SHM_SLOT_SIZE   (1024 * 1024)  // data bytes, a reverse SMF at 960 PPQN fits
+#define MSQ_SHM_POLL_MS     100            // how often a waiting side checks the other is alive
+#define MSQ_SHM_CLAIM_MS    1000           // a turn not taken in this long is passed over
+
+// slot states
+#define MSQ_SHM_FREE        0
+#define MSQ_SHM_REQUEST     1
+#define MSQ_SHM_DONE        2
+
+// results
+#define MSQ_SHM_OK          0
+#define MSQ_SHM_FAILED      -1     // not convertible, as the CLI would say
+#define MSQ_SHM_TOO_BIG     -2     // the result doesn't fit the slot
+#define MSQ_SHM_BAD_REQUEST -3
+
+
+// at the start of the segment, slots follow
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;      // data bytes after each msq_shm_slot
+    uint32_t next_ticket;    // clients take these in turn
+    uint32_t server_pid;     // for information, see MSQ_Shm.cpp
+    uint32_t reserved[10];
+} msq_shm_hdr;
+
+
+//  A request, then its result in place.  The data is SMF or SysEx
+//  bytes, followed at the next 4 byte boundary by num_tempos tick,
+//  MPQN pairs of uint32_t: the tempo map to write back for MSQ_CODEC_TO_SMF,
+//  the source's tempo map for MSQ_CODEC_TO_Q1
+//
+typedef struct
+{
+    uint32_t turn;           // futex, the ticket whose turn it is
+    uint32_t state;          // futex, MSQ_SHM_FREE ...
+    int32_t  direction;      // MSQ_CODEC_TO_Q1 or MSQ_CODEC_TO_SMF
+    int32_t  src_track;
+    uint32_t filters;        // FILTER_OPT_ ... as msq_convert_smf/syx take them
+    int32_t  n_timebase;     // PPQN of the SMF written
+    uint32_t data_size;
+    uint32_t num_tempos;
+    uint32_t tempo_ppqn;
+    int32_t  result;         // MSQ_SHM_OK ...
+    uint64_t owner;          // ticket << 32 | pid of the client that took it, pid 0 if passed over
+    uint32_t reserved[4];
+} msq_shm_slot;
+
+
+class MSQ_Shm
+{
+public:
+    MSQ_Shm();
+
+    ~MSQ_Shm();
+
+    //  Server: makes the segment, name as for shm_open.  FALSE if it
+    //  couldn't, or a live server already has it
+    //
+    bool create(const char* name, int num_slots, int slot_size);
+
+    // client: FALSE if no server is there
+    bool open(const char* name);
+    void close();
+
+    int get_slot_size() const;
+    uint8_t* get_data(msq_shm_slot* slot);
+    uint32_t* get_tempos(msq_shm_slot* slot);    // after data_size bytes of data
+    int get_tempo_room(const msq_shm_slot* slot) const;
+
+    //  Client: waits for a slot of its own, 0 if the server went away
+    //  or passed the turn over.
+    //  Fill it in, post_request() and wait_result(), read the result,
+    //  and end_request() lets the next client have it
+    //
+    msq_shm_slot* begin_request();
+    void post_request(msq_shm_slot* slot);
+    bool wait_result(msq_shm_slot* slot);
+    void end_request(msq_shm_slot* slot);
+
+    //  Server: the next request in turn, 0 after timeout_ms without one,
+    //  on a signal or after passing a stalled turn over.  Convert it in
+    //  place, then post_result()
+    //
+    msq_shm_slot* next_request(int timeout_ms);
+    void post_result(msq_shm_slot* slot);
+
+private:
+    char shm_name[256];
+    bool is_server;
+
+    int shm_fd;             // the server's flock tells it's alive
+    uint8_t* segment;
+    size_t segment_size;
+    msq_shm_hdr* hdr;
+
+    uint32_t server_ticket;
+    uint32_t stall_ticket;  // seen up but not taken since stall_since_ms
+    int64_t stall_since_ms;
+
+    msq_shm_slot* slot_at(uint32_t ticket);
+    bool server_alive();
+    bool pass_over(msq_shm_slot* slot);
+};
+
+#endif /* defined(__msq_convert__MSQ_Shm__) */
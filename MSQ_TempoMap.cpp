@@ -0,0 +1,162 @@
+//
+//  MSQ_TempoMap.cpp
+//  msq_convert
+//
+//  Tempo changes with prefix-summed time, see MSQ_TempoMap.h
+//
+
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "MSQ_Q1.h"
+#include "MSQ_TempoMap.h"
+
+
+MSQ_TempoMap::MSQ_TempoMap()
+{
+    ppqn = 120;
+}
+
+
+MSQ_TempoMap::~MSQ_TempoMap()
+{
+}
+
+
+void MSQ_TempoMap::clear(int new_ppqn)
+{
+    ppqn = (new_ppqn > 0) ? new_ppqn : 120;
+    ticks.clear();
+    mpqns.clear();
+    scaled_us.clear();
+}
+
+
+void MSQ_TempoMap::add_tempo(int tick, uint32_t mpqn)
+{
+    if ( !mpqn || (tick < 0) ) return;
+
+    const int n = (int) ticks.size();
+
+    if ( n && (tick <= ticks[n - 1]) )
+    {
+        // same tick, the later event wins
+        if (tick == ticks[n - 1])
+            mpqns[n - 1] = mpqn;
+        return;
+    }
+
+    // time up to here, whole microseconds * ppqn so nothing rounds
+    const int64_t prev_tick = n ? ticks[n - 1] : 0;
+    const int64_t prev_mpqn = n ? mpqns[n - 1] : MSQ_TEMPO_SMF_DEFAULT;
+    const int64_t prev_us = n ? scaled_us[n - 1] : 0;
+
+    ticks.push_back(tick);
+    mpqns.push_back(mpqn);
+    scaled_us.push_back(prev_us + (tick - prev_tick) * prev_mpqn);
+}
+
+
+int MSQ_TempoMap::get_num_tempos() const
+{
+    return (int) ticks.size();
+}
+
+
+int MSQ_TempoMap::get_ppqn() const
+{
+    return (ppqn);
+}
+
+
+int MSQ_TempoMap::get_tick(int idx) const
+{
+    return ticks[idx];
+}
+
+
+uint32_t MSQ_TempoMap::get_mpqn(int idx) const
+{
+    return mpqns[idx];
+}
+
+
+int64_t MSQ_TempoMap::tick_to_us(int tick) const
+{
+    // last change at or before tick
+    const int i = (int)(std::upper_bound(ticks.begin(), ticks.end(), tick) - ticks.begin()) - 1;
+
+    if (i < 0)
+        return ((int64_t) tick * MSQ_TEMPO_SMF_DEFAULT) / ppqn;
+
+    return (scaled_us[i] + (int64_t)(tick - ticks[i]) * mpqns[i]) / ppqn;
+}
+
+
+int MSQ_TempoMap::us_to_tick(int64_t us) const
+{
+    const int64_t scaled = us * ppqn;
+    const int i = (int)(std::upper_bound(scaled_us.begin(), scaled_us.end(), scaled) - scaled_us.begin()) - 1;
+
+    if (i < 0)
+        return (int)(scaled / MSQ_TEMPO_SMF_DEFAULT);
+
+    return ticks[i] + (int)((scaled - scaled_us[i]) / mpqns[i]);
+}
+
+
+bool MSQ_TempoMap::save(const char* path) const
+{
+    msq_tempo_hdr hdr;
+    hdr.magic = MSQ_TEMPO_MAGIC;
+    hdr.version = MSQ_TEMPO_VERSION;
+    hdr.ppqn = (uint32_t) ppqn;
+    hdr.num_tempos = (uint32_t) ticks.size();
+
+    FILE* tempo_file = fopen(path, "wb");
+    if (tempo_file == 0) return FALSE;
+
+    bool written = (fwrite(&hdr, sizeof(hdr), 1, tempo_file) == 1);
+    for (size_t i = 0; written && (i < ticks.size()); i++)
+    {
+        const uint32_t entry[2] = { (uint32_t) ticks[i], mpqns[i] };
+        written = (fwrite(entry, sizeof(entry), 1, tempo_file) == 1);
+    }
+
+    return ( (fclose(tempo_file) == 0) && written );
+}
+
+
+bool MSQ_TempoMap::load(const char* path)
+{
+    msq_tempo_hdr hdr;
+
+    FILE* tempo_file = fopen(path, "rb");
+    if (tempo_file == 0) return FALSE;
+
+    bool valid = (fread(&hdr, sizeof(hdr), 1, tempo_file) == 1)
+                 && (hdr.magic == MSQ_TEMPO_MAGIC) && (hdr.version == MSQ_TEMPO_VERSION)
+                 && (hdr.ppqn > 0) && (hdr.ppqn <= 0x7FFF);
+
+    if (valid)
+    {
+        clear((int) hdr.ppqn);
+
+        for (uint32_t i = 0; i < hdr.num_tempos; i++)
+        {
+            uint32_t entry[2];
+            if (fread(entry, sizeof(entry), 1, tempo_file) != 1)
+            {
+                valid = FALSE;
+                break;
+            }
+            add_tempo((int) entry[0], entry[1]);
+        }
+    }
+    fclose(tempo_file);
+
+    if (!valid) clear(120);
+
+    return (valid);
+}
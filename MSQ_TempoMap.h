@@ -0,0 +1,67 @@
+//
+//  MSQ_TempoMap.h
+//  msq_convert
+//
+//  Tempo changes of a sequence with tick <-> microsecond lookup.
+//  The MSQ-100 doesn't store tempo, so the map of the source SMF is
+//  kept in a small file next to the dump and put back on the way
+//  back to SMF.  Plain C++, msqfast uses it as well.
+//
+
+#ifndef __msq_convert__MSQ_TempoMap__
+#define __msq_convert__MSQ_TempoMap__
+
+#include <stdint.h>
+#include <vector>
+
+
+#define MSQ_TEMPO_MAGIC         0x5451534DUL   // 'MSQT'
+#define MSQ_TEMPO_VERSION       1
+#define MSQ_TEMPO_SMF_DEFAULT   500000         // 120 BPM, SMF without tempo events
+#define MSQ_TEMPO_MSQ_DEFAULT   600000         // 100 BPM, written for Q1 data
+
+
+// tempo file layout: header, then num_tempos pairs of uint32 tick, mpqn
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ppqn;
+    uint32_t num_tempos;
+} msq_tempo_hdr;
+
+
+class MSQ_TempoMap
+{
+public:
+    MSQ_TempoMap();
+
+    ~MSQ_TempoMap();
+
+    void clear(int ppqn);
+
+    // changes must come in tick order, a second one at a tick replaces it
+    void add_tempo(int tick, uint32_t mpqn);
+
+    int get_num_tempos() const;
+    int get_ppqn() const;
+    int get_tick(int idx) const;
+    uint32_t get_mpqn(int idx) const;   // microseconds per quarter note
+
+    //  Both O(log n) over the prefix sums.  Before the first change,
+    //  and in an empty map, the SMF default of 120 BPM applies
+    //
+    int64_t tick_to_us(int tick) const;
+    int us_to_tick(int64_t us) const;
+
+    bool save(const char* path) const;
+    bool load(const char* path);
+
+private:
+    int ppqn;
+    std::vector<int> ticks;
+    std::vector<uint32_t> mpqns;
+    std::vector<int64_t> scaled_us;   // microseconds * ppqn up to each change
+};
+
+#endif /* defined(__msq_convert__MSQ_TempoMap__) */
@@ -0,0 +1,226 @@
+//
+//  MSQ_Transcode.cpp
+//  msq_convert
+//
+//  Q1 data to SMF bytes, see MSQ_Transcode.h
+//
+
+#include <string.h>
+
+#include "MSQ_Transcode.h"
+
+
+static const uint8_t msq_track_title[] =
+{
+    0xFF, 0x03, 0x10, 'M', 'S', 'Q', '-', '1',
+    '0', '0', ' ', 'S', 'e', 'q', 'u', 'e', 'n', 'c', 'e'
+};
+
+
+static int write_var_len(uint8_t* out, uint32_t value)
+{
+    int n = 0;
+    uint8_t buf[5];
+
+    do
+    {
+        buf[n++] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+    }
+    while (value);
+
+    for (int i = 0; i < n; i++)
+        out[i] = buf[n - 1 - i] | ((i < n - 1) ? 0x80 : 0x00);
+
+    return (n);
+}
+
+
+static int write_tempo(uint8_t* out, int delta, uint32_t mpqn)
+{
+    int n = write_var_len(out, delta);
+
+    out[n++] = 0xFF; out[n++] = 0x51; out[n++] = 0x03;
+    out[n++] = (uint8_t)(mpqn >> 16);
+    out[n++] = (uint8_t)(mpqn >> 8);
+    out[n++] = (uint8_t) mpqn;
+
+    return (n);
+}
+
+
+// every Q1 byte yields at most one event, plus a note off before it
+int q1_smf_size_bound(int q1_size, const MSQ_TempoMap& tempo_map)
+{
+    return 64 + (int) sizeof(msq_track_title) + q1_size * 16 + (tempo_map.get_num_tempos() + 1) * 12;
+}
+
+
+// tempo map tick to 120 PPQN, as the Q1 ticks
+static int tempo_tick_120(const MSQ_TempoMap& tempo_map, int i)
+{
+    return (int)(((int64_t) tempo_map.get_tick(i) * 120) / tempo_map.get_ppqn());
+}
+
+
+//  A note on while the same key still sounds gets a note off first, as
+//  matching note pairs does in the JUCE path.  Tempo changes merge in
+//  as parse_Q1_data does, past the last event they are dropped.
+//  parser is fresh from q1_parse_init or put at a bar by q1_parse_seek,
+//  whose tick becomes tick 0.
+//
+static int transcode_smf(q1_parser* parser, const MSQ_TempoMap& tempo_map,
+                         short n_timebase, uint8_t* smf)
+{
+    uint8_t* p = smf;
+    const int start_tick = parser->tick;
+
+    memcpy(p, "MThd\0\0\0\6\0\0\0\1", 12);
+    p += 12;
+    *p++ = (uint8_t)(n_timebase >> 8);
+    *p++ = (uint8_t) n_timebase;
+    memcpy(p, "MTrk\0\0\0\0", 8);
+    p += 8;
+    uint8_t* trk_start = p;
+
+    *p++ = 0x00;
+    memcpy(p, msq_track_title, sizeof(msq_track_title));
+    p += sizeof(msq_track_title);
+
+    uint8_t key_on[16][128];
+    memset(key_on, 0, sizeof(key_on));
+
+    const int num_tempos = tempo_map.get_num_tempos();
+    uint8_t last_status = 0xFF;
+    int last_tick = 0;
+    int next_tempo = 0;
+
+    // the dump has no tempo
+    if (!num_tempos)
+        p += write_tempo(p, 0, MSQ_TEMPO_MSQ_DEFAULT);
+
+    // from a bar on, only the last tempo before it is still in effect
+    if (start_tick)
+    {
+        while ( (next_tempo + 1 < num_tempos) && (tempo_tick_120(tempo_map, next_tempo + 1) <= start_tick) )
+            next_tempo++;
+    }
+
+    for ( ; (next_tempo < num_tempos) && (tempo_tick_120(tempo_map, next_tempo) <= start_tick); next_tempo++)
+        p += write_tempo(p, 0, tempo_map.get_mpqn(next_tempo));
+
+    // the beats per measure the bar starts with, 4 needs no event
+    if (start_tick && (parser->time_sig != 4))
+    {
+        *p++ = 0x00;
+        *p++ = 0xFF; *p++ = 0x58; *p++ = 0x04;
+        *p++ = parser->time_sig; *p++ = 0x02; *p++ = 0x01; *p++ = 0x60;
+    }
+
+    q1_event ev;
+
+    while ( q1_parse_next(parser, &ev) )
+    {
+        const int ev_tick = ev.tick - start_tick;
+
+        // same rounding as changePPQN
+        int tick = ev_tick;
+        if (n_timebase != 120)
+            tick = (ev_tick * n_timebase + 60) / 120;
+
+        while (next_tempo < num_tempos)
+        {
+            // tempo map ticks to 120 PPQN, then like the events
+            int tempo_tick = tempo_tick_120(tempo_map, next_tempo) - start_tick;
+            if (tempo_tick > ev_tick) break;
+            if (n_timebase != 120)
+                tempo_tick = (tempo_tick * n_timebase + 60) / 120;
+
+            p += write_tempo(p, (tempo_tick > last_tick) ? tempo_tick - last_tick : 0, tempo_map.get_mpqn(next_tempo++));
+            if (tempo_tick > last_tick) last_tick = tempo_tick;
+            last_status = 0xFF;
+        }
+
+        int delta = tick - last_tick;
+        if (delta < 0) delta = 0;
+        last_tick = tick;
+
+        if (ev.status == 0xFF)
+        {
+            // time signature x/4
+            p += write_var_len(p, delta);
+            *p++ = 0xFF; *p++ = 0x58; *p++ = 0x04;
+            *p++ = ev.data1; *p++ = 0x02; *p++ = 0x01; *p++ = 0x60;
+            last_status = 0xFF;
+            continue;
+        }
+
+        const int chan = ev.status & 0x0F;
+        const bool note_on = ( ((ev.status & 0xF0) == 0x90) && ev.data2 );
+        const bool is_note = ( ((ev.status & 0xF0) == 0x80) || ((ev.status & 0xF0) == 0x90) );
+
+        // note offs of velocity 0 go out as 0x9n, like write_smf, with a
+        // release velocity they stay 0x8n
+        const uint8_t status = ( is_note && !ev.data2 ) ? (0x90 | chan) : ev.status;
+
+        // struck before the start bar
+        if ( start_tick && is_note && !note_on && !key_on[chan][ev.data1 & 0x7F] )
+            continue;
+
+        if (note_on && key_on[chan][ev.data1 & 0x7F])
+        {
+            p += write_var_len(p, delta);
+            delta = 0;
+            if (last_status != status)
+                *p++ = status;
+            *p++ = ev.data1;
+            *p++ = 0x00;
+            last_status = status;
+        }
+        if (is_note)
+            key_on[chan][ev.data1 & 0x7F] = note_on;
+
+        p += write_var_len(p, delta);
+        if (status != last_status)
+            *p++ = status;
+        *p++ = ev.data1;
+        if (ev.size == 3)
+            *p++ = ev.data2;
+        last_status = status;
+    }
+
+    *p++ = 0x00;
+    *p++ = 0xFF; *p++ = 0x2F; *p++ = 0x00;
+
+    const uint32_t trk_size = (uint32_t)(p - trk_start);
+    trk_start[-4] = (uint8_t)(trk_size >> 24);
+    trk_start[-3] = (uint8_t)(trk_size >> 16);
+    trk_start[-2] = (uint8_t)(trk_size >> 8);
+    trk_start[-1] = (uint8_t) trk_size;
+
+    return (int)(p - smf);
+}
+
+
+int q1_transcode_smf(const uint8_t* q1_data, int q1_size, const MSQ_TempoMap& tempo_map,
+                     short n_timebase, uint8_t* smf)
+{
+    q1_parser parser;
+    q1_parse_init(&parser, q1_data, q1_size);
+
+    return transcode_smf(&parser, tempo_map, n_timebase, smf);
+}
+
+
+int q1_transcode_smf_from(const uint8_t* q1_data, int q1_size, const MSQ_TempoMap& tempo_map,
+                          const MSQ_BarIndex& bar_index, int from_bar,
+                          short n_timebase, uint8_t* smf)
+{
+    q1_parser parser;
+    q1_parse_init(&parser, q1_data, q1_size);
+
+    if ( (from_bar >= bar_index.get_num_bars()) || !bar_index.seek(&parser, from_bar) )
+        return (0);
+
+    return transcode_smf(&parser, tempo_map, n_timebase, smf);
+}
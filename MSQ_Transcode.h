@@ -0,0 +1,41 @@
+//
+//  MSQ_Transcode.h
+//  msq_convert
+//
+//  Q1 data straight to Standard MIDI File bytes, for bulk reverse
+//  conversion.  The parser's events go out as track bytes right away:
+//  Q1 deltas, 0xF8 overflows summed in, become variable length deltas,
+//  0xFA beats per measure changes FF 58 meta events, and running status
+//  is kept up across them where it can be.  No MidiMessage, sequence or
+//  writeTo in between, and the file is the one msq_syx_to_smf and
+//  write_smf make, byte for byte.  Plain C++, see MSQ_Q1.h
+//
+
+#ifndef __msq_convert__MSQ_Transcode__
+#define __msq_convert__MSQ_Transcode__
+
+#include "MSQ_Q1.h"
+#include "MSQ_TempoMap.h"
+#include "MSQ_BarIndex.h"
+
+
+// smf needs this many bytes for q1_size bytes of Q1 data
+int q1_smf_size_bound(int q1_size, const MSQ_TempoMap& tempo_map);
+
+//  Writes a Format 0 SMF at n_timebase PPQN into smf, from the Q1 data
+//  msq_syx_to_smf would parse.  The tempo comes from tempo_map, 100 BPM
+//  if it is empty.  Returns the SMF size
+//
+int q1_transcode_smf(const uint8_t* q1_data, int q1_size, const MSQ_TempoMap& tempo_map,
+                     short n_timebase, uint8_t* smf);
+
+//  The same from bar from_bar of bar_index on, bar 0 being the first.
+//  The bar's start is tick 0, the tempo and beats per measure in effect
+//  there go out first, and note offs of notes struck before it are left
+//  out.  Returns 0 if from_bar isn't in the index
+//
+int q1_transcode_smf_from(const uint8_t* q1_data, int q1_size, const MSQ_TempoMap& tempo_map,
+                          const MSQ_BarIndex& bar_index, int from_bar,
+                          short n_timebase, uint8_t* smf);
+
+#endif /* defined(__msq_convert__MSQ_Transcode__) */
@@ -0,0 +1,320 @@
+//
+//  MSQ_Watch.cpp
+//  msq_convert
+//
+//  Watch folder conversion, see MSQ_Watch.h
+//
+//  The main thread only reads inotify events and keeps the files
+//  seen until they settle, so a burst of drops never waits on a
+//  conversion.  Settled files go into a queue the workers take from.
+//
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+ #include <sys/inotify.h>
+ #define MSQ_HAVE_INOTIFY 1
+#else
+ #define MSQ_HAVE_INOTIFY 0
+#endif
+
+#include <algorithm>
+
+#include "AppConfig.h"
+#include "MSQ_Watch.h"
+
+
+static volatile sig_atomic_t watch_interrupted = 0;
+
+static void watch_on_sigint(int)
+{
+    watch_interrupted = 1;
+}
+
+
+static juce::int64 watch_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (juce::int64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static juce::int64 watch_file_size(const juce::String& path)
+{
+    struct stat st;
+
+    return (stat(path.toRawUTF8(), &st) == 0) ? (juce::int64) st.st_size : -1;
+}
+
+
+MSQ_Watch::MSQ_Watch(int workers_wanted, msq_watch_fn convert, void* user)
+{
+    convert_fn = convert;
+    convert_user = user;
+    num_workers = juce::jlimit (1, MSQ_WATCH_MAX_WORKERS, workers_wanted);
+    stopping = FALSE;
+
+#if MSQ_HAVE_INOTIFY
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    notify_fd = -1;
+#endif
+}
+
+
+MSQ_Watch::~MSQ_Watch()
+{
+    stop();
+
+    if (notify_fd >= 0)
+        close(notify_fd);
+}
+
+
+bool MSQ_Watch::add_dir(const juce::File& dir)
+{
+#if MSQ_HAVE_INOTIFY
+    if ( (notify_fd < 0) || !dir.isDirectory() ) return FALSE;
+
+    // closed after writing, or moved in complete, as most exporters do
+    const int wd = inotify_add_watch(notify_fd, dir.getFullPathName().toRawUTF8(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+    if (wd < 0) return FALSE;
+
+    watch_dirs[wd] = dir.getFullPathName();
+    return TRUE;
+#else
+    (void) dir;
+    return FALSE;
+#endif
+}
+
+
+void MSQ_Watch::ignore_write(const juce::String& path)
+{
+    std::lock_guard<std::mutex> lock (queue_lock);
+
+    own_writes[path] = watch_now_ms() + MSQ_WATCH_OWN_MS;
+}
+
+
+// called with queue_lock held
+bool MSQ_Watch::is_own_write(const juce::String& path, juce::int64 now_ms)
+{
+    std::map<juce::String, juce::int64>::iterator own = own_writes.find(path);
+
+    if (own == own_writes.end()) return FALSE;
+
+    const bool ours = (own->second >= now_ms);
+    if (!ours)
+        own_writes.erase(own);
+
+    return (ours);
+}
+
+
+void MSQ_Watch::read_events()
+{
+#if MSQ_HAVE_INOTIFY
+    // aligned for struct inotify_event
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const juce::int64 now_ms = watch_now_ms();
+
+    for (;;)
+    {
+        const ssize_t len = read(notify_fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (char* p = buf; p < buf + len; )
+        {
+            const struct inotify_event* ev = (const struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if ( !ev->len || (ev->mask & IN_ISDIR) ) continue;
+
+            const juce::String name (ev->name);
+            if ( !name.endsWithIgnoreCase(".mid") && !name.endsWithIgnoreCase(".syx") ) continue;
+
+            std::map<int, juce::String>::iterator dir = watch_dirs.find(ev->wd);
+            if (dir == watch_dirs.end()) continue;
+
+            const juce::String path (dir->second + "/" + name);
+
+            if (ev->mask & IN_MODIFY)
+            {
+                // still being written, wait for the close
+                std::map<juce::String, pending_file>::iterator pend = pending.find(path);
+                if (pend != pending.end())
+                    pend->second.due_ms = now_ms + MSQ_WATCH_SETTLE_MS;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock (queue_lock);
+
+                if ( is_own_write(path, now_ms) )
+                {
+                    own_writes.erase(path);
+                    continue;
+                }
+            }
+
+            pending_file pend;
+            pend.due_ms = now_ms + MSQ_WATCH_SETTLE_MS;
+            pend.size = watch_file_size(path);
+            pending[path] = pend;
+        }
+    }
+#endif
+}
+
+
+// files quiet since their close go to the workers
+void MSQ_Watch::queue_settled(juce::int64 now_ms)
+{
+    std::map<juce::String, pending_file>::iterator pend = pending.begin();
+
+    while (pend != pending.end())
+    {
+        if (pend->second.due_ms > now_ms)
+        {
+            ++pend;
+            continue;
+        }
+
+        // written to again without a new close, give it more time
+        const juce::int64 size = watch_file_size(pend->first);
+        if (size != pend->second.size)
+        {
+            pend->second.size = size;
+            pend->second.due_ms = now_ms + MSQ_WATCH_SETTLE_MS;
+            ++pend;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (queue_lock);
+
+            // one worker per file, a drop while converting waits its turn
+            if ( std::find(busy.begin(), busy.end(), pend->first) != busy.end() )
+            {
+                pend->second.due_ms = now_ms + MSQ_WATCH_SETTLE_MS;
+                ++pend;
+                continue;
+            }
+
+            if ( (size >= 0) && (std::find(queue.begin(), queue.end(), pend->first) == queue.end()) )
+                queue.push_back(pend->first);
+        }
+        queue_ready.notify_one();
+
+        pending.erase(pend++);
+    }
+}
+
+
+// poll timeout, until the next pending file is due
+int MSQ_Watch::next_due_ms(juce::int64 now_ms)
+{
+    juce::int64 wait_ms = 500;
+
+    for (std::map<juce::String, pending_file>::iterator pend = pending.begin(); pend != pending.end(); ++pend)
+        wait_ms = juce::jmin (wait_ms, juce::jmax ((juce::int64) 0, pend->second.due_ms - now_ms));
+
+    return (int) wait_ms;
+}
+
+
+void MSQ_Watch::run()
+{
+    if (notify_fd < 0) return;
+
+    watch_interrupted = 0;
+    void (*prev_handler)(int) = signal(SIGINT, watch_on_sigint);
+
+    stopping = FALSE;
+    for (int w = 0; w < num_workers; w++)
+        workers.push_back(std::thread(&MSQ_Watch::worker, this));
+
+    while ( !watch_interrupted )
+    {
+        {
+            std::lock_guard<std::mutex> lock (queue_lock);
+            if (stopping) break;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = notify_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        const int ready = poll(&pfd, 1, next_due_ms(watch_now_ms()));
+        if ( (ready < 0) && (errno != EINTR) ) break;
+
+        if ( (ready > 0) && (pfd.revents & POLLIN) )
+            read_events();
+
+        queue_settled(watch_now_ms());
+    }
+
+    stop();
+    signal(SIGINT, prev_handler);
+}
+
+
+void MSQ_Watch::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock (queue_lock);
+        stopping = TRUE;
+    }
+    queue_ready.notify_all();
+
+    // files queued are still converted
+    for (size_t w = 0; w < workers.size(); w++)
+        workers[w].join();
+    workers.clear();
+}
+
+
+void MSQ_Watch::worker()
+{
+    // warm from one file to the next
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+    msq_conv_init(ctx);
+
+    for (;;)
+    {
+        juce::String path;
+        {
+            std::unique_lock<std::mutex> lock (queue_lock);
+            while ( queue.empty() && !stopping )
+                queue_ready.wait(lock);
+
+            if (queue.empty()) break;
+
+            path = queue.front();
+            queue.pop_front();
+            busy.push_back(path);
+        }
+
+        convert_fn(*this, path, *ctx, convert_user);
+
+        {
+            std::lock_guard<std::mutex> lock (queue_lock);
+            busy.erase(std::find(busy.begin(), busy.end(), path));
+        }
+    }
+
+    delete ctx;
+}
@@ -0,0 +1,88 @@
+//
+//  MSQ_Watch.h
+//  msq_convert
+//
+//  Watch folder: converts .mid and .syx files as they are dropped into
+//  one or more directories.  inotify reports each file closed after
+//  writing or moved in, and once it has settled (no more writes, size
+//  unchanged) a pool of workers converts it, each worker keeping its
+//  msq_conv_ctx from file to file.  Linux only.
+//
+
+#ifndef __msq_convert__MSQ_Watch__
+#define __msq_convert__MSQ_Watch__
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "MSQ_100.h"
+
+
+#define MSQ_WATCH_SETTLE_MS     20      // quiet time before a file counts as written
+#define MSQ_WATCH_OWN_MS        2000    // how long an output's own events are ignored
+#define MSQ_WATCH_MAX_WORKERS   16
+
+
+class MSQ_Watch;
+
+//  Converts the file at path, called on a worker thread with that
+//  worker's context.  Outputs it writes should be announced with
+//  ignore_write() first, or they come back as new files.
+//
+typedef void (*msq_watch_fn)(MSQ_Watch& watch, const juce::String& path, msq_conv_ctx& ctx, void* user);
+
+
+class MSQ_Watch
+{
+public:
+    MSQ_Watch(int num_workers, msq_watch_fn convert, void* user);
+
+    ~MSQ_Watch();
+
+    // FALSE if the directory can't be watched, or no inotify here
+    bool add_dir(const juce::File& dir);
+
+    // an output about to be written, its close isn't a new file
+    void ignore_write(const juce::String& path);
+
+    // until stop(), or SIGINT
+    void run();
+    void stop();
+
+private:
+    msq_watch_fn convert_fn;
+    void* convert_user;
+    int num_workers;
+
+    int notify_fd;
+    std::map<int, juce::String> watch_dirs;      // by watch descriptor
+
+    // files seen, waiting to settle
+    struct pending_file
+    {
+        juce::int64 due_ms;
+        juce::int64 size;
+    };
+    std::map<juce::String, pending_file> pending;
+
+    std::mutex queue_lock;
+    std::condition_variable queue_ready;
+    std::deque<juce::String> queue;
+    std::map<juce::String, juce::int64> own_writes;   // path, until when
+    std::vector<juce::String> busy;                   // being converted
+    bool stopping;
+
+    std::vector<std::thread> workers;
+
+    void read_events();
+    void queue_settled(juce::int64 now_ms);
+    int next_due_ms(juce::int64 now_ms);
+    bool is_own_write(const juce::String& path, juce::int64 now_ms);
+    void worker();
+};
+
+#endif /* defined(__msq_convert__MSQ_Watch__) */
@@ -10,29 +10,1614 @@
   ==============================================================================
 */
 //#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 using namespace std;
 
 #include "../JuceLibraryCode/JuceHeader.h"
 //#include "juce_MidiFile.h"
 #include "MSQ_100.h"
+#include "MSQ_Catalog.h"
+#include "MSQ_Analyze.h"
+#include "MSQ_Watch.h"
+#include "MSQ_Shm.h"
+#include "MSQ_Pack.h"
+#include "MSQ_FileIO.h"
+#include "MSQ_Codec.h"
+#include "MSQ_Transcode.h"
 
 
+#define BATCH_NUM_FILES  64   // files read, converted and written together
+
+
+
+//==============================================================================
+// Converts the chosen track of Standard MIDI File data to MSQ-100 SysEx
+// returns FALSE if there were no tracks to convert
+static bool convert_smf(MSQ_100_SysEx& msq_sysex, const void* std_midi_data, size_t std_midi_size,
+                        int src_track, unsigned long filter_options)
+{
+    msq_sysex.read_smf_track(std_midi_data, std_midi_size, src_track);
+    
+    if (!msq_sysex.getNumTracks())
+        return FALSE;
+    
+    // future options: merge tracks
+    src_track = msq_sysex.prepare_smf_track(src_track);
+    
+    msq_sysex.smf_to_msq_syx(src_track, filter_options);
+    
+    return TRUE;
+}
+
+
+//  -t all, or a list such as 2,5,7: every track given goes to its own
+//  dump.  src_tracks is left empty for all.  Returns FALSE for a
+//  single track number, which src_track takes as before
+//
+static bool parse_track_list(const char* k, std::vector<int>& src_tracks)
+{
+    const String list (k);
+    
+    src_tracks.clear();
+    
+    if (list.equalsIgnoreCase("all"))
+        return TRUE;
+    
+    if (!list.containsChar(','))
+        return FALSE;
+    
+    StringArray trks;
+    trks.addTokens(list, ",", "");
+    
+    for (int i = 0; i < trks.size(); i++)
+    {
+        if (trks[i].trim().isNotEmpty())
+            src_tracks.push_back(trks[i].trim().getIntValue());
+    }
+    
+    return TRUE;
+}
+
+
+// letters of the -f option, channel digits go to filt_chan
+// returns FALSE on a letter that isn't a filter
+static bool parse_filters(const char* k, unsigned long& filter_options, unsigned int& filt_chan)
+{
+    while (*k != '\0')
+    {
+        switch (*k)
+        {
+            case 'p':
+            case 'P':
+                filter_options |= FILTER_OPT_PRGCHNG;
+                break;
+            
+            case 'a':
+            case 'A':
+                filter_options |= FILTER_OPT_AFTRTCH;
+                break;
+            
+            case 'b':
+            case 'B':
+                filter_options |= FILTER_OPT_PTCHBND;
+                break;
+            
+            case 'l':
+            case 'L':
+                filter_options |= FILTER_OPT_CCNTRLS;
+                break;
+            
+            case 'c':
+            case 'C':
+                filter_options |= FILTER_OPT_CHNMUTE;
+                break;
+            
+            case 'x':
+            case 'X':
+                filter_options |= FILTER_OPT_CHNSOLO;
+                break;
+            
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+                filt_chan = 10 * filt_chan + (*k - '0');
+                break;
+            
+            default:
+                return FALSE;
+        }
+        ++k;
+    }
+    
+    return TRUE;
+}
+
+
+// -q option, 96 to 960 PPQN in steps of 24
+static short valid_timebase(int n_timebase)
+{
+    if (n_timebase < 96)
+        n_timebase = 96;
+    else if(n_timebase > 960)
+        n_timebase = 960;
+    else if (n_timebase % 24)
+        n_timebase = 24 * (n_timebase / 24);
+    
+    return (short) n_timebase;
+}
+
+
+// the conversion options commands share, -t -q -f -o
+typedef struct
+{
+    int src_track;
+    short n_timebase;
+    unsigned long filter_options;
+    unsigned int filt_chan;      // -f digits, see finish_conv_options
+} conv_options;
+
+
+static void init_conv_options(conv_options& opts)
+{
+    opts.src_track = 1;
+    opts.n_timebase = 120;
+    opts.filter_options = FILTER_OPT_CLEAR;
+    opts.filt_chan = 0;
+}
+
+
+//  Option letter c, if it's one of those in allowed, with k the argument
+//  after it or 0.  Returns the arguments used, 1 for a flag and 2 when
+//  k was its value, 0 for a letter that isn't shared, -1 on a bad value
+//
+static int parse_conv_option(char c, const char* k, const char* allowed, conv_options& opts)
+{
+    if ( !std::strchr(allowed, c) ) return 0;
+    
+    switch (c)
+    {
+        case 't':
+            if (!k) return -1;
+            opts.src_track = std::atoi(k);
+            return 2;
+            
+        case 'q':
+            if (!k) return -1;
+            opts.n_timebase = valid_timebase(std::atoi(k));
+            return 2;
+            
+        case 'f':
+            if ( !k || !parse_filters(k, opts.filter_options, opts.filt_chan) ) return -1;
+            return 2;
+            
+        case 'o':
+            opts.filter_options |= ENCODE_OPT_OPTIMIZE;
+            return 1;
+    }
+    
+    return 0;
+}
+
+
+// the -f channel into the filter options, once all are parsed
+static void finish_conv_options(conv_options& opts)
+{
+    if ( opts.filter_options & (FILTER_OPT_CHNMUTE | FILTER_OPT_CHNSOLO) )
+        opts.filter_options |= (FILTER_CHAN_MASK & (unsigned)opts.filt_chan);
+}
+
+
+// letters as given to the -f option
+static String filter_letters(unsigned long filter_options)
+{
+    String letters;
+    
+    if (filter_options & FILTER_OPT_PRGCHNG) letters += "p";
+    if (filter_options & FILTER_OPT_CCNTRLS) letters += "l";
+    if (filter_options & FILTER_OPT_AFTRTCH) letters += "a";
+    if (filter_options & FILTER_OPT_PTCHBND) letters += "b";
+    if (filter_options & FILTER_OPT_CHNMUTE) letters += "c";
+    if (filter_options & FILTER_OPT_CHNSOLO) letters += "x";
+    if (filter_options & (FILTER_OPT_CHNMUTE | FILTER_OPT_CHNSOLO))
+        letters += String ((int)(filter_options & FILTER_CHAN_MASK));
+    
+    if (letters.isEmpty()) letters = "-";
+    
+    return letters;
+}
+
+
+//  Converts the SMF once per filter set, plain and optimized,
+//  and lists the upload time of each result
+//
+static void compare_transfer_times(const File& std_midi_file, int src_track,
+                                   unsigned long filter_options, double blk_delay_ms)
+{
+    const unsigned long filter_sets[] =
+    {
+        0,
+        FILTER_OPT_PRGCHNG,
+        FILTER_OPT_PRGCHNG | FILTER_OPT_CCNTRLS,
+        FILTER_OPT_PRGCHNG | FILTER_OPT_CCNTRLS | FILTER_OPT_AFTRTCH,
+        FILTER_OPT_PRGCHNG | FILTER_OPT_CCNTRLS | FILTER_OPT_AFTRTCH | FILTER_OPT_PTCHBND
+    };
+    
+    MemoryMappedFile std_midi_map (std_midi_file, MemoryMappedFile::readOnly);
+    
+    std::cout << "\n  filters     opt  blocks   bytes   time (ms)\n";
+    
+    for (int f = 0; f < (int)(sizeof(filter_sets) / sizeof(filter_sets[0])); f++)
+    {
+        for (int opt = 0; opt < 2; opt++)
+        {
+            unsigned long filters = (filter_options & ~ENCODE_OPT_OPTIMIZE) | filter_sets[f];
+            if (opt) filters |= ENCODE_OPT_OPTIMIZE;
+            
+            ScopedPointer <MSQ_100_SysEx> msq_sysex (new MSQ_100_SysEx());
+            
+            if ( !convert_smf(*msq_sysex, std_midi_map.getData(), std_midi_map.getSize(), src_track, filters) )
+                return;
+            
+            char line[80];
+            snprintf(line, sizeof(line), "  %-10s  %-3s  %6d  %6d  %10.1f\n",
+                     filter_letters(filters).toRawUTF8(), opt ? "o" : "-",
+                     msq_sysex->get_num_syx_blks(), msq_sysex->get_SysEx_size(),
+                     msq_sysex->get_transfer_time(blk_delay_ms));
+            std::cout << line;
+        }
+    }
+    std::cout << std::endl;
+}
+
+
+//  The MSQ-100 doesn't keep tempo, the source's tempo map goes into
+//  a .tempo file next to the dump and comes back from there
+//
+static File tempo_file_for(const String& sysex_path)
+{
+    return File(sysex_path).withFileExtension(".tempo");
+}
+
+
+//  Saves the tempo map for the dump at sysex_path.  Without tempo
+//  changes, one a conversion before left there is removed, or it would
+//  come back with this dump.  TRUE if a map was saved
+//
+static bool save_tempo_file(const MSQ_TempoMap& tempo_map, const String& sysex_path)
+{
+    const File tempo_file (tempo_file_for(sysex_path));
+    
+    if (tempo_map.get_num_tempos() > 0)
+        return tempo_map.save(tempo_file.getFullPathName().toRawUTF8());
+    
+    tempo_file.deleteFile();
+    return FALSE;
+}
+
+
+// where the converted file of src goes, name_msq.syx or name_qsm.mid
+static File dest_file_for(const File& src, bool forward)
+{
+    return src.getParentDirectory().getChildFile(src.getFileNameWithoutExtension() + (forward ? "_msq" : "_qsm"))
+           .withFileExtension(forward ? ".syx" : ".mid");
+}
+
+
+//  Writes name_tN_msq.syx for each track of src_tracks, all of them
+//  if it's empty, parsing the SMF once and encoding the tracks in
+//  parallel
+//
+static void convert_smf_tracks(const void* std_midi_data, size_t std_midi_size, const File& dest_dir,
+                               const String& dest_name, const std::vector<int>& src_tracks,
+                               unsigned long filter_options)
+{
+    std::vector<msq_track_dump> dumps;
+    
+    const int num_converted = msq_convert_smf_tracks(std_midi_data, std_midi_size, src_tracks,
+                                                     (uint32_t) filter_options, 0, dumps);
+    if (num_converted < 0)
+    {
+        std::cout << "No Std. MIDI File data to convert" << std::endl;
+        return;
+    }
+    
+    for (size_t i = 0; i < dumps.size(); i++)
+    {
+        const msq_track_dump& dump = dumps[i];
+        
+        if (!dump.converted)
+        {
+            std::cout << "Track " << dump.src_track << " not found, skipped" << std::endl;
+            continue;
+        }
+        
+        const File sysex_file (dest_dir.getChildFile(dest_name + "_t" + String (dump.src_track) + "_msq")
+                               .withFileExtension(".syx"));
+        sysex_file.deleteFile();
+        
+        ScopedPointer <FileOutputStream> sysex_stream (sysex_file.createOutputStream());
+        if ( (sysex_stream == 0) || !sysex_stream->write(dump.syx.getData(), dump.syx.getSize()) )
+        {
+            std::cout << "Couldn't write " << sysex_file.getFileName() << std::endl;
+            continue;
+        }
+        
+        std::cout << "Track " << dump.src_track << " written to " << sysex_file.getFileName()
+        << " (" << (int) dump.syx.getSize() << " bytes)" << std::endl;
+        
+        save_tempo_file(dump.tempo_map, sysex_file.getFullPathName());
+    }
+    
+    std::cout << num_converted << " tracks converted to MSQ-100 SysEx\n";
+}
+
+
+//  Direction for the format of data, by its first bytes rather than
+//  the extension.  Unknown data keeps ext_direction, data recognized
+//  but without a converter gets -1.  With -s a dump may start at any
+//  of its blocks, block 0 being lost.
+//
+static int sniff_direction(const String& name, const void* data, size_t size, int ext_direction,
+                           unsigned long filter_options)
+{
+    const msq_codec* codec = msq_sniff((const uint8_t*) data, (int) juce::jmin (size, (size_t) MSQ_SNIFF_SIZE));
+    
+    if ( (filter_options & DECODE_OPT_SALVAGE) && msq_sniff_q1_frame((const uint8_t*) data, (int) size) )
+        codec = msq_get_codec(MSQ_FMT_Q1_SYSEX);
+    
+    if (codec == 0)
+        return (ext_direction);
+    
+    if (codec->direction == MSQ_CODEC_NONE)
+        std::cout << name << " is " << codec->name << ", no converter for it" << std::endl;
+    else if (codec->direction != ext_direction)
+        std::cout << name << " is " << codec->name << ", converting it as such" << std::endl;
+    
+    return (codec->direction);
+}
+
+
+static int sniff_file_direction(const File& src, int ext_direction, unsigned long filter_options)
+{
+    uint8_t head[MSQ_SNIFF_SIZE];
+    
+    ScopedPointer <FileInputStream> src_stream (src.createInputStream());
+    if (src_stream == 0)
+        return (ext_direction);
+    
+    const int head_size = src_stream->read(head, MSQ_SNIFF_SIZE);
+    if (head_size <= 0)
+        return (ext_direction);
+    
+    return sniff_direction(src.getFileName(), head, head_size, ext_direction, filter_options);
+}
+
+
+// what -s couldn't save of a dump
+static void print_salvage_report(const String& name, const q1_salvage_report& report)
+{
+    if ( !report.num_damaged && !report.num_lost && !report.bytes_skipped && !report.end_lost )
+    {
+        std::cout << name << ": no damage, " << report.num_blks << " blocks" << std::endl;
+        return;
+    }
+    
+    std::cout << name << ": " << report.num_blks << " blocks kept, "
+    << report.num_damaged << " damaged frames, " << report.num_lost << " blocks lost";
+    
+    // runs of lost message numbers
+    for (int m = 0; m < Q1_MAX_SYX_BLKS; m++)
+    {
+        if (!report.lost[m]) continue;
+        
+        int last = m;
+        while ( (last + 1 < Q1_MAX_SYX_BLKS) && report.lost[last + 1] )
+            last++;
+        
+        std::cout << " #" << m;
+        if (last > m)
+            std::cout << "-" << last;
+        m = last;
+    }
+    std::cout << std::endl;
+    
+    if (report.fcb_lost)
+        std::cout << "  FCB lost, the default one stands in" << std::endl;
+    if (report.end_lost)
+        std::cout << "  no track end, blocks after #" << (report.num_blks + report.num_lost - 1) << " may be lost" << std::endl;
+    if (report.num_resyncs || report.q1_dropped)
+        std::cout << "  rejoined " << report.num_resyncs << " times, " << report.q1_dropped << " Q1 bytes of "
+        << report.bars_dropped << " bars dropped to stay on bar lines" << std::endl;
+    if (report.bytes_skipped)
+        std::cout << "  " << report.bytes_skipped << " bytes outside of any frame" << std::endl;
+}
+
+
+// converts one file held in memory, forward for .mid, else reverse
+static bool convert_buffer(msq_conv_ctx& ctx, const msq_io_file& src_file, msq_io_file& dst_file, bool forward,
+                           int src_track, short n_timebase, unsigned long filter_options)
+{
+    MSQ_TempoMap tempo_map;
+    bool converted;
+    
+    // the source's tempo, if saved next to the dump
+    if (!forward)
+        tempo_map.load(tempo_file_for(src_file.path).getFullPathName().toRawUTF8());
+    
+    {
+        // straight into the block the write is submitted from
+        MemoryOutputStream dst_stream (dst_file.data, FALSE);
+        
+        if (forward)
+            converted = msq_convert_smf(ctx, src_file.data.getData(), src_file.size, src_track,
+                                        filter_options, &tempo_map, dst_stream);
+        else
+            converted = msq_convert_syx(ctx, src_file.data.getData(), src_file.size, n_timebase, filter_options,
+                                        (tempo_map.get_num_tempos() > 0) ? &tempo_map : 0, dst_stream);
+    }
+    dst_file.size = dst_file.data.getSize();
+    
+    if (forward && converted)
+        save_tempo_file(tempo_map, dst_file.path);
+    
+    return (converted);
+}
+
+
+//  Converts several source files with the same options.  While one batch
+//  converts, the next one is being read and the last one written
+//
+static void run_batch(const StringArray& src_names, int src_track, short n_timebase,
+                      unsigned long filter_options, bool try_uring)
+{
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    const int num_files = src_names.size();
+    int num_converted = 0;
+    
+    MSQ_File_IO file_io (try_uring);
+    msq_io_file* src_files = new msq_io_file[num_files];
+    msq_io_file* dst_files = new msq_io_file[num_files];
+    bool* forward = new bool[num_files];
+    msq_conv_ctx* ctx = new msq_conv_ctx;   // one for all files
+    
+    for (int f = 0; f < num_files; f++)
+    {
+        String name (src_names[f].unquoted().trim());
+        forward[f] = TRUE;
+        
+        if ( name.endsWithIgnoreCase(".mid") )
+            name = name.dropLastCharacters(4);
+        else if ( name.endsWithIgnoreCase(".syx") )
+        {
+            name = name.dropLastCharacters(4);
+            forward[f] = FALSE;
+        }
+        else if ( !workDirectory.getChildFile(name).withFileExtension(".mid").exists()
+                 && workDirectory.getChildFile(name).withFileExtension(".syx").exists() )
+            forward[f] = FALSE;
+        
+        const File src (workDirectory.getChildFile(name).withFileExtension(forward[f] ? ".mid" : ".syx"));
+        src_files[f].path = src.getFullPathName();
+        dst_files[f].path = dest_file_for(src, forward[f]).getFullPathName();
+        dst_files[f].size = 0;
+    }
+    
+    std::cout << "Converting " << num_files << " files, "
+    << (file_io.is_uring() ? "io_uring" : "POSIX") << " I/O" << std::endl;
+    
+    file_io.submit_reads(src_files, juce::jmin (num_files, BATCH_NUM_FILES));
+    
+    for (int b = 0; b < num_files; b += BATCH_NUM_FILES)
+    {
+        const int batch_size = juce::jmin (num_files - b, BATCH_NUM_FILES);
+        
+        file_io.wait_reads();
+        if (b + batch_size < num_files)
+            file_io.submit_reads(&src_files[b + batch_size], juce::jmin (num_files - b - batch_size, BATCH_NUM_FILES));
+        
+        for (int f = b; f < b + batch_size; f++)
+        {
+            // the data decides, the extension only guessed
+            const File src (src_files[f].path);
+            int direction = forward[f] ? MSQ_CODEC_TO_Q1 : MSQ_CODEC_TO_SMF;
+            if (src_files[f].result >= 0)
+                direction = sniff_direction(src.getFileName(), src_files[f].data.getData(), src_files[f].size, direction,
+                                            filter_options);
+            
+            if (src_files[f].result < 0)
+            {
+                std::cout << "Couldn't open " << src_files[f].path << " for reading" << std::endl;
+                dst_files[f].path = String();
+            }
+            else if (direction == MSQ_CODEC_NONE)
+            {
+                dst_files[f].path = String();
+            }
+            else
+            {
+                if ( (direction == MSQ_CODEC_TO_Q1) != forward[f] )
+                {
+                    forward[f] = !forward[f];
+                    dst_files[f].path = dest_file_for(src, forward[f]).getFullPathName();
+                }
+                
+                if ( !convert_buffer(*ctx, src_files[f], dst_files[f], forward[f], src_track, n_timebase, filter_options) )
+                {
+                    std::cout << "Couldn't convert " << src_files[f].path << std::endl;
+                    dst_files[f].path = String();
+                }
+                else if ( !forward[f] && (filter_options & DECODE_OPT_SALVAGE) )
+                    print_salvage_report(src.getFileName(), ctx->salvage);
+            }
+            src_files[f].data.setSize(0);
+        }
+        
+        // previous batch done, let go of its data
+        file_io.wait_writes();
+        for (int f = b - BATCH_NUM_FILES; f >= 0 && f < b; f++)
+            dst_files[f].data.setSize(0);
+        
+        file_io.submit_writes(&dst_files[b], batch_size);
+    }
+    file_io.wait_writes();
+    
+    for (int f = 0; f < num_files; f++)
+    {
+        if ( dst_files[f].path.isEmpty() ) continue;
+        
+        if (dst_files[f].result < 0)
+            std::cout << "Couldn't write " << dst_files[f].path << std::endl;
+        else
+            num_converted++;
+    }
+    std::cout << num_converted << " of " << num_files << " files converted" << std::endl << std::endl;
+    
+    delete ctx;
+    delete[] forward;
+    delete[] dst_files;
+    delete[] src_files;
+}
+
+
+//  msqconvert index archive_dir catalog_file
+//  msqconvert query catalog_file [terms]
+//  msqconvert dups catalog_file [min_similarity]
+//
+static int run_catalog(int argc, char* argv[])
+{
+    MSQ_Catalog catalog;
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    const String command (argv[1]);
+    
+    if ( (command == "index") && (argc == 4) )
+    {
+        const int num_indexed = catalog.build_index(workDirectory.getChildFile(argv[2]),
+                                                    workDirectory.getChildFile(argv[3]));
+        if (num_indexed < 0)
+            std::cout << "Couldn't write " << argv[3] << std::endl << std::endl;
+        else
+            std::cout << num_indexed << " dumps indexed in " << argv[3] << std::endl;
+        
+        return 0;
+    }
+    
+    if ( (command == "query") && (argc >= 3) )
+    {
+        StringArray terms;
+        for (int ai = 3; ai < argc; ai++)
+            terms.add(String (argv[ai]));
+        
+        if ( !catalog.open_index(workDirectory.getChildFile(argv[2])) )
+        {
+            std::cout << "Couldn't read catalog " << argv[2] << std::endl << std::endl;
+            return 0;
+        }
+        if ( !catalog.is_valid_query(terms) )
+        {
+            std::cout << "Query terms are key=value, key<value or key>value\n"
+            "  keys: sig chan blocks bars size syx notes,\n"
+            "  sig and chan take = only\n\n";
+            return 0;
+        }
+        
+        int num_match = 0;
+        for (int e = 0; e < catalog.get_num_entries(); e++)
+        {
+            const msq_catalog_entry* entry = catalog.get_entry(e);
+            if ( !catalog.matches_query(entry, terms) ) continue;
+            
+            std::cout << catalog.get_name(e) << "  " << entry->num_blks << " blocks, "
+            << entry->num_bars << " bars, sig";
+            for (int n = 0; n < juce::jmin ((int) entry->num_sigs, MSQ_CATALOG_MAX_SIGS); n++)
+                std::cout << " " << (int) entry->sigs[n] << "/4";
+            std::cout << std::endl;
+            num_match++;
+        }
+        std::cout << num_match << " of " << catalog.get_num_entries() << " dumps match" << std::endl;
+        
+        return 0;
+    }
+    
+    if ( (command == "dups") && (argc >= 3) && (argc <= 4) )
+    {
+        // percent of note shingles in common
+        const int min_similarity = (argc == 4) ? juce::jlimit (1, 100, std::atoi(argv[3])) : 75;
+        std::vector<int> group_of;
+        std::vector<std::pair<int, int> > members;
+        
+        if ( !catalog.open_index(workDirectory.getChildFile(argv[2])) )
+        {
+            std::cout << "Couldn't read catalog " << argv[2] << std::endl << std::endl;
+            return 0;
+        }
+        
+        catalog.find_duplicates(min_similarity, group_of);
+        
+        for (int e = 0; e < catalog.get_num_entries(); e++)
+            members.push_back(std::make_pair(group_of[e], e));
+        std::sort(members.begin(), members.end());
+        
+        int num_groups = 0, num_copies = 0;
+        for (size_t m = 0; m < members.size(); )
+        {
+            size_t m_end = m + 1;
+            while ( (m_end < members.size()) && (members[m_end].first == members[m].first) )
+                m_end++;
+            
+            if (m_end - m > 1)
+            {
+                // the first one found stands for the group
+                const msq_fingerprint& first = catalog.get_entry(members[m].first)->fingerprint;
+                
+                std::cout << catalog.get_name(members[m].first) << std::endl;
+                for (size_t d = m + 1; d < m_end; d++)
+                {
+                    const msq_fingerprint& fp = catalog.get_entry(members[d].second)->fingerprint;
+                    
+                    if (fp.exact == first.exact)
+                        std::cout << "   =   ";
+                    else
+                        std::cout << "  " << String (MSQ_Fingerprint::similarity(first, fp)).paddedLeft(' ', 3) << "%  ";
+                    std::cout << catalog.get_name(members[d].second) << std::endl;
+                    num_copies++;
+                }
+                num_groups++;
+            }
+            m = m_end;
+        }
+        std::cout << num_copies << " copies of " << num_groups << " sequences in "
+        << catalog.get_num_entries() << " dumps" << std::endl;
+        
+        return 0;
+    }
+    
+    std::cout << "Usage: msqconvert index archive_dir catalog_file\n"
+    "       msqconvert query catalog_file [sig=7] [chan=10] [blocks>100] ...\n"
+    "       msqconvert dups catalog_file [min_similarity %]\n\n";
+    
+    return 0;
+}
+
+
+//  msqconvert analyze path ... [-t track] [-f filters] [-o] [-n threads] [-j]
+//
+static int run_analyze(int argc, char* argv[])
+{
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    conv_options opts;
+    int num_threads = 0;
+    bool as_json = FALSE;
+    bool cmd_error = FALSE;
+    StringArray paths;
+    
+    init_conv_options(opts);
+    
+    for (int ai = 2; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            paths.add(String (argv[ai]).trim());
+            continue;
+        }
+        
+        const int used = parse_conv_option(argv[ai][1], k, "tfo", opts);
+        if (used)
+        {
+            cmd_error = (used < 0);
+            ai += used - 1;
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'n':
+                if (k) num_threads = std::atoi(k);
+                ai++;
+                break;
+                
+            case 'j':
+                as_json = TRUE;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( cmd_error || (paths.size() == 0) )
+    {
+        std::cout << "Usage: msqconvert analyze path ... [-t track] [-f filters] [-o] [-n threads] [-j]\n\n"
+        "  Reports for every .mid and .syx file, directories included,\n"
+        "  the blocks, Q1 bytes and bars it converts to, the longest\n"
+        "  bar, events left out by the filters and channels used.\n"
+        "  Nothing is written, -j prints JSON instead of a table\n\n";
+        return 0;
+    }
+    
+    finish_conv_options(opts);
+    
+    MSQ_Analyze analyze (opts.src_track, (uint32_t) opts.filter_options);
+    
+    for (int p = 0; p < paths.size(); p++)
+        analyze.add_path(workDirectory.getChildFile(paths[p]));
+    
+    analyze.run(num_threads);
+    
+    if (as_json)
+        analyze.print_json(std::cout);
+    else
+        analyze.print_table(std::cout);
+    
+    return 0;
+}
+
+
+// a stage's time, and its counters per event and per Q1 byte
+static void print_bench_stage(const char* stage, const msq_perf_sample& sample, const MSQ_PerfCount& perf,
+                              int runs, int num_events, int num_bytes)
+{
+    char line[160];
+    const double ns_run = (double) sample.ns / runs;
+    
+    snprintf(line, sizeof(line), "  %-10s %9.1f %8.1f %8.1f", stage, ns_run / 1000.0,
+             ns_run / juce::jmax (num_events, 1), ns_run / juce::jmax (num_bytes, 1));
+    std::cout << line;
+    
+    if (!perf.get_num_counters())
+    {
+        std::cout << std::endl;
+        return;
+    }
+    
+    char ipc[16] = "-";
+    if ( perf.has_counter(MSQ_PERF_CYCLES) && perf.has_counter(MSQ_PERF_INSTRUCTIONS)
+        && sample.count[MSQ_PERF_CYCLES] )
+        snprintf(ipc, sizeof(ipc), "%.2f", (double) sample.count[MSQ_PERF_INSTRUCTIONS] / sample.count[MSQ_PERF_CYCLES]);
+    
+    for (int u = 0; u < 2; u++)
+    {
+        const double per = (double) runs * juce::jmax (u ? num_bytes : num_events, 1);
+        
+        if (u)
+            snprintf(line, sizeof(line), "\n  %-10s %9s %8s %8s %5s  /B ", "", "", "", "", "");
+        else
+            snprintf(line, sizeof(line), " %5s  /ev", ipc);
+        std::cout << line;
+        
+        for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+        {
+            if (perf.has_counter(c))
+                snprintf(line, sizeof(line), "  %13.2f", sample.count[c] / per);
+            else
+                snprintf(line, sizeof(line), "  %13s", "-");
+            std::cout << line;
+        }
+    }
+    std::cout << std::endl;
+}
+
+
+//  msqconvert bench file ... [-t track] [-f filters] [-o] [-q PPQN] [-r runs]
+//
+static int run_bench(int argc, char* argv[])
+{
+    static const char* stage_names[MSQ_NUM_STAGES] =
+    {
+        "read", "filter", "flatten", "encode", "frame", "write", "decode", "transcode"
+    };
+    
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    conv_options opts;
+    int runs = 20;
+    bool cmd_error = FALSE;
+    StringArray paths;
+    
+    init_conv_options(opts);
+    
+    for (int ai = 2; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            paths.add(String (argv[ai]).trim());
+            continue;
+        }
+        
+        const int used = parse_conv_option(argv[ai][1], k, "tfoq", opts);
+        if (used)
+        {
+            cmd_error = (used < 0);
+            ai += used - 1;
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'r':
+                if (k) runs = std::atoi(k);
+                ai++;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( cmd_error || (paths.size() == 0) || (runs < 1) )
+    {
+        std::cout << "Usage: msqconvert bench file ... [-t track] [-f filters] [-o] [-q PPQN] [-r runs]\n\n"
+        "  Converts each .mid or .syx file runs times in memory, 20 by\n"
+        "  default, and reports every stage of the conversion: time per\n"
+        "  run, per event and per Q1 byte, and with hardware counters\n"
+        "  the cycles, instructions, branch misses and L1 data and last\n"
+        "  level cache misses per event and per Q1 byte.  Counters this\n"
+        "  machine doesn't give are shown as -\n\n";
+        return 0;
+    }
+    
+    finish_conv_options(opts);
+    
+    MSQ_PerfCount perf;
+    perf.open();
+    
+    if (!perf.get_num_counters())
+    {
+        std::cout << "No hardware counters (" << strerror(perf.get_open_error()) << "), times only";
+        if (perf.get_open_error() == EACCES)
+            std::cout << ", see /proc/sys/kernel/perf_event_paranoid";
+        std::cout << std::endl << std::endl;
+    }
+    else if (perf.get_num_counters() < MSQ_PERF_NUM_COUNTERS)
+    {
+        std::cout << "Not counted:";
+        for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+        {
+            if (!perf.has_counter(c))
+                std::cout << " " << MSQ_PerfCount::counter_name(c);
+        }
+        std::cout << " (" << strerror(perf.get_open_error()) << ")" << std::endl << std::endl;
+    }
+    
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+    
+    for (int p = 0; p < paths.size(); p++)
+    {
+        const File src (workDirectory.getChildFile(paths[p]));
+        MemoryBlock src_data;
+        
+        if ( !src.loadFileAsData(src_data) )
+        {
+            std::cout << "Couldn't open " << src.getFullPathName() << " for reading" << std::endl;
+            continue;
+        }
+        
+        const int direction = sniff_direction(src.getFileName(), src_data.getData(), src_data.getSize(),
+                                              src.hasFileExtension(".syx") ? MSQ_CODEC_TO_SMF : MSQ_CODEC_TO_Q1,
+                                              opts.filter_options);
+        if (direction == MSQ_CODEC_NONE)
+            continue;
+        
+        MSQ_TempoMap tempo_map;
+        uint8_t* smf_data = 0;
+        int num_events = 0, num_bytes = 0;
+        bool converted = TRUE;
+        
+        if (direction == MSQ_CODEC_TO_SMF)
+            tempo_map.load(tempo_file_for(src.getFullPathName()).getFullPathName().toRawUTF8());
+        
+        // one run ahead, not counted, for warm caches
+        for (int r = 0; (r <= runs) && converted; r++)
+        {
+            if (r == 1)
+                perf.reset();
+            
+            if (direction == MSQ_CODEC_TO_Q1)
+            {
+                MSQ_100_SysEx msq_sysex (*ctx);
+                MemoryOutputStream syx_out;
+                
+                msq_sysex.set_perf_count(&perf);
+                
+                perf.begin(MSQ_STAGE_READ);
+                converted = convert_smf(msq_sysex, src_data.getData(), src_data.getSize(), opts.src_track, opts.filter_options);
+                
+                perf.begin(MSQ_STAGE_WRITE);
+                converted = converted && msq_sysex.write_syx(syx_out);
+                perf.end();
+                
+                num_events = (int) ctx->stats.num_events;
+                num_bytes = ctx->q1_data_size;
+            }
+            else
+            {
+                int num_blks;
+                
+                perf.begin(MSQ_STAGE_DECODE);
+                num_bytes = q1_decode_dump((const uint8_t*) src_data.getData(), (int) src_data.getSize(), ctx->q1_data, &num_blks);
+                converted = (num_blks > 0);
+                
+                if (converted && !smf_data)
+                    smf_data = new uint8_t[q1_smf_size_bound(num_bytes, tempo_map)];
+                
+                perf.begin(MSQ_STAGE_TRANSCODE);
+                if (converted)
+                    q1_transcode_smf(ctx->q1_data, num_bytes, tempo_map, opts.n_timebase, smf_data);
+                perf.end();
+            }
+        }
+        delete[] smf_data;
+        
+        if (!converted)
+        {
+            std::cout << src.getFileName() << " couldn't be converted" << std::endl;
+            continue;
+        }
+        
+        if (direction == MSQ_CODEC_TO_SMF)
+        {
+            // the events the transcoder wrote
+            q1_parser parser;
+            q1_event ev;
+            
+            q1_parse_init(&parser, ctx->q1_data, num_bytes);
+            while ( q1_parse_next(&parser, &ev) )
+                num_events++;
+        }
+        
+        std::cout << src.getFileName() << ": " << num_events << " events, " << num_bytes << " Q1 bytes, "
+        << runs << " runs" << std::endl;
+        
+        char line[160];
+        snprintf(line, sizeof(line), "  %-10s %9s %8s %8s", "stage", "us/run", "ns/ev", "ns/B");
+        std::cout << line;
+        if (perf.get_num_counters())
+        {
+            snprintf(line, sizeof(line), " %5s     ", "IPC");
+            std::cout << line;
+            for (int c = 0; c < MSQ_PERF_NUM_COUNTERS; c++)
+            {
+                snprintf(line, sizeof(line), "  %13s", MSQ_PerfCount::counter_name(c));
+                std::cout << line;
+            }
+        }
+        std::cout << std::endl;
+        
+        for (int s = 0; s < MSQ_NUM_STAGES; s++)
+        {
+            if (perf.get_stage(s).runs)
+                print_bench_stage(stage_names[s], perf.get_stage(s), perf, runs, num_events, num_bytes);
+        }
+        std::cout << std::endl;
+    }
+    
+    delete ctx;
+    
+    return 0;
+}
+
+
+//  msqconvert pack pack_file path ... [-t track] [-f filters] [-o]
+//  msqconvert unpack pack_file [name | #n ...] [-m] [-q PPQN]
+//
+static int run_pack(int argc, char* argv[])
+{
+    MSQ_Pack pack;
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    const String command (argv[1]);
+    conv_options opts;
+    bool to_smf = FALSE;
+    bool cmd_error = (argc < 3);
+    StringArray names;
+    
+    init_conv_options(opts);
+    
+    for (int ai = 3; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            names.add(String (argv[ai]).trim());
+            continue;
+        }
+        
+        const int used = parse_conv_option(argv[ai][1], k, "tqfo", opts);
+        if (used)
+        {
+            cmd_error = (used < 0);
+            ai += used - 1;
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'm':
+                to_smf = TRUE;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( (command == "pack") && !cmd_error && (names.size() > 0) )
+    {
+        Array<File> src_files;
+        for (int n = 0; n < names.size(); n++)
+            src_files.add(workDirectory.getChildFile(names[n]));
+        
+        finish_conv_options(opts);
+        
+        const int num_packed = pack.build_pack(src_files, workDirectory.getChildFile(argv[2]),
+                                               opts.src_track, (uint32_t) opts.filter_options);
+        if (num_packed < 0)
+            std::cout << "Couldn't write " << argv[2] << std::endl << std::endl;
+        else
+            std::cout << num_packed << " dumps packed in " << argv[2] << std::endl;
+        
+        return 0;
+    }
+    
+    if ( (command == "unpack") && !cmd_error )
+    {
+        if ( !pack.open_pack(workDirectory.getChildFile(argv[2])) )
+        {
+            std::cout << "Couldn't read pack " << argv[2] << std::endl << std::endl;
+            return 0;
+        }
+        
+        if (names.size() == 0)
+        {
+            // what's in it
+            for (int e = 0; e < pack.get_num_entries(); e++)
+            {
+                const msq_pack_entry* entry = pack.get_entry(e);
+                std::cout << "#" << e << "  " << pack.get_name(e) << "  " << entry->num_blks << " blocks, "
+                << entry->num_bars << " bars" << std::endl;
+            }
+            std::cout << pack.get_num_entries() << " dumps" << std::endl;
+            return 0;
+        }
+        
+        for (int n = 0; n < names.size(); n++)
+        {
+            const int e = names[n].startsWith("#") ? names[n].substring(1).getIntValue()
+                                                   : pack.find_entry(names[n].toRawUTF8());
+            if ( (e < 0) || (e >= pack.get_num_entries()) )
+            {
+                std::cout << names[n] << " isn't in " << argv[2] << std::endl;
+                continue;
+            }
+            
+            // named as if converted from the packed file
+            const File packed (workDirectory.getChildFile(File (pack.get_name(e)).getFileName()));
+            File dump (packed.withFileExtension(".syx"));
+            if (pack.get_entry(e)->source_type == MSQ_PACK_SRC_MID)
+                dump = dest_file_for(packed, TRUE);
+            const File dst (to_smf ? dest_file_for(dump, FALSE) : dump);
+            
+            dst.deleteFile();
+            bool written;
+            {
+                ScopedPointer <FileOutputStream> dst_stream (dst.createOutputStream());
+                written = (dst_stream != 0)
+                          && (to_smf ? pack.write_smf(e, opts.n_timebase, *dst_stream) : pack.write_syx(e, *dst_stream));
+            }
+            
+            if (written && !to_smf)
+            {
+                // the packed tempo map goes next to the dump as a conversion leaves it
+                MSQ_TempoMap tempo_map;
+                pack.get_tempo_map(e, tempo_map);
+                save_tempo_file(tempo_map, dst.getFullPathName());
+            }
+            
+            if (written)
+                std::cout << pack.get_name(e) << " -> " << dst.getFileName() << std::endl;
+            else
+                std::cout << "Couldn't write " << dst.getFileName() << std::endl;
+        }
+        
+        return 0;
+    }
+    
+    std::cout << "Usage: msqconvert pack pack_file path ... [-t track] [-f filters] [-o]\n"
+    "       msqconvert unpack pack_file [name | #n ...] [-m] [-q PPQN]\n\n"
+    "  pack puts the Q1 data of every .syx and .mid file given, or\n"
+    "  found in directories given, into pack_file.  unpack lists\n"
+    "  the dumps in it, or writes the ones named as .syx, with -m\n"
+    "  converted to .mid\n\n";
+    
+    return 0;
+}
+
+
+// runs on a watch worker, see MSQ_Watch.h
+static void watch_convert(MSQ_Watch& watch, const String& path, msq_conv_ctx& ctx, void* user)
+{
+    // the options every file dropped in converts with
+    const conv_options* opts = (const conv_options*) user;
+    const double start_ms = Time::getMillisecondCounterHiRes();
+    const File src (path);
+    msq_io_file src_file, dst_file;
+    
+    src_file.path = path;
+    if ( !src.loadFileAsData(src_file.data) )
+    {
+        std::cout << "Couldn't open " << path << " for reading" << std::endl;
+        return;
+    }
+    src_file.size = src_file.data.getSize();
+    
+    const int direction = sniff_direction(src.getFileName(), src_file.data.getData(), src_file.size,
+                                          src.hasFileExtension(".mid") ? MSQ_CODEC_TO_Q1 : MSQ_CODEC_TO_SMF,
+                                          opts->filter_options);
+    if (direction == MSQ_CODEC_NONE) return;
+    
+    const bool forward = (direction == MSQ_CODEC_TO_Q1);
+    const File dst (dest_file_for(src, forward));
+    dst_file.path = dst.getFullPathName();
+    
+    if ( !convert_buffer(ctx, src_file, dst_file, forward, opts->src_track, opts->n_timebase, opts->filter_options) )
+    {
+        std::cout << "Couldn't convert " << path << std::endl;
+        return;
+    }
+    
+    // written here, not a new file for the watch
+    watch.ignore_write(dst_file.path);
+    
+    dst.deleteFile();
+    {
+        ScopedPointer <FileOutputStream> dst_stream (dst.createOutputStream());
+        if (dst_stream == 0)
+        {
+            std::cout << "Couldn't write " << dst_file.path << std::endl;
+            return;
+        }
+        dst_stream->write(dst_file.data.getData(), dst_file.size);
+        dst_stream->flush();
+    }
+    
+    // one line, workers print at the same time
+    std::cout << (src.getFileName() + " -> " + dst.getFileName() + " ("
+                  + String (juce::roundToInt (Time::getMillisecondCounterHiRes() - start_ms)) + " ms)\n");
+    std::cout.flush();
+}
+
+
+//  msqconvert watch dir ... [-t track] [-q PPQN] [-f filters] [-o] [-n workers]
+//
+static int run_watch(int argc, char* argv[])
+{
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    conv_options opts;
+    int num_workers = 2;
+    bool cmd_error = FALSE;
+    StringArray dirs;
+    
+    init_conv_options(opts);
+    
+    for (int ai = 2; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            dirs.add(String (argv[ai]).trim());
+            continue;
+        }
+        
+        const int used = parse_conv_option(argv[ai][1], k, "tqfo", opts);
+        if (used)
+        {
+            cmd_error = (used < 0);
+            ai += used - 1;
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'n':
+                if (k) num_workers = std::atoi(k);
+                ai++;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( cmd_error || (dirs.size() == 0) )
+    {
+        std::cout << "Usage: msqconvert watch dir ... [-t track] [-q PPQN] [-f filters] [-o] [-n workers]\n\n"
+        "  Converts every .mid and .syx file written or moved into\n"
+        "  the directories, with the options as for single files,\n"
+        "  until interrupted.  -n sets the number of conversions\n"
+        "  running at once, 2 by default\n\n";
+        return 0;
+    }
+    
+    finish_conv_options(opts);
+    
+    MSQ_Watch watch (num_workers, watch_convert, &opts);
+    
+    for (int d = 0; d < dirs.size(); d++)
+    {
+        if ( !watch.add_dir(workDirectory.getChildFile(dirs[d])) )
+        {
+            std::cout << "Couldn't watch " << dirs[d] << std::endl << std::endl;
+            return 0;
+        }
+    }
+    
+    std::cout << "Watching " << dirs.size() << (dirs.size() == 1 ? " directory" : " directories")
+    << ", Ctrl-C stops" << std::endl;
+    
+    watch.run();
+    
+    return 0;
+}
+
+
+//==============================================================================
+static volatile sig_atomic_t serve_interrupted = 0;
+
+static void serve_on_sigint(int)
+{
+    serve_interrupted = 1;
+}
+
+
+// converts the request in slot, leaving the result in its place
+static void serve_request(MSQ_Shm& shm, msq_shm_slot* slot, msq_conv_ctx& ctx)
+{
+    uint8_t* data = shm.get_data(slot);
+    const int slot_size = shm.get_slot_size();
+    MSQ_TempoMap tempo_map;
+    MemoryOutputStream dst_out;
+    bool converted = FALSE;
+    
+    slot->result = MSQ_SHM_BAD_REQUEST;
+    if ( (slot->data_size == 0) || (slot->data_size > (uint32_t) slot_size)
+        || (slot->num_tempos > (uint32_t) shm.get_tempo_room(slot)) )
+    {
+        slot->data_size = 0;
+        return;
+    }
+    
+    if (slot->direction == MSQ_CODEC_TO_Q1)
+    {
+        converted = msq_convert_smf(ctx, data, slot->data_size, slot->src_track, slot->filters,
+                                    &tempo_map, dst_out);
+    }
+    else if (slot->direction == MSQ_CODEC_TO_SMF)
+    {
+        // the map goes before the result takes its place
+        const uint32_t* tempos = shm.get_tempos(slot);
+        
+        tempo_map.clear(slot->tempo_ppqn ? (int) slot->tempo_ppqn : 120);
+        for (uint32_t t = 0; t < slot->num_tempos; t++)
+            tempo_map.add_tempo((int) tempos[2 * t], tempos[2 * t + 1]);
+        
+        converted = msq_convert_syx(ctx, data, slot->data_size, valid_timebase(slot->n_timebase), slot->filters,
+                                    (tempo_map.get_num_tempos() > 0) ? &tempo_map : 0, dst_out);
+        tempo_map.clear(120);
+    }
+    else
+    {
+        slot->data_size = 0;
+        return;
+    }
+    
+    slot->data_size = 0;
+    slot->num_tempos = 0;
+    
+    if (!converted)
+    {
+        slot->result = MSQ_SHM_FAILED;
+        return;
+    }
+    if ((int) dst_out.getDataSize() > slot_size)
+    {
+        slot->result = MSQ_SHM_TOO_BIG;
+        return;
+    }
+    
+    memcpy(data, dst_out.getData(), dst_out.getDataSize());
+    slot->data_size = (uint32_t) dst_out.getDataSize();
+    
+    if (tempo_map.get_num_tempos() > shm.get_tempo_room(slot))
+    {
+        slot->data_size = 0;
+        slot->result = MSQ_SHM_TOO_BIG;
+        return;
+    }
+    
+    uint32_t* tempos = shm.get_tempos(slot);
+    for (int t = 0; t < tempo_map.get_num_tempos(); t++)
+    {
+        tempos[2 * t] = (uint32_t) tempo_map.get_tick(t);
+        tempos[2 * t + 1] = tempo_map.get_mpqn(t);
+    }
+    slot->num_tempos = (uint32_t) tempo_map.get_num_tempos();
+    slot->tempo_ppqn = (uint32_t) tempo_map.get_ppqn();
+    
+    slot->result = MSQ_SHM_OK;
+}
+
+
+//  msqconvert serve name [-n slots] [-k KB]
+//
+static int run_serve(int argc, char* argv[])
+{
+    int num_slots = MSQ_SHM_NUM_SLOTS;
+    int slot_kb = MSQ_SHM_SLOT_SIZE / 1024;
+    bool cmd_error = FALSE;
+    const char* name = 0;
+    
+    for (int ai = 2; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            if (name)
+                cmd_error = TRUE;
+            name = argv[ai];
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'n':
+                if (k) num_slots = std::atoi(k);
+                ai++;
+                break;
+                
+            case 'k':
+                if (k) slot_kb = std::atoi(k);
+                ai++;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( cmd_error || !name || (num_slots < 1) || (slot_kb < 64) )
+    {
+        std::cout << "Usage: msqconvert serve name [-n slots] [-k KB]\n\n"
+        "  Stays resident and converts what clients put into the\n"
+        "  shared memory /name, see MSQ_Shm.h, until interrupted.\n"
+        "  -n sets the slots clients can fill at once, 4 by default,\n"
+        "  -k the bytes each holds in KB, 1024 by default\n\n";
+        return 0;
+    }
+    
+    MSQ_Shm shm;
+    if ( !shm.create(name, num_slots, slot_kb * 1024) )
+    {
+        std::cout << "Couldn't set up shared memory " << name << ", is it served already?" << std::endl << std::endl;
+        return 0;
+    }
+    
+    std::cout << "Serving " << name << ", Ctrl-C stops" << std::endl;
+    
+    msq_conv_ctx* ctx = new msq_conv_ctx;
+    msq_conv_init(ctx);
+    
+    serve_interrupted = 0;
+    void (*prev_handler)(int) = signal(SIGINT, serve_on_sigint);
+    
+    while ( !serve_interrupted )
+    {
+        msq_shm_slot* slot = shm.next_request(500);
+        if (!slot) continue;
+        
+        serve_request(shm, slot, *ctx);
+        shm.post_result(slot);
+    }
+    
+    signal(SIGINT, prev_handler);
+    shm.close();
+    delete ctx;
+    
+    return 0;
+}
+
 
 //==============================================================================
+//  msqconvert ingest capture [-a] [-b BPM] [-f filters] [-o]
+//
+static int run_ingest(int argc, char* argv[])
+{
+    const File workDirectory (File::getCurrentWorkingDirectory());
+    conv_options opts;
+    bool arrival_time = FALSE;
+    double bpm = 100.0;
+    bool cmd_error = FALSE;
+    const char* name = 0;
+    
+    init_conv_options(opts);
+    
+    for (int ai = 2; (ai < argc) && !cmd_error; ai++)
+    {
+        const char* k = (ai + 1 < argc) ? argv[ai + 1] : 0;
+        
+        if (argv[ai][0] != '-')
+        {
+            if (name)
+                cmd_error = TRUE;
+            name = argv[ai];
+            continue;
+        }
+        
+        const int used = parse_conv_option(argv[ai][1], k, "fo", opts);
+        if (used)
+        {
+            cmd_error = (used < 0);
+            ai += used - 1;
+            continue;
+        }
+        
+        switch (argv[ai][1])
+        {
+            case 'a':
+                arrival_time = TRUE;
+                break;
+                
+            case 'b':
+                if (k) bpm = std::atof(k);
+                ai++;
+                break;
+                
+            default:
+                cmd_error = TRUE;
+                break;
+        }
+    }
+    
+    if ( cmd_error || !name || (bpm < 10.0) || (bpm > 500.0) )
+    {
+        std::cout << "Usage: msqconvert ingest capture [-a] [-b BPM] [-f filters] [-o]\n\n"
+        "  Encodes a raw MIDI capture to MSQ-100 SysEx as it is\n"
+        "  read, no MIDI file needed.  capture is a log with a line\n"
+        "  per chunk received, its time in ms and the bytes in hex,\n"
+        "  or with -a the MIDI bytes themselves, from a FIFO or\n"
+        "  device, timed as they arrive.  -b sets the tempo the\n"
+        "  time is counted in, 100 BPM by default.  Output file is\n"
+        "  capture_msq.syx with its .tempo\n\n";
+        return 0;
+    }
+    
+    finish_conv_options(opts);
+    
+    const File src (workDirectory.getChildFile(String (name).trim()));
+    
+    // POSIX, a FIFO is read as it fills
+    const int fd = open(src.getFullPathName().toRawUTF8(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cout << "Couldn't open " << name << " for reading" << std::endl << std::endl;
+        return 0;
+    }
+    
+    if (arrival_time)
+        std::cout << "Reading " << src.getFileName() << ", until its writer closes" << std::endl;
+    
+    MSQ_100_SysEx msq_sysex;
+    MSQ_RawMidi raw;
+    
+    raw.begin(fd, arrival_time, bpm);
+    const bool converted = msq_sysex.raw_to_msq_syx(raw, bpm, (uint32_t) opts.filter_options);
+    close(fd);
+    
+    const msq_raw_stats& raw_stats = raw.get_stats();
+    const msq_conv_stats& stats = msq_sysex.get_stats();
+    
+    std::cout << raw_stats.num_events << " channel messages in " << (juce::int64) raw_stats.num_bytes << " bytes";
+    if (raw_stats.num_realtime) std::cout << ", " << raw_stats.num_realtime << " realtime skipped";
+    if (raw_stats.num_sysex)    std::cout << ", " << raw_stats.num_sysex << " SysEx skipped";
+    if (raw_stats.num_common)   std::cout << ", " << raw_stats.num_common << " system common skipped";
+    if (raw_stats.num_stray)    std::cout << ", " << raw_stats.num_stray << " stray data bytes";
+    if (raw_stats.num_bad_lines) std::cout << ", " << raw_stats.num_bad_lines << " bad lines";
+    std::cout << std::endl;
+    
+    if (!converted)
+    {
+        std::cout << "No channel messages to convert" << std::endl << std::endl;
+        return 0;
+    }
+    
+    if (stats.num_cut)
+        std::cout << stats.num_cut << " events past the last block left out" << std::endl;
+    
+    const File sysex_file (dest_file_for(src, TRUE));
+    sysex_file.deleteFile();
+    ScopedPointer <FileOutputStream> sysex_stream (sysex_file.createOutputStream());
+    
+    if ( (sysex_stream == 0) || !msq_sysex.write_syx(*sysex_stream) )
+    {
+        std::cout << "Couldn't write " << sysex_file.getFileName() << std::endl << std::endl;
+        return 0;
+    }
+    
+    std::cout << "Transfer time " << msq_sysex.get_transfer_time(0.0)
+    << " ms (" << msq_sysex.get_SysEx_size() << " bytes in "
+    << msq_sysex.get_num_syx_blks() << " blocks at " << MIDI_BAUD_RATE << " baud)" << std::endl;
+    
+    msq_sysex.get_tempo_map().save(tempo_file_for(sysex_file.getFullPathName()).getFullPathName().toRawUTF8());
+    
+    std::cout << "Raw MIDI converted to MSQ-100 SysEx, " << sysex_file.getFileName() << std::endl;
+    
+    return 0;
+}
+
+
 int main (int argc, char* argv[])
 {
-    int direction = 1, src_track = 0;
+    int direction = 1;
     char c;
     char* k;
 
-    unsigned long filter_options = FILTER_OPT_CLEAR;
-    unsigned int filt_chan = 0;
-    
-    short n_timebase = 120;  // Default PPQN only used for reading from MSQ SysEx
+    conv_options opts;           // n_timebase only used for reading from MSQ SysEx
     bool cmd_error = FALSE;
     
+    double blk_delay_ms = 0.0;   // device pause after each SysEx block
+    bool compare_mode = FALSE;
+    
+    StringArray src_names;       // more than one source converts as a batch
+    bool try_uring = FALSE;
+    bool save_bars = FALSE;      // bar index next to the .syx, reverse only
+    bool opt_value = FALSE;      // next argument belongs to an option
+    
+    std::vector<int> src_tracks; // -t all or a list, a dump per track
+    bool multi_track = FALSE;
+    
 
     MSQ_100_SysEx *my_msq_sysex;
     String srcfile;
@@ -40,6 +1625,27 @@ int main (int argc, char* argv[])
 
     std::cout << "\nMSQ-100 SysEx Converter! v0.33 (beta) by Michael Lauter - www.lauterzeit.com/msq\n\n";
   
+    if ( (argc > 1) && ((String (argv[1]) == "index") || (String (argv[1]) == "query") || (String (argv[1]) == "dups")) )
+        return run_catalog(argc, argv);
+    
+    if ( (argc > 1) && (String (argv[1]) == "analyze") )
+        return run_analyze(argc, argv);
+    
+    if ( (argc > 1) && (String (argv[1]) == "bench") )
+        return run_bench(argc, argv);
+    
+    if ( (argc > 1) && (String (argv[1]) == "watch") )
+        return run_watch(argc, argv);
+    
+    if ( (argc > 1) && (String (argv[1]) == "serve") )
+        return run_serve(argc, argv);
+    
+    if ( (argc > 1) && (String (argv[1]) == "ingest") )
+        return run_ingest(argc, argv);
+    
+    if ( (argc > 1) && ((String (argv[1]) == "pack") || (String (argv[1]) == "unpack")) )
+        return run_pack(argc, argv);
+    
     int ai = 0;
     if ( argc > 1 )
     {
@@ -52,96 +1658,68 @@ int main (int argc, char* argv[])
         cmd_error = TRUE;
     }
     srcfile.trim();
-    src_track = 1;
+    init_conv_options(opts);
     
     while ( ( ++ai < argc ) && !cmd_error )
     {
-        if ( (*++argv)[0] == '-' )
+        if ( (*++argv)[0] != '-' )
+        {
+            if (!opt_value)
+                src_names.add(String (argv[0]).trim());
+            opt_value = FALSE;
+        }
+        else
         {
+            opt_value = FALSE;
             while ( (c = *++argv[0]) && !cmd_error )
             {
                 k = (argv+1)[0];
                 //ai++;
                 
+                // -t takes a list here, see below
+                const int used = (c == 't') ? 0 : parse_conv_option(c, k, "qfo", opts);
+                if (used)
+                {
+                    cmd_error = (used < 0);
+                    opt_value = (used == 2);
+                    continue;
+                }
+                
                 switch (c)
                 {
                     case 't':
+                        opt_value = TRUE;
                         if( ai < argc)
-                            src_track = std::atoi( k );
+                        {
+                            multi_track = parse_track_list(k, src_tracks);
+                            if (!multi_track)
+                                opts.src_track = std::atoi( k );
+                        }
                         break;
                         
-                    case 'q':
+                    case 'd':
+                        opt_value = TRUE;
                         if( ai < argc)
-                            n_timebase = std::atoi( k );
+                            blk_delay_ms = std::atof( k );
                         
-                        if (n_timebase < 96)
-                            n_timebase = 96;
-                        else if(n_timebase > 960)
-                            n_timebase = 960;
-                        else if (n_timebase % 24)
-                            n_timebase = 24 * (n_timebase / 24);
+                        if (blk_delay_ms < 0.0)
+                            blk_delay_ms = 0.0;
                         break;
                         
-                    case 'f':
-                        if( ai >= argc) break;
+                    case 'c':
+                        compare_mode = TRUE;
+                        break;
                         
+                    case 'u':
+                        try_uring = TRUE;
+                        break;
                         
-                        // k = (argv+1)[0];
-
-                        while ( (*k != '\0') && !cmd_error)
-                        {
-                            // parse filter options
-                            switch (*k)
-                            {
-                                case 'p':
-                                case 'P':
-                                    filter_options |= FILTER_OPT_PRGCHNG;
-                                    break;
-                                    
-                                case 'a':
-                                case 'A':
-                                    filter_options |= FILTER_OPT_AFTRTCH;
-                                    break;
-                                    
-                                case 'b':
-                                case 'B':
-                                    filter_options |= FILTER_OPT_PTCHBND;
-                                    break;
-                                    
-                                case 'l':
-                                case 'L':
-                                    filter_options |= FILTER_OPT_CCNTRLS;
-                                    break;
-                                    
-                                case 'c':
-                                case 'C':
-                                    filter_options |= FILTER_OPT_CHNMUTE;
-                                    break;
-                                    
-                                case 'x':
-                                case 'X':
-                                    filter_options |= FILTER_OPT_CHNSOLO;
-                                    break;
-                                    
-                                case '0':
-                                case '1':
-                                case '2':
-                                case '3':
-                                case '4':
-                                case '5':
-                                case '6':
-                                case '7':
-                                case '8':
-                                case '9':
-                                    filt_chan = 10 * filt_chan + (*k - '0');
-                                    break;
-                                    
-                                default:
-                                    cmd_error = TRUE;
-                                    break;
-                            }
-                            ++k;
-                        }
+                    case 'b':
+                        save_bars = TRUE;
+                        break;
+                        
+                    case 's':
+                        opts.filter_options |= DECODE_OPT_SALVAGE;
                         break;
                         
                     default:
@@ -152,10 +1730,18 @@ int main (int argc, char* argv[])
         }
     }
     
+    // io_uring only pays off over a batch, say so rather than ignore it
+    if ( try_uring && !src_names.size() && !cmd_error )
+    {
+        std::cout << "-u only applies to a batch of several source files" << std::endl << std::endl;
+        cmd_error = TRUE;
+    }
+    
     // for debug in check < 1, but should look for == 1
     if ( cmd_error || argc == 1 || !srcfile.isNotEmpty())
     {
-        std::cout << "Usage: msqconvert sourcefile[.mid | .syx] [-t track] [-q PPQN] [-f filters]\n\n"
+        std::cout << "Usage: msqconvert sourcefile[.mid | .syx] [-t track] [-q PPQN] [-f filters] [-o] [-d ms] [-c] [-b] [-s]\n"
+        "       msqconvert sourcefile sourcefile ... [options] [-u]\n\n"
         "  msqconvert will translate a Standard MIDI File to\n"
         "  Roland MSQ-100 SysEx sequencer data.\n\n"
         "  If sourcefile is .mid then a target file will be\n"
@@ -164,30 +1750,83 @@ int main (int argc, char* argv[])
         "  performed, whereby the -q option sets the PPQN (timebase)\n"
         "  for the new MIDI file.  If converting FROM Format 1 MIDI\n"
         "  file, then the -t option specifies track num.\n"
+        "  -t all, or a list such as -t 2,5,7, writes each track\n"
+        "  to its own name_tN_msq.syx, parsing the file once\n"
         "  The -f option invokes message filtering as follows:\n"
         "      p = program change and bank select messages\n"
         "      l = controllers change\n"
         "      a = channel and/or polyphonic aftertouch\n"
         "      b = pitch bend\n"
         "      c = channel (mute)\n"
-        "      x = all except channel (solo)\n\n"
+        "      x = all except channel (solo)\n"
+        "  The -o option reorders simultaneous events for running\n"
+        "  status and drops repeated time signatures, so more bars\n"
+        "  fit in the MSQ-100's 127 blocks\n"
+        "  The upload time at 31250 baud is printed for each dump,\n"
+        "  -d adds the device's pause after every block in ms and\n"
+        "  -c compares the upload time of other filter sets and -o\n"
+        "  Several source files are converted as a batch with the\n"
+        "  same options, -u does the batch's file I/O with io_uring\n"
+        "  -b saves a bar index of a .syx source as name.bars, for\n"
+        "  msqfast -a and players that start at a given bar\n"
+        "  -s salvages a damaged .syx source: bad blocks are skipped,\n"
+        "  the music picks up again at the next bar line, and what\n"
+        "  was lost is listed\n\n"
         "Examples:\n"
         "  msqconvert my_song.mid -t 3 -f pax14\n"
         "      which converts only track 3 and filters\n"
         "      program changes, aftertouch and all\n"
         "      channel messages except Ch. 14\n"
         "      Output file is my_song_msq.syx\n\n"
+        "  msqconvert my_song.mid -t all -f p\n"
+        "      which converts every track holding notes or\n"
+        "      other channel messages without program changes\n"
+        "      Output files are my_song_t1_msq.syx, ...\n\n"
         "  msqconvert my_step_seq.syx -q 480 -f c3\n"
         "      which reverse converts without Ch. 3\n"
         "      to std. Midi at 480 PPQN.  If -t is omitted,\n"
         "      then the default of 120 PPQN is used\n"
-        "      Output file is my_step_seq_qsm.mid\n\n";
+        "      Output file is my_step_seq_qsm.mid\n\n"
+        "  msqconvert index archive_dir catalog_file\n"
+        "  msqconvert query catalog_file sig=7 blocks>100\n"
+        "      which indexes all .syx and .mid files once, then\n"
+        "      lists dumps in 7/4 longer than 100 blocks\n\n"
+        "  msqconvert dups catalog_file 80\n"
+        "      which lists dumps of the same music, also when\n"
+        "      filtered differently, at least 80% alike\n\n"
+        "  msqconvert analyze songs/ -f pl\n"
+        "      which reports what every file in songs/ would\n"
+        "      convert to without program and control changes,\n"
+        "      writing nothing\n\n"
+        "  msqconvert bench my_song.mid -r 100\n"
+        "      which converts my_song.mid 100 times and shows\n"
+        "      where the time goes, stage by stage\n\n"
+        "  msqconvert watch exports/ -f pl\n"
+        "      which converts every file dropped into exports/\n"
+        "      as it arrives, until Ctrl-C\n\n"
+        "  msqconvert serve daw\n"
+        "      which stays resident converting whatever a\n"
+        "      plugin puts in the shared memory /daw\n\n"
+        "  msqconvert ingest /tmp/midi_in -a -b 120\n"
+        "      which records what is played into the FIFO\n"
+        "      /tmp/midi_in at 120 BPM, written when it closes\n"
+        "      Output file is midi_in_msq.syx\n\n"
+        "  msqconvert pack archive.msqp dumps/\n"
+        "  msqconvert unpack archive.msqp #3 -m\n"
+        "      which keeps all dumps in one file, then writes\n"
+        "      the fourth one out as a MIDI file\n\n";
         
         return (0);
     }
 
-    if ( filter_options & (FILTER_OPT_CHNMUTE | FILTER_OPT_CHNSOLO) );
-        filter_options |= (FILTER_CHAN_MASK & (unsigned)filt_chan);
+    finish_conv_options(opts);
+    
+    if (src_names.size())
+    {
+        src_names.insert(0, srcfile);
+        run_batch(src_names, opts.src_track, opts.n_timebase, opts.filter_options, try_uring);
+        return (0);
+    }
     
     my_msq_sysex = new MSQ_100_SysEx();
     
@@ -218,9 +1857,15 @@ int main (int argc, char* argv[])
         }
     }
     
+    // extension as written, the data may still turn out the other kind
+    const String src_ext (direction == 1 ? ".mid" : ".syx");
+    if (direction != -1)
+        direction = sniff_file_direction(sourceDirectory.getChildFile(srcfile).withFileExtension(src_ext), direction,
+                                         opts.filter_options);
+    
     if (direction != -1)
     {
-        std::cout << "Timebase set to " << n_timebase << " PPQN" << std::endl;
+        std::cout << "Timebase set to " << opts.n_timebase << " PPQN" << std::endl;
     }
     
     if (direction == 1)
@@ -231,50 +1876,52 @@ int main (int argc, char* argv[])
         String destfile = String (srcfile.unquoted());
         destfile.append("_msq.syx", 8);
         destfile.trim();
-        srcfile.append(".mid", 4);
+        srcfile.append(src_ext, 4);
 
-        const File std_midi_file (sourceDirectory.getChildFile(srcfile).withFileExtension(".mid"));
-        ScopedPointer <FileInputStream> std_midi_stream (std_midi_file.createInputStream());
+        const File std_midi_file (sourceDirectory.getChildFile(srcfile).withFileExtension(src_ext));
+        MemoryMappedFile std_midi_map (std_midi_file, MemoryMappedFile::readOnly);
         
-        if (std_midi_stream == 0)
+        if (std_midi_map.getData() == 0)
         {
             std::cout << "Couldn't open "
             << srcfile << " for reading" << std::endl << std::endl;
         }
+        else if (multi_track)
+        {
+            convert_smf_tracks(std_midi_map.getData(), std_midi_map.getSize(), destDirectory,
+                               destfile.dropLastCharacters(8), src_tracks, opts.filter_options);
+        }
         else
         {
             const File sysex_file (destDirectory.getChildFile(destfile).withFileExtension(".syx"));
             sysex_file.deleteFile();
             ScopedPointer <FileOutputStream> sysex_stream (sysex_file.createOutputStream());
             
-            // ScopedPointer <MSQ_100_SysEx> my_msq_sysex;
-            my_msq_sysex->readFrom(*std_midi_stream);
-            
-            if (my_msq_sysex->getNumTracks())
+            if ( convert_smf(*my_msq_sysex, std_midi_map.getData(), std_midi_map.getSize(), opts.src_track, opts.filter_options) )
             {
-                // if at least one track then use the first
-                // my_msq_sysex->getTrack(1);
-                // future options: merge tracks
-                if (my_msq_sysex->getNumTracks() > 1)
-                {
-                    // MIDI Fromat 1
-                    if ( src_track >= my_msq_sysex->getNumTracks() )
-                        src_track = 1;
-                    my_msq_sysex->mergeTimeSig(src_track);
-                }
-                else
+                if (opts.filter_options & ENCODE_OPT_OPTIMIZE)
                 {
-                    // MIDI Fromat 0
-                    src_track = 0;
+                    std::cout << "Optimized Q1 data " << my_msq_sysex->get_Q1_data_size()
+                    << " bytes, saved " << (my_msq_sysex->get_Q1_base_size() - my_msq_sysex->get_Q1_data_size())
+                    << " bytes (" << my_msq_sysex->get_num_syx_blks() << " blocks)" << std::endl;
                 }
                 
-                // if timebase is different, change to 120 PPQN for MSQ-100
-                if (my_msq_sysex->getTimeFormat() != 120)
-                    my_msq_sysex->changePPQN((short) 120);
+                std::cout << "Transfer time " << my_msq_sysex->get_transfer_time(blk_delay_ms)
+                << " ms (" << my_msq_sysex->get_SysEx_size() << " bytes in "
+                << my_msq_sysex->get_num_syx_blks() << " blocks at " << MIDI_BAUD_RATE << " baud";
+                if (blk_delay_ms > 0.0)
+                    std::cout << " + " << blk_delay_ms << " ms per block";
+                std::cout << ")" << std::endl;
+                
+                my_msq_sysex->write_syx(*sysex_stream);
                 
-                my_msq_sysex->smf_to_msq_syx(src_track, filter_options);
+                const MSQ_TempoMap& tempo_map = my_msq_sysex->get_tempo_map();
+                if ( save_tempo_file(tempo_map, sysex_file.getFullPathName()) )
+                    std::cout << "Tempo map (" << tempo_map.get_num_tempos() << " changes) saved to "
+                    << tempo_file_for(sysex_file.getFullPathName()).getFileName() << std::endl;
                 
-                my_msq_sysex->write_RawSysEx(*sysex_stream);
+                if (compare_mode)
+                    compare_transfer_times(std_midi_file, opts.src_track, opts.filter_options, blk_delay_ms);
             }
             
             cout << "Std. MIDI File converted to MSQ-100 SysEx\n";
@@ -287,9 +1934,9 @@ int main (int argc, char* argv[])
         destfile = String (srcfile.unquoted());
         destfile.append("_qsm.mid", 8);
         destfile.trim();
-        srcfile.append(".syx", 4);
+        srcfile.append(src_ext, 4);
         
-        const File sysex_file (sourceDirectory.getChildFile(srcfile).withFileExtension(".syx"));
+        const File sysex_file (sourceDirectory.getChildFile(srcfile).withFileExtension(src_ext));
         ScopedPointer <FileInputStream> sysex_stream (sysex_file.createInputStream());
         
         if (sysex_stream == 0)
@@ -305,18 +1952,40 @@ int main (int argc, char* argv[])
             
             // ScopedPointer <MSQ_100_SysEx> my_msq_sysex;
 
-            // read the .SYX file
-            my_msq_sysex->read_RawSysEx(*sysex_stream);
+            // read the .SYX file, salvaging takes it as it is
+            MemoryBlock sysex_data;
+            if (opts.filter_options & DECODE_OPT_SALVAGE)
+                sysex_file.loadFileAsData(sysex_data);
+            else
+                my_msq_sysex->read_RawSysEx(*sysex_stream);
+            
+            const File tempo_file (tempo_file_for(sysex_file.getFullPathName()));
+            if ( my_msq_sysex->get_tempo_map().load(tempo_file.getFullPathName().toRawUTF8()) )
+                std::cout << "Tempo map loaded from " << tempo_file.getFileName() << std::endl;
  
             // try to make MODE 0 Standard Midi File
-            my_msq_sysex->msq_syx_to_smf(filter_options);
+            if (opts.filter_options & DECODE_OPT_SALVAGE)
+            {
+                my_msq_sysex->salvage_syx_to_smf(sysex_data.getData(), sysex_data.getSize(), opts.filter_options);
+                print_salvage_report(sysex_file.getFileName(), my_msq_sysex->get_salvage_report());
+            }
+            else
+                my_msq_sysex->msq_syx_to_smf(opts.filter_options);
+            
+            if (save_bars && my_msq_sysex->is_MSQ_100())
+            {
+                const File bars_file (sysex_file.withFileExtension(".bars"));
+                if ( my_msq_sysex->get_bar_index().save(bars_file.getFullPathName().toRawUTF8()) )
+                    std::cout << "Bar index (" << my_msq_sysex->get_bar_index().get_num_bars() << " bars) saved to "
+                    << bars_file.getFileName() << std::endl;
+            }
         
             // change to new PPQN - 96 is default for MC-500/300/50s and Ableton
-            if (n_timebase != 120)
-                my_msq_sysex->changePPQN((short) n_timebase);
+            if (opts.n_timebase != 120)
+                my_msq_sysex->changePPQN((short) opts.n_timebase);
         
             // Write the .MID file
-            my_msq_sysex->writeTo(*std_midi_stream);
+            my_msq_sysex->write_smf(*std_midi_stream);
         
             cout << "MSQ-100 SysEx converted to Std. MIDI File, Format 0\n";
         }
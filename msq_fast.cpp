@@ -0,0 +1,340 @@
+//
+//  msq_fast.cpp
+//  msq_convert
+//
+//  msqfast - fast-start MSQ-100 SysEx to Standard MIDI File converter
+//  for scripts running one small conversion per process.  Uses only the
+//  Q1 codec core, no JUCE and no iostreams, so there is no static
+//  initialization ahead of the conversion.  The .mid it writes matches
+//  msqconvert's reverse conversion byte for byte.
+//
+//  Build statically linked, without Main.cpp and the JUCE modules:
+//      c++ -O2 -static -o msqfast msq_fast.cpp MSQ_Q1.cpp MSQ_TempoMap.cpp MSQ_Transcode.cpp MSQ_BarIndex.cpp
+//
+//  msqfast -a bar starts the .mid at that bar, seeking with the name.bars
+//  index msqconvert -b saves, or one made on the spot if it is missing
+//  or stale
+//
+//  msqfast -B runs ... execs itself that many times and checks the
+//  median run against FAST_BUDGET_US, as the startup regression test
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "MSQ_Transcode.h"
+
+
+#define FAST_BUDGET_US      2000    // process start to converted file written
+#define FAST_MAX_BENCH_RUNS 10000
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: msqfast sourcefile.syx [-q PPQN] [-a bar]\n"
+            "       msqfast -B runs sourcefile.syx [-q PPQN] [-a bar]\n\n"
+            "  Converts MSQ-100 SysEx to sourcefile_qsm.mid like msqconvert,\n"
+            "  -a starts it at that bar, 1 being the first, using the bar\n"
+            "  index msqconvert -b saved as sourcefile.bars if it matches\n"
+            "  -B times that many runs and fails if the median takes longer\n"
+            "  than %d us\n\n", FAST_BUDGET_US);
+}
+
+
+// whole file into a new buffer, returns size or -1
+static int read_file(const char* path, uint8_t** data)
+{
+    struct stat st;
+    int done = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return (-1);
+
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return (-1);
+    }
+
+    *data = new uint8_t[st.st_size + 1];
+
+    while (done < st.st_size)
+    {
+        ssize_t n = read(fd, *data + done, st.st_size - done);
+        if ( (n < 0) && (errno == EINTR) ) continue;
+        if (n <= 0) break;
+        done += (int) n;
+    }
+    close(fd);
+
+    return (done);
+}
+
+
+static bool write_file(const char* path, const uint8_t* data, int size)
+{
+    int done = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return FALSE;
+
+    while (done < size)
+    {
+        ssize_t n = write(fd, data + done, size - done);
+        if ( (n < 0) && (errno == EINTR) ) continue;
+        if (n <= 0) break;
+        done += (int) n;
+    }
+
+    return ( (close(fd) == 0) && (done == size) );
+}
+
+
+//  Decodes the dump and writes its SMF into a new smf buffer, see
+//  q1_transcode_smf.  From a bar past the first, the bar index at
+//  bars_path is loaded, or built when it doesn't match the dump.
+//  Returns the SMF size, 0 if there was no valid block, -1 if the dump
+//  has no such bar.
+//
+static int convert_dump(const uint8_t* syx_data, int syx_size, const MSQ_TempoMap& tempo_map,
+                        short n_timebase, const char* bars_path, int from_bar, uint8_t** smf)
+{
+    uint8_t* q1_data = new uint8_t[Q1_MAX_SYX_BLKS * Q1_BLK_BUF_SIZE];
+    int num_blks;
+
+    const int q1_size = q1_decode_dump(syx_data, syx_size, q1_data, &num_blks);
+
+    if (!num_blks)
+    {
+        delete[] q1_data;
+        return (0);
+    }
+
+    int smf_size;
+    *smf = new uint8_t[q1_smf_size_bound(q1_size, tempo_map)];
+
+    if (from_bar)
+    {
+        MSQ_BarIndex bar_index;
+        if ( !bar_index.load(bars_path, q1_data, q1_size) )
+            bar_index.build(q1_data, q1_size);
+
+        smf_size = q1_transcode_smf_from(q1_data, q1_size, tempo_map, bar_index, from_bar,
+                                         n_timebase, *smf);
+        if (!smf_size)
+        {
+            delete[] *smf;
+            *smf = 0;
+            smf_size = -1;
+        }
+    }
+    else
+    {
+        smf_size = q1_transcode_smf(q1_data, q1_size, tempo_map, n_timebase, *smf);
+    }
+
+    delete[] q1_data;
+
+    return (smf_size);
+}
+
+
+// msqconvert's -q rules
+static short clamp_timebase(int n_timebase)
+{
+    if (n_timebase < 96)
+        n_timebase = 96;
+    else if (n_timebase > 960)
+        n_timebase = 960;
+    else if (n_timebase % 24)
+        n_timebase = 24 * (n_timebase / 24);
+
+    return (short) n_timebase;
+}
+
+
+static int convert_file(const char* src_name, short n_timebase, int from_bar)
+{
+    uint8_t* syx_data = 0;
+    uint8_t* smf_data = 0;
+    char path[4096];
+
+    size_t name_len = strlen(src_name);
+    if ( (name_len > 4) && !strcasecmp(src_name + name_len - 4, ".mid") )
+    {
+        fprintf(stderr, "msqfast converts .syx only, use msqconvert for %s\n", src_name);
+        return (1);
+    }
+    if ( (name_len > 4) && !strcasecmp(src_name + name_len - 4, ".syx") )
+        name_len -= 4;
+    if (name_len + 9 > sizeof(path))
+        return (1);
+
+    memcpy(path, src_name, name_len);
+    strcpy(path + name_len, ".syx");
+
+    const int syx_size = read_file(path, &syx_data);
+    if (syx_size < 0)
+    {
+        fprintf(stderr, "Couldn't open %s for reading\n", path);
+        return (1);
+    }
+
+    // the source's tempo map, if msqconvert saved one with the dump
+    MSQ_TempoMap tempo_map;
+    strcpy(path + name_len, ".tempo");
+    if ( !tempo_map.load(path) )
+        tempo_map.add_tempo(0, MSQ_TEMPO_MSQ_DEFAULT);
+    strcpy(path + name_len, ".bars");
+    char bars_path[4096];
+    strcpy(bars_path, path);
+    strcpy(path + name_len, ".syx");
+
+    const int smf_size = convert_dump(syx_data, syx_size, tempo_map, n_timebase, bars_path, from_bar, &smf_data);
+    delete[] syx_data;
+
+    if (!smf_size)
+    {
+        fprintf(stderr, "%s is not MSQ-100 SysEx\n", path);
+        return (1);
+    }
+    if (smf_size < 0)
+    {
+        fprintf(stderr, "%s has no bar %d\n", path, from_bar + 1);
+        return (1);
+    }
+
+    strcpy(path + name_len, "_qsm.mid");
+    const bool written = write_file(path, smf_data, smf_size);
+    delete[] smf_data;
+
+    if (!written)
+    {
+        fprintf(stderr, "Couldn't write %s\n", path);
+        return (1);
+    }
+
+    return (0);
+}
+
+
+static long elapsed_us(const struct timespec* t0, const struct timespec* t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1000000L + (t1->tv_nsec - t0->tv_nsec) / 1000L;
+}
+
+
+static int compare_us(const void* a, const void* b)
+{
+    const long d = *(const long*) a - *(const long*) b;
+
+    return (d > 0) - (d < 0);
+}
+
+
+//  Times whole runs, fork to exit, of this binary converting argv
+//  exits 1 when a run fails or the median is over budget
+//
+static int run_benchmark(int runs, char* argv[])
+{
+    long* run_us = new long[runs];
+    int failed = 0;
+
+    for (int r = 0; r < runs; r++)
+    {
+        struct timespec t0, t1;
+        int status = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execv("/proc/self/exe", argv);
+            _exit(127);
+        }
+        if ( (pid < 0) || (waitpid(pid, &status, 0) < 0) )
+        {
+            delete[] run_us;
+            return (1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        run_us[r] = elapsed_us(&t0, &t1);
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+            failed++;
+    }
+
+    qsort(run_us, runs, sizeof(long), compare_us);
+
+    const long median_us = run_us[runs / 2];
+    printf("%d runs: min %ld us, median %ld us, max %ld us, budget %d us - %s\n",
+           runs, run_us[0], median_us, run_us[runs - 1], FAST_BUDGET_US,
+           failed ? "FAILED" : ((median_us > FAST_BUDGET_US) ? "OVER" : "ok"));
+
+    delete[] run_us;
+
+    return ( (failed || (median_us > FAST_BUDGET_US)) ? 1 : 0 );
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* src_name = 0;
+    short n_timebase = 120;
+    int bench_runs = 0;
+    int from_bar = 1;
+    bool cmd_error = FALSE;
+
+    for (int ai = 1; (ai < argc) && !cmd_error; ai++)
+    {
+        if ( !strcmp(argv[ai], "-q") && (ai + 1 < argc) )
+            n_timebase = clamp_timebase(atoi(argv[++ai]));
+        else if ( !strcmp(argv[ai], "-a") && (ai + 1 < argc) )
+            from_bar = atoi(argv[++ai]);
+        else if ( !strcmp(argv[ai], "-B") && (ai + 1 < argc) )
+            bench_runs = atoi(argv[++ai]);
+        else if ( (argv[ai][0] != '-') && !src_name )
+            src_name = argv[ai];
+        else
+            cmd_error = TRUE;
+    }
+
+    if ( cmd_error || !src_name || (from_bar < 1) || (bench_runs < 0) || (bench_runs > FAST_MAX_BENCH_RUNS) )
+    {
+        usage();
+        return (2);
+    }
+
+    if (bench_runs)
+    {
+        // the runs get the same arguments, less -B
+        char** run_argv = new char*[argc + 1];
+        int n = 0;
+
+        for (int ai = 0; ai < argc; ai++)
+        {
+            if ( !strcmp(argv[ai], "-B") )
+                ai++;
+            else
+                run_argv[n++] = argv[ai];
+        }
+        run_argv[n] = 0;
+
+        const int result = run_benchmark(bench_runs, run_argv);
+        delete[] run_argv;
+
+        return (result);
+    }
+
+    return convert_file(src_name, n_timebase, from_bar - 1);
+}